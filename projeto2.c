@@ -6,33 +6,133 @@
  * Key Features:
  * 1. **Directory and File Management**:
  *    - Create directories (`criad <path/name>`).
- *    - Create files with specified sizes (`criaa <path/name> <size>`).
+ *    - Create files with specified sizes (`criaa <path/name> <size> [--prealloc]`). Files are sparse by default:
+ *      the size is recorded and the blocks form one hole extent, a write allocates zeroed blocks for the holes
+ *      it touches, and reads of holes return zeros. `--prealloc` allocates every block at creation.
  *    - Remove empty directories (`removed <path/name>`).
  *    - Remove files (`removea <path/name>`).
+ *    - Move or rename a file or directory (`move <src> <dst>`; into `dst` if it is an existing directory).
+ *      The entry is relinked under the new parent in O(1) plus the ancestor paths: data blocks, inodes and
+ *      the subtree stay in place, moving a directory under itself is refused, and the aggregates of the
+ *      old and new ancestors are adjusted.
+ *    - Import a real directory tree (`importa <host-dir> <path> [--esparso] [threads=N]`): worker threads read the
+ *      host tree with `openat`/`getdents64` (one `fstatat` per regular file for its size; links and special files
+ *      are skipped) and queue one batch per host directory, while the command thread inserts the batches with the
+ *      blocks of each one reserved in a single request and the aggregates updated once per batch. Files get their
+ *      real sizes and, unless `--esparso`, all of their blocks; contents are not copied.
+ *    - Each directory keeps a hash index of its children (by name and type), so path lookups
+ *      and duplicate checks are O(1) per component; the sibling list keeps the listing order.
+ *    - Bloco, Diretorio and Arquivo nodes come from type-specific slab pools with free lists, and
+ *      variable-size arrays from a size-class arena; `stats` shows allocation counts and pool occupancy.
+ *    - Bloco holds only the fields touched by tree walks (name pointer, hash, child/sibling links);
+ *      names are interned in a shared string arena and timestamps are 64-bit epoch values kept with
+ *      the other cold attributes in the file/directory content.
+ *    - All commands share one path resolver backed by an LRU cache of directory paths, so
+ *      repeated deep paths resolve with a single hash probe.
+ *    - `snapshot <name>` takes an O(1) copy-on-write snapshot of an in-memory tree and `rollback <name>` returns
+ *      to it. Directories and files are reference counted: changing a shared directory first copies it and
+ *      its ancestors (path copying), writing a shared file gives it its own extent list over the same blocks
+ *      (counted like deduplicated ones, so each write copies only the block it changes), and blocks go back to
+ *      the bitmap only when nothing references them. `snapshot` lists memory and blocks shared versus owned.
  *
  * 2. **Directory Listing and Tree Display**:
  *    - List the contents of a directory (`verd <path>`).
- *    - Display the directory tree structure (`arvore`).
+ *    - Every directory keeps direct and recursive aggregates (files, directories, bytes, blocks), updated
+ *      along the ancestor path on each create and remove and stored in the directory inode, so `du <path>`
+ *      and the `verd` totals are O(1).
+ *    - Find entries by name (`busca <pattern> [path]`): an exact name, a prefix (`abc*`) or a shell glob, printed
+ *      as absolute paths. A global name index, built by the first `busca` and then kept up to date by every create,
+ *      remove and move, maps each distinct name to its entries (hash lookup for exact names) and each trigram
+ *      to the names containing it, so globs only check names having all the pattern's literal trigrams.
+ *    - Display the directory tree structure (`arvore [path] [--profundidade N] [--dirs | --arquivos]`). Whole-tree
+ *      walks use a non-recursive pre-order iterator whose stack holds one entry per level, and the listing is
+ *      streamed through a large output buffer.
  *
- * 3. **Disk Space Management**:
- *    - Show the disk sector map (`mapa`), indicating free and occupied sectors.
- *    - Display the sectors occupied by a specific file (`verset <path/name>`).
+ * 3. **File Contents**:
+ *    - Write and read bytes of a file (`escreve <path/name> <offset> <text>`, `le <path/name> <offset> <length>`).
+ *    - All data goes through a fixed-size LRU buffer cache (`-c <buffers>`) with dirty tracking, read-ahead
+ *      for sequential reads and write-back on eviction or `sync`; `cache` reports hit rate, evictions and
+ *      bytes flushed. Read-ahead blocks enter at the midpoint of the LRU (the head of its older 3/8), so
+ *      prefetched blocks that are never read age out without pushing recently used ones out.
+ *    - `preenche <path/name> [text]` writes a whole file with a repeated pattern (or zeros). With `dedup on`
+ *      (or `-d`) each written block is fingerprinted and looked up in an index, and identical blocks
+ *      share one physical block with a reference count; writing a shared block copies it first and freeing
+ *      drops one reference. `dedup`, `mapa` and `verd` report logical versus physical usage and hashing time.
+ *    - With `-p` (tail packing) the last partial block of a file, or a whole file smaller than a block, goes to a
+ *      slice of a shared tail block instead of a block of its own. Tail blocks are cut into 64 slices and slice 0
+ *      holds the mask of used ones, so they describe themselves on disk; an emptied tail block is freed. `verd`
+ *      reports the slack bytes the listed files saved this way.
  *
- * 4. **File System Initialization**:
- *    - Simulate disk space with 256 blocks, where the first 10 blocks are reserved for boot/system data.
- *    - Track free and occupied blocks using an array (`blocosLivres`).
+ * 4. **Disk Space Management**:
+ *    - Show the disk sector map (`mapa`), indicating free and occupied sectors. `mapa [start [end]]` limits it to
+ *      a range, `--rle` prints one line per run of equal blocks (found a bitmap word at a time), `--zoom N`
+ *      shows one cell per N blocks with its fill level, and `--conferir` recounts the free blocks with a
+ *      popcount over the bitmap and checks them against the free counter and the summary level.
+ *    - Display the sectors occupied by a specific file (`verset <path/name>`), as compact ranges with the
+ *      holes of sparse files, and its logical versus allocated size; `verd` sums both for the listed files.
+ *    - Files are stored as arrays of (start, length) extents allocated in contiguous runs. There is no separate
+ *      free-extent index: the bitmap summary finds free runs, and a multi-block request under first-fit looks at
+ *      the next few free runs and takes the first that holds it whole (or the largest of them) before splitting.
+ *    - `frag` reports extents per file, the free-extent size histogram and the largest free run;
+ *      `defrag [budget]` moves fragmented files into contiguous runs, at most `budget` blocks per call (a file
+ *      that does not fit in what is left of the budget waits for a later call), so it can be interleaved with
+ *      other commands.
+ *    - `verifica [--reparar] [threads=N]` rebuilds the expected bitmap from the blocks of every entry (live tree
+ *      and snapshots, subtrees split across a pool of worker threads) and diffs it against the real one a word at
+ *      a time: occupied blocks nobody owns, owned blocks marked free, blocks with two owners, extents outside the
+ *      data area, overlapping tails, tail masks, the free counter and the summary level. `--reparar` fixes them:
+ *      entries get fresh blocks for shared or invalid ones, unowned blocks are freed, and the dedup reference
+ *      counts are recomputed.
  *
- * 5. **Command-Line Interface**:
+ * 5. **File System Initialization**:
+ *    - Simulate disk space with 256 blocks by default, where the first 10 blocks are reserved for boot/system data.
+ *    - Disk size and reserved block count can be changed at startup (`-b <blocos>` and `-r <reservados>`), and
+ *      so can the block size (`-t <bytes>`, a power of two from 512 B to 64 KiB, kept in the volume superblock).
+ *    - Track free and occupied blocks using a packed 64-bit bitmap (`blocosLivres`) plus a summary level
+ *      (`resumoLivres`) with one bit per bitmap word, so allocation stays near O(1) even on a nearly full disk.
+ *    - The block allocation policy is selectable (`-a <policy>` or `politica <policy>`): first-fit (default),
+ *      next-fit, best-fit, worst-fit and a binary buddy allocator that trims the unused tail of each chunk.
+ *      `alocacao` replays one create/delete trace at a high fill level under every policy and reports
+ *      allocation latency, failure rate, extents per file and free-space fragmentation.
+ *
+ * 6. **Persistent Volumes**:
+ *    - With `-i <imagem>` the disk lives in an image file (created and formatted on first use, `-n <inodes>`
+ *      sets the inode table size). The image holds a superblock, the allocation bitmap, a fixed-size
+ *      inode/directory-entry table and the data area, and is accessed through `mmap`: opening is instant
+ *      and directories are loaded lazily on first access. `sync` flushes the mapping with `msync`.
+ *    - With `-j` metadata changes go through a write-ahead journal (`<image>.diario`): each mutating command
+ *      is one transaction holding the bitmap, inode and extent blocks it touched, concurrent and batched
+ *      commands are grouped into one fsync (group commit), and complete transactions are replayed on the
+ *      next open, so a crash never leaves blocks allocated without an entry or an entry on freed blocks.
+ *      `diario` shows transactions, fsyncs and journal size.
+ *
+ * 7. **Command-Line Interface**:
  *    - Provide a shell-like interface for interacting with the file system.
  *    - Support commands such as `ajuda` (help) and `sair` (exit).
+ *    - Batch mode (`-s <script>`, or `-s -` for stdin) replays a command file without prompts: input is
+ *      read in large chunks and tokenized in place, commands are dispatched through a table, per-block
+ *      messages are suppressed, output is fully buffered and the run ends with a commands/second report.
+ *    - `bench` builds a synthetic tree (depth, fan-out, file size distribution) and runs a create/delete
+ *      mix through the real commands, reporting throughput, p50/p99/p999 latency per operation and peak RSS.
+ *      Files are created preallocated unless `criacao=esparsa`, and the tree is removed at the end of the run.
+ *
+ * 8. **Concurrency**:
+ *    - Commands are reentrant (per-thread argument list) and may run from several threads against one volume.
+ *    - Each directory has a reader-writer lock; paths are resolved by lock coupling from the root down, so
+ *      locks are always taken parent before child. Whole-volume commands (`arvore`, `mapa`, `sync`, ...)
+ *      take a volume lock exclusively, the others share it.
+ *    - The block bitmap is updated with atomic compare-and-swap, and each thread can start its search in
+ *      its own region of the disk, so creates in different directories do not serialize on the allocator.
+ *    - `estresse` runs a multi-threaded create/delete/read/write mix and then checks the tree, the bitmap,
+ *      the pools and every thread's own record of what it created.
  *
  * Functions to Implement:
  * - `inicializar_blocos`: Initialize the disk blocks, marking the first 10 as reserved.
  * - `alocar_bloco`: Allocate a free block from the disk.
  * - `liberar_bloco`: Free an allocated block.
- * - `obter_data_atual`: Get the current date and time for file/directory metadata.
+ * - `formatar_data`: Format a creation timestamp (stored as epoch seconds) when a listing is printed.
  * - `criad`: Create a new directory in the specified path.
- * - `criaa`: Create a new file in the specified path with allocated blocks.
+ * - `criaa`: Create a new file in the specified path, sparse or with its blocks preallocated.
  * - `removed`: Remove an empty directory.
  * - `removea`: Remove a file and free its allocated blocks.
  * - `verd`: List the contents of a directory, including files and subdirectories.
@@ -40,692 +140,8611 @@
  * - `mapa`: Show the disk sector map, marking free and occupied sectors.
  *
  * Usage:
- * Compile and run the program. Use commands like `criad`, `criaa`, `verd`, etc., to interact with the simulated file system. Type `ajuda` for a full list of commands.
+ * Compile with `-pthread` and run the program. Use commands like `criad`, `criaa`, `verd`, etc., to interact with the simulated file system. Type `ajuda` for a full list of commands.
  */
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
+typedef struct extensao {
+    long inicio;                /* BURACO num trecho ainda não escrito de um arquivo esparso */
+    long tamanho;
+} Extensao;
+
+#define BURACO (-1L)
+
+/* Atributos frios, comuns a arquivos e diretórios; só são lidos ao listar ou gravar no volume. */
+typedef struct atributos {
+    int64_t criado;     /* segundos desde a época */
+    long posicao;
+    int32_t ino;        /* inode no volume persistente, ou -1 */
+} Atributos;
+
 typedef struct arquivo {
-    struct arquivo *prox;
-    int posicao;
+    Atributos attr;
+    long tamanho;
+    long escritoAte;    /* bytes [escritoAte, tamanho) nunca foram escritos e são lidos como zero */
+    long proxLeitura;   /* onde a última leitura parou, para detectar acesso sequencial */
+    Extensao *ext;
+    int numExt;
+    int capExt;
+    long cauda;         /* bloco de caudas com o fim do arquivo, se caudaFatias > 0 (ver caudas) */
+    int16_t caudaFatia;
+    int16_t caudaFatias;
+    int fragmentado;    /* está na lista de arquivos com mais de uma extensão (ver defrag) */
+    int compartilhado;  /* entradas além da primeira que apontam para este arquivo (ver instantâneos) */
+    struct arquivo *antFrag;
+    struct arquivo *proxFrag;
 } Arquivo;
 
+/* Conteúdo de um diretório: entradas e bytes dos arquivos, e blocos de dados (um por subdiretório). */
+typedef struct uso {
+    int64_t arquivos;
+    int64_t diretorios;
+    int64_t bytes;
+    int64_t blocos;
+} Uso;
+
+/* Só os filhos diretos, e a subárvore inteira; mantidos a cada criação e remoção (ver agregados_somar). */
+typedef struct agregados {
+    Uso direto;
+    Uso total;
+} Agregados;
+
+/*
+ * Índice de um diretório: tabela hash encadeada (por Bloco.proxHash) com os
+ * filhos, chaveada por nome e tipo. A lista filho/prox continua sendo a ordem
+ * de listagem; a tabela só acelera a busca.
+ */
+typedef struct diretorio {
+    Atributos attr;
+    struct bloco **tabela;
+    unsigned capTabela;
+    unsigned numFilhos;
+    int carregado;      /* 0 = filhos ainda só na tabela de inodes do volume */
+    pthread_rwlock_t trava;     /* protege a tabela, a lista de filhos e os atributos dos filhos */
+    int compartilhado;  /* entradas além da primeira que apontam para este diretório (ver instantâneos) */
+    struct bloco *pai;  /* NULL na raiz */
+    Agregados *agregados;       /* no inode do diretório se ele está no volume, senão em 'proprios' */
+    Agregados proprios;
+} Diretorio;
+
+/*
+ * Entrada da árvore. Só tem os campos usados ao percorrer e buscar (cabe numa
+ * linha de cache); o resto fica no Arquivo ou no Diretorio. arq == NULL
+ * indica diretório.
+ */
 typedef struct bloco {
-    char nome[100];
-    int tamanho;
-    char data[20];
+    const char *nome;   /* nome internado, ver nome_internar */
+    unsigned hash;
     Arquivo *arq;
-    int posicao;
+    Diretorio *dir;
     struct bloco *prox;
+    struct bloco *ant;
     struct bloco *filho;
+    struct bloco *proxHash;
 } Bloco;
 
-int blocosLivres[256];
-int espacosLivres = 256 - 10;
+#define MAX_NOME 100
+#define SAL_DIR 0x9e3779b9u    /* misturado ao hash do nome para separar diretório e arquivo homônimos */
+
+/* Nome guardado uma única vez na arena de nomes, com contagem de referências. */
+typedef struct nomeInterno {
+    struct nomeInterno *prox;
+    unsigned hash;
+    uint32_t refs;
+    uint16_t tamanho;
+    char texto[];
+} NomeInterno;
+
+_Static_assert(sizeof(Bloco) <= 64, "Bloco deve caber numa linha de cache");
+
+#define MAGICO_VOLUME 0x32534f4du
+#define VERSAO_VOLUME 3
+#define TIPO_DIR 1
+#define TIPO_ARQ 2
+#define EXT_INODE 5
+#define EXT_POR_BLOCO 31
+#define TAM_BLOCO_MIN 512           /* blocos de extensões e o diário usam só os primeiros TAM_BLOCO_MIN bytes */
+#define TAM_BLOCO_MAX (64 * 1024)
+
+typedef struct superbloco {
+    uint32_t magico;
+    uint32_t versao;
+    int64_t totalBlocos;
+    int64_t blocosReservados;
+    int64_t espacosLivres;
+    int64_t offBitmap;
+    int64_t offResumo;
+    int64_t offInodes;
+    int32_t numInodes;
+    int32_t proximoInode;   /* inodes [0, proximoInode) já foram usados alguma vez */
+    int32_t inodeLivre;     /* lista de inodes liberados, encadeada por 'prox' */
+    int32_t limpo;          /* 1 = fechado com sync; senão espacosLivres é recontado */
+    int32_t tamBloco;       /* 0 = TAM_BLOCO_MIN (imagens de antes do -t) */
+} Superbloco;
+
+/* Entrada da tabela de inodes; pai/filho/prox/ant são índices na tabela (-1 = nenhum). */
+typedef struct inodeDisco {
+    int64_t tamanho;
+    int64_t criado;
+    int64_t posicao;
+    int64_t extIndireto;    /* bloco com as extensões além das EXT_INODE primeiras, ou -1 */
+    int64_t escritoAte;
+    int32_t pai, filho, prox, ant;
+    int32_t numExt;
+    uint8_t tipo;
+    char nome[100];
+    uint8_t caudaFatia;     /* arquivo com caudaFatias > 0: fatias [caudaFatia, caudaFatia + caudaFatias) de 'cauda' */
+    uint8_t caudaFatias;
+    uint8_t reservado[5];
+    int64_t cauda;
+    union {
+        Extensao ext[EXT_INODE];    /* arquivo */
+        Agregados agregados;        /* diretório */
+    };
+} InodeDisco;
+
+typedef struct blocoExtensoes {
+    int64_t prox;
+    int32_t num;
+    int32_t reservado;
+    Extensao ext[EXT_POR_BLOCO];
+} BlocoExtensoes;
+
+_Static_assert(sizeof(InodeDisco) == 256, "InodeDisco deve ter 256 bytes");
+_Static_assert(sizeof(BlocoExtensoes) == TAM_BLOCO_MIN, "BlocoExtensoes deve ocupar o menor bloco");
+
+#define TAM_SLAB (64 * 1024)
+#define TAM_MIN_CLASSE 32
+#define NUM_CLASSES 12
+#define TAM_MAX_CLASSE (TAM_MIN_CLASSE << (NUM_CLASSES - 1))
+
+typedef struct slab {
+    struct slab *prox;
+    void *reservado;    /* mantém os objetos alinhados em 16 bytes */
+} Slab;
+
+typedef struct pool {
+    const char *nome;
+    size_t tamObjeto;
+    size_t objetosPorSlab;
+    void *livres;       /* lista livre encadeada pela primeira palavra de cada objeto */
+    Slab *slabs;
+    long numSlabs;
+    long emUso;
+    long alocacoes;
+    long liberacoes;
+    pthread_mutex_t trava;
+} Pool;
+
+/* Alocação acima de TAM_MAX_CLASSE, feita pelo malloc mas listada para a liberação em bloco. */
+typedef struct grande {
+    struct grande *prox;
+    struct grande *ant;
+} Grande;
+
+Pool poolBlocos, poolDiretorios, poolArquivos;
+Pool classesArena[NUM_CLASSES];
+Grande *grandes;
+pthread_mutex_t travaGrandes = PTHREAD_MUTEX_INITIALIZER;
+
+NomeInterno **tabelaNomes;
+unsigned capNomes, numNomes;
+pthread_mutex_t travaNomes = PTHREAD_MUTEX_INITIALIZER;
+
+#define BUFFERS_PADRAO 256
+#define JANELA_LEITURA 8
+
+typedef struct buffer {
+    long bloco;             /* bloco físico guardado, ou -1 */
+    int sujo;
+    int antecipado;         /* trazido pela leitura antecipada e ainda não usado */
+    int velho;              /* na parte antiga da LRU, de meioLRU até buffersLRU */
+    unsigned char *dados;
+    struct buffer *proxHash;
+    struct buffer *antLRU;
+    struct buffer *proxLRU;
+} Buffer;
+
+typedef struct estatisticasBuffers {
+    long acertos;
+    long faltas;
+    long expulsoes;
+    long bytesGravados;
+    long antecipados;
+    long acertosAntecipados;
+} EstatisticasBuffers;
+
+unsigned char *dispositivo;     /* bloco n em dispositivo + n * tamBloco */
+Buffer *buffers;
+unsigned char *memoriaBuffers;
+Buffer **hashBuffers;
+unsigned capHashBuffers;
+int numBuffers;
+Buffer *buffersMRU, *buffersLRU;
+Buffer *meioLRU;                /* primeiro buffer da parte antiga (os 3/8 do lado menos recente) */
+int numVelhos;
+EstatisticasBuffers statsBuffers;
+pthread_mutex_t travaBuffers = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Deduplicação: com o dedup ligado, cada bloco gravado tem uma impressão do
+ * conteúdo num índice (tabela encadeada pelos próprios números de bloco) e
+ * blocos iguais viram um só, com contagem de referências. Os vetores são
+ * criados quando o dedup é ligado pela primeira vez e ficam até o fim:
+ * desligado, ele só deixa de procurar iguais, mas as contagens continuam
+ * valendo para escritas e liberações.
+ */
+#define FORA_INDICE (-2)
+uint32_t *refsBlocos;       /* referências além da primeira a cada bloco; NULL = dedup nunca ligado */
+uint64_t *impressaoBloco;
+long *proxImpressao;        /* próximo bloco na mesma posição da tabela, -1 no fim ou FORA_INDICE */
+long *tabelaImpressoes;
+long capImpressoes;
+int dedupAtivo;
+long blocosEconomizados;    /* soma de refsBlocos */
+long dedupHashes, dedupAcertos, dedupCopias, nsHash;
+pthread_mutex_t travaDedup = PTHREAD_MUTEX_INITIALIZER;
+
+long totalBlocos = 256;
+long blocosReservados = 10;
+long espacosLivres = 256 - 10;
+long tamBloco = TAM_BLOCO_MIN;     /* bytes por bloco (-t); num volume vem do superbloco */
+
+/* Bitmap de blocos: bit i = 1 se o bloco i está livre. */
+uint64_t *blocosLivres;
+long numPalavras;
+/* Resumo: bit w = 1 se a palavra w de blocosLivres tem algum bloco livre. */
+uint64_t *resumoLivres;
+long numResumo;
+/* No x86-64 as contagens do bitmap ganham uma versão com a instrução popcnt, escolhida ao carregar o programa. */
+#if defined(__x86_64__)
+#define VERSOES_POPCOUNT __attribute__((target_clones("popcnt", "default")))
+#else
+#define VERSOES_POPCOUNT
+#endif
+/*
+ * Política de alocação de blocos (ver 'politicas'). alocar devolve uma
+ * sequência de até 'desejado' blocos já tomada do bitmap (com 'exato', só
+ * uma de exatamente 'desejado' blocos, ou 0); liberar é avisada depois que
+ * blocos voltam ao bitmap; iniciar monta o estado próprio da política a
+ * partir do bitmap.
+ */
+typedef struct politicaAlocacao {
+    const char *nome;
+    long (*alocar)(long desejado, int exato, long *inicio);
+    void (*liberar)(long inicio, long tamanho);
+    void (*iniciar)();
+    void (*encerrar)();
+} PoliticaAlocacao;
+
+#define AJUSTE_PRIMEIRO 0
+#define AJUSTE_PROXIMO 1
+#define AJUSTE_MELHOR 2
+#define AJUSTE_PIOR 3
+#define SONDAGEM_CORRIDAS 8     /* sequências livres que o first-fit olha antes de partir um pedido */
+#define ORDENS_BUDDY 40
+
+/* Onde a próxima busca do next-fit começa. */
+long cursorProximo;
+/* Buddy: ordem do pedaço livre que começa em cada bloco (-1 = nenhum) e listas duplamente encadeadas por ordem. */
+int8_t *ordemBuddy;
+long *proximoBuddy, *anteriorBuddy;
+long listasBuddy[ORDENS_BUDDY];
+pthread_mutex_t travaBuddy = PTHREAD_MUTEX_INITIALIZER;
+
+/* Arquivos com mais de uma extensão, na ordem em que ficaram fragmentados; defrag consome pelo início. */
+#define ORCAMENTO_DEFRAG 1024
+Arquivo *fragInicio, *fragFim;
+long numFragmentados;
+pthread_mutex_t travaFrag = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Caudas (-p): o fim de um arquivo que não enche um bloco fica numa fatia
+ * de um bloco de caudas dividido em FATIAS_CAUDA fatias de tamBloco /
+ * FATIAS_CAUDA bytes. A fatia 0 guarda a máscara das ocupadas, então o
+ * bloco se descreve sozinho no volume. Os blocos com fatias livres que
+ * conhecemos ficam numa lista curta, onde as próximas caudas são
+ * procuradas; um bloco que esvazia volta ao bitmap.
+ */
+#define FATIAS_CAUDA 64
+#define MAX_CAUDAS_ABERTAS 16
+int caudasAtivas;
+long caudasAbertas[MAX_CAUDAS_ABERTAS];
+int numCaudasAbertas;
+pthread_mutex_t travaCaudas = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Verificação (fsck, ver verifica): trabalhadores tiram diretórios de uma
+ * pilha comum, marcam num bitmap próprio cada bloco que as entradas deles
+ * usam e devolvem os subdiretórios à pilha. O bitmap esperado é depois
+ * comparado com blocosLivres palavra a palavra.
+ */
+#define MAX_FAIXAS_VERIFICA 8
+
+/* Blocos de um tipo de problema: o total e as primeiras faixas, para mostrar. */
+typedef struct faixas {
+    long total;
+    int num;
+    Extensao faixa[MAX_FAIXAS_VERIFICA];
+} Faixas;
+
+typedef struct verificacao {
+    uint64_t *vistos;       /* bit por bloco: alguma entrada o usa */
+    uint64_t *repetidos;    /* ...e mais de uma */
+    uint32_t *donos;        /* com dedup: quantas entradas usam cada bloco */
+    uint64_t *fatias;       /* fatias de cauda usadas em cada bloco */
+    long blocosCauda;       /* blocos com alguma fatia marcada */
+    long sobrepostas;       /* caudas que dividem uma fatia com outra */
+    void **compartilhados;  /* Arquivo/Diretorio com compartilhado > 0 já vistos (endereçamento aberto) */
+    long capCompartilhados, numCompartilhados;
+    Bloco **pilha;          /* diretórios ainda por abrir */
+    long topo, capPilha;
+    int ativos;             /* trabalhadores com um diretório em mãos */
+    int erro;
+    int reparando;          /* o percurso corrige donos em vez de só marcar (ver verifica_reparar) */
+    long diretorios, arquivos, extensoes, realocados;
+    Faixas foraDoDisco;     /* extensões com blocos reservados ou além do fim */
+    char exemploFora[MAX_NOME];
+    pthread_mutex_t trava;
+    pthread_cond_t temTrabalho;
+} Verificacao;
+
+/* Liberações de blocos que já estavam livres; não deviam acontecer e o 'verifica' as mostra. */
+long liberacoesInvalidas;
+
+/* Sequências de blocos pedidas ao alocador de uma vez e repartidas depois, na ordem (ver importa). */
+typedef struct reserva {
+    Extensao *seq;
+    int num, cap, atual;
+    long usado;             /* blocos de seq[atual] já repartidos */
+} Reserva;
+
+/*
+ * Importação de uma árvore do hospedeiro (ver importa). Trabalhadores tiram
+ * diretórios do hospedeiro de uma pilha comum, leem as entradas com
+ * getdents64 e entregam cada diretório lido como um lote numa fila; a
+ * thread do comando insere os lotes na árvore na ordem da fila, com os
+ * blocos do lote pedidos de uma vez. Um subdiretório só vai para a pilha
+ * depois que o lote do pai entrou na fila, então o diretório dele já
+ * existe na árvore quando o lote dele é inserido.
+ */
+#define TAM_LEITURA_IMPORTA (64 * 1024)
+
+/* Entrada como getdents64 a devolve. */
+typedef struct entradaHospedeiro {
+    uint64_t ino;
+    int64_t proxima;
+    unsigned short tamanho;
+    unsigned char tipo;
+    char nome[];
+} EntradaHospedeiro;
+
+typedef struct itemImporta {
+    size_t nome;            /* posição do nome em 'nomes' do lote */
+    int32_t dir;            /* id do subdiretório, ou -1 num arquivo */
+    long tamanho;
+} ItemImporta;
+
+typedef struct loteImporta {
+    struct loteImporta *prox;
+    int32_t dir;            /* id do diretório lido */
+    long num, cap;
+    ItemImporta *itens;
+    char *nomes;
+    size_t tamNomes, capNomes;
+} LoteImporta;
+
+typedef struct pendenteImporta {
+    char *caminho;          /* relativo ao diretório importado ("" é ele mesmo) */
+    int32_t id;
+} PendenteImporta;
+
+typedef struct importacao {
+    int raiz;               /* descritor do diretório importado, base dos openat */
+    PendenteImporta *pilha; /* diretórios do hospedeiro ainda por ler */
+    long topo, capPilha;
+    int ativos;             /* trabalhadores com um diretório em mãos */
+    int trabalhadores;      /* ainda rodando; sem eles e com a fila vazia, acabou */
+    int32_t proximoId;
+    LoteImporta *fila, *filaFim;
+    int parar;              /* falha: os trabalhadores largam o que falta e os lotes são descartados */
+    long ignorados;         /* links simbólicos, dispositivos, nomes longos demais */
+    long ilegiveis;         /* diretórios ou entradas que o hospedeiro não deixou ler */
+    pthread_mutex_t trava;
+    pthread_cond_t temTrabalho, temLote;
+    /* Só da thread que insere: */
+    Bloco **destinos;       /* diretório da árvore de cada id (NULL se não foi criado) */
+    long capDestinos;
+    Reserva reserva;
+    int prealocar;
+    long dirs, arquivos, bytes, blocos, existentes;
+} Importacao;
+/*
+ * Percurso da árvore em pré-ordem sem recursão: a pilha guarda, por nível,
+ * a próxima entrada a visitar, então a memória é proporcional à
+ * profundidade e não ao número de entradas. Não trava diretórios: só para
+ * comandos que têm o volume exclusivo.
+ */
+#define PILHA_PERCURSO 64
+typedef struct percurso {
+    Bloco **pilha;
+    int topo;
+    int cap;
+    int maxNivel;       /* não desce abaixo deste nível; -1 = sem limite */
+    int erro;           /* a pilha não pôde crescer; o percurso terminou antes */
+} Percurso;
+
+/* Saída acumulada em blocos grandes, para listagens longas não pagarem um printf por linha. */
+#define TAM_ESCRITOR (64 * 1024)
+typedef struct escritor {
+    size_t usado;
+    char buf[TAM_ESCRITOR];
+} Escritor;
+
+/*
+ * Instantâneos: cada um guarda só uma entrada de raiz apontando para o
+ * diretório raiz da época, que passa a ser compartilhado. Um diretório ou
+ * arquivo compartilhado é imutável; quem precisa alterá-lo faz uma cópia
+ * própria antes (ver resolver_copiando e arquivo_copiar).
+ */
+typedef struct instantaneo {
+    char nome[MAX_NOME];
+    Bloco *raiz;
+    int64_t criado;
+    struct instantaneo *prox;
+} Instantaneo;
+Instantaneo *instantaneos;
+int numInstantaneos;
+long dirsCopiados, arquivosCopiados;
+
+/*
+ * Índice global de nomes (ver busca): montado pelo primeiro 'busca' e
+ * mantido depois a cada criação, remoção e movimentação. Cada nome
+ * distinto tem um registro com a lista das entradas que o usam; 'porNome'
+ * acha um nome exato e os trigramas acham os nomes que contêm um trecho.
+ * As entradas são chaveadas pelo conteúdo (Arquivo ou Diretorio), que não
+ * muda quando um instantâneo faz o diretório pai ganhar entradas novas.
+ * Um nome que fica sem entradas continua no índice, porque as listas de
+ * trigramas só crescem, até a próxima remontagem.
+ */
+#define TRIGRAMA_INICIO '\x01'  /* antes do nome: trigramas do começo servem ao prefixo */
+#define TRIGRAMA_FIM '\x02'
+
+typedef struct entradaBusca {
+    void *chave;        /* Arquivo ou Diretorio da entrada; NULL = vaga, encadeada por 'prox' */
+    Diretorio *pai;
+    int32_t nome;       /* em indice.nomes */
+    int32_t ant, prox;  /* entradas com o mesmo nome */
+    int32_t proxChave;  /* encadeamento de 'porChave' */
+    int32_t ehDir;
+} EntradaBusca;
+
+typedef struct nomeBusca {
+    char *texto;
+    unsigned hash;
+    int32_t proxHash;
+    int32_t primeira;   /* primeira entrada com este nome, ou -1 */
+    int32_t numEntradas;
+} NomeBusca;
+
+typedef struct trigrama {
+    uint32_t chave;     /* os três bytes; 0 = posição vazia */
+    uint32_t num, cap;
+    int32_t *nomes;     /* crescente: um nome novo sempre tem o maior índice até então */
+} Trigrama;
+
+typedef struct indiceBusca {
+    int montado;
+    EntradaBusca *entradas;
+    int32_t numEntradas, capEntradas, vagas, emUso;
+    int32_t *porChave;
+    unsigned capPorChave;
+    NomeBusca *nomes;
+    int32_t numNomes, capNomes, nomesVivos;
+    int32_t *porNome;
+    unsigned capPorNome;
+    Trigrama *trigramas;    /* endereçamento aberto */
+    unsigned capTrigramas, numTrigramas;
+    pthread_mutex_t trava;
+} IndiceBusca;
+
+IndiceBusca indice = {.vagas = -1, .trava = PTHREAD_MUTEX_INITIALIZER};
+
+/* Menor palavra de resumo que pode ter blocos livres (acelera o first-fit). */
+long dicaResumo;
+/* Palavra do bitmap onde esta thread começa a procurar, ou -1 para usar dicaResumo (ver alocar_extensao). */
+_Thread_local long palavraLocal = -1;
+
 Bloco *raiz;
 
-char in[256], in_bkp[256], argumentos[256];
-char **argList;
-char **dirList;
+int fdVolume = -1;
+unsigned char *mapaVolume;
+size_t tamMapa;
+Superbloco *super;
+InodeDisco *inodes;
+pthread_mutex_t travaInodes = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t travaCarga = PTHREAD_MUTEX_INITIALIZER;
+
+/* Diário de metadados (ver diario_confirmar_travado): um cabeçalho e, para cada transação, descritor + blocos + confirmação. */
+#define MAGICO_DIARIO 0x4f495244u
+#define VERSAO_DIARIO 1
+#define REG_DESCRITOR 1
+#define REG_CONFIRMACAO 2
+#define TAM_MAX_DIARIO (8L << 20)       /* passado disso o diário é esvaziado num checkpoint completo */
+#define LIMITE_SUJOS_LOTE 4096          /* sem espera, confirma quando a transação acumula tantos blocos */
+
+typedef struct registroDiario {
+    uint32_t magico;
+    uint32_t tipo;
+    int64_t seq;
+    int64_t numBlocos;
+    uint64_t soma;      /* na confirmação: FNV-1a da lista de blocos e das imagens */
+} RegistroDiario;
+
+typedef struct diario {
+    int fd;
+    off_t fim;              /* onde a próxima transação é gravada */
+    int64_t seq;            /* número da próxima transação no arquivo */
+    uint64_t *marcados;     /* bit por bloco do volume: já anotado na transação em curso */
+    long *sujos;
+    long numSujos, capSujos;
+    unsigned char *buffer;
+    size_t capBuffer;
+    long atual;             /* transação em curso; as operações abertas entram nela */
+    long confirmada;        /* última transação durável */
+    int ativas;             /* operações abertas na transação em curso */
+    int fechando;
+    int gravando;
+    pthread_mutex_t trava;
+    pthread_cond_t aberta, drenada, concluida;
+    long operacoes;         /* comandos registrados */
+    long confirmacoes;      /* transações gravadas, cada uma com um fsync */
+    long blocosRegistrados;
+    long checkpoints;
+    long dadosDuraveis;     /* statsBuffers.bytesGravados no último fdatasync da imagem */
+} Diario;
+
+Diario diario = {.fd = -1, .atual = 1, .trava = PTHREAD_MUTEX_INITIALIZER, .aberta = PTHREAD_COND_INITIALIZER,
+                 .drenada = PTHREAD_COND_INITIALIZER, .concluida = PTHREAD_COND_INITIALIZER};
+int diarioAtivo;
+int esperarDiario = 1;  /* 0 = os comandos não esperam a confirmação, que sai agrupada (modo lote) */
+
+/*
+ * Ordem das travas: travaVolume, depois as travas de diretório de cima para
+ * baixo (pai antes do filho). travaCache só é pedida com tentativa
+ * (trylock) sobre diretórios; travaCarga, travaNomes, travaInodes, travaCaudas,
+ * travaDedup, travaBuffers, travaGrandes, travaFrag, travaBuddy, diario.trava,
+ * indice.trava e as travas dos pools são folhas ou só pedem travas depois
+ * delas nesta mesma lista. A espera pela confirmação do diário é feita sem
+ * nenhuma outra trava.
+ */
+pthread_rwlock_t travaVolume = PTHREAD_RWLOCK_INITIALIZER;
+
+#define MAX_ARGS 32
+#define TAM_LOTE (1 << 20)
+
+_Thread_local char **argList;
+int verboso = 1;    /* 0 = sem as mensagens por bloco alocado/liberado (modo lote) */
+
+/* Como o comando usa travaVolume. */
+#define VOLUME_COMPARTILHADO 0
+#define VOLUME_EXCLUSIVO 1
+#define VOLUME_LIVRE 2      /* não trava; o próprio comando executa outros por executar_comando */
+
+typedef struct comando {
+    const char *nome;
+    void (*executar)();
+    int trava;
+    int altera;         /* 1 = altera o volume: é uma operação do diário */
+} Comando;
+
+#define MAX_CAMINHO 256
+#define TAM_CACHE_CAMINHOS 4096
+
+/*
+ * Cache de caminhos (dentry cache): associa o caminho normalizado de um
+ * diretório ao seu Bloco. As entradas ficam numa tabela hash e numa lista LRU;
+ * quando o cache enche, a menos usada é reaproveitada.
+ */
+typedef struct entradaCache {
+    char caminho[MAX_CAMINHO];
+    unsigned hash;
+    Bloco *no;
+    struct entradaCache *proxHash;
+    struct entradaCache *antLRU;
+    struct entradaCache *proxLRU;
+} EntradaCache;
+
+EntradaCache entradasCache[TAM_CACHE_CAMINHOS];
+EntradaCache *tabelaCache[TAM_CACHE_CAMINHOS * 2];
+EntradaCache *lruInicio, *lruFim;
+EntradaCache *vagasCache;
+int numEntradasCache;
+pthread_mutex_t travaCache = PTHREAD_MUTEX_INITIALIZER;
 
 void inicializar_blocos();
-char* obter_data_atual();
+void formatar_bitmap();
+void formatar_data(int64_t t, char *destino);
 char* substituir_string(const char *string, const char *search, const char *replacement);
-void liberar_bloco(int i);
-int alocar_bloco();
+int bloco_livre(long i);
+void liberar_bloco(long i);
+long alocar_bloco();
+uint64_t mascara_bits(int b, int n);
+void resumo_esvaziou(long w);
+void dica_baixar(long r);
+int palavra_tomar(long w, int b, long maximo, int *bit);
+long alocar_extensao(long desejado, long *inicio);
+void liberar_extensao(long inicio, long tamanho);
+void extensao_devolver(long inicio, long tamanho);
+long alocar_primeiro(long desejado, int exato, long *inicio);
+void bitmap_devolver(long inicio, long tamanho);
+long corrida_livre(long de, long maximo, long *inicio);
+long alocar_contiguo(long tamanho);
+long reserva_pedir(Reserva *r, long n);
+long reserva_tirar(Reserva *r, long n, long *inicio);
+void reserva_devolver(Reserva *r);
+long tomar_corrida(long inicio, long n);
+long alocar_varrendo(long desejado, int exato, long *inicio, int modo);
+long alocar_proximo(long desejado, int exato, long *inicio);
+long alocar_melhor(long desejado, int exato, long *inicio);
+long alocar_pior(long desejado, int exato, long *inicio);
+void buddy_tirar(long i);
+void buddy_por(long i, int k);
+void buddy_fundir(long i, int k);
+void buddy_faixa(long inicio, long n);
+void buddy_iniciar();
+void buddy_encerrar();
+long buddy_alocar(long desejado, int exato, long *inicio);
+void buddy_liberar(long inicio, long tamanho);
+PoliticaAlocacao* politica_buscar(const char *nome);
+void politica_trocar(PoliticaAlocacao *p);
+void politica_cmd();
+void pool_iniciar(Pool *p, const char *nome, size_t tamObjeto);
+void* pool_alocar(Pool *p);
+void pool_liberar(Pool *p, void *obj);
+void pool_destruir(Pool *p);
+int classe_arena(size_t tam);
+void* arena_alocar(size_t tam);
+void arena_liberar(void *ptr, size_t tam);
+void* arena_realocar(void *ptr, size_t tamAntigo, size_t tamNovo);
+void iniciar_memoria();
+void liberar_memoria();
+void imprimir_pool(Pool *p);
+void stats();
+const char* nome_internar(const char *nome);
+void nome_soltar(const char *nome);
+Atributos* atributos(Bloco *b);
+int extensao_emenda(Extensao *ultima, long inicio);
+int arquivo_adicionar_extensao(Arquivo *arq, long inicio, long tamanho);
+int arquivo_fragmentado(Arquivo *arq);
+void frag_atualizar(Arquivo *arq);
+long arquivo_posicao(Arquivo *arq);
+void arquivo_liberar(Arquivo *arq);
+void frag_ligar(Arquivo *arq);
+void frag_desligar(Arquivo *arq);
+unsigned hash_nome(const char *nome, int ehDir);
+Diretorio* dir_criar();
+int dir_crescer(Diretorio *d);
+void dir_destruir(Diretorio *d);
+Bloco* dir_buscar(Bloco *pai, const char *nome, int ehDir);
+int dir_inserir(Bloco *pai, Bloco *novo);
+int dir_ligar(Bloco *pai, Bloco *novo);
+void agregados_somar(Bloco *d, Uso u, int sinal);
+void agregados_subir(Bloco *d, Uso u, int sinal);
+long arquivo_blocos(Arquivo *arq);
+long arquivo_blocos_logicos(Arquivo *arq);
+long arquivo_bytes_alocados(Arquivo *arq);
+void dir_remover(Bloco *pai, Bloco *alvo);
+void dir_travar(Bloco *b, int escrita);
+int dir_tentar_travar(Bloco *b, int escrita);
+void dir_destravar(Bloco *b);
+void normalizar_caminho(char *caminho);
+EntradaCache* cache_buscar(const char *caminho, unsigned h);
+void cache_desligar_lru(EntradaCache *e);
+void cache_ligar_lru(EntradaCache *e);
+void cache_desligar_hash(EntradaCache *e);
+void cache_inserir(const char *caminho, unsigned h, Bloco *no);
+void cache_invalidar(const char *caminho);
+void cache_invalidar_filhos(Bloco *b);
+void cache_limpar();
+Bloco* resolver_dir(char *caminho, int escrita);
+Bloco* resolver_copiando(const char *caminho);
+Bloco* resolver_pai(char *caminho, char **nome, int escrita);
+int tam_bloco_valido(long tam);
+int volume_calcular_layout(Superbloco *sb);
+void volume_apontar();
+int volume_abrir(const char *caminho, int numInodes, int comDiario);
+int volume_gravar_metadados(long blocos);
+void volume_sincronizar();
+void volume_fechar();
+int32_t inode_alocar();
+void inode_liberar(int32_t ino);
+void inode_liberar_indiretos(InodeDisco *n);
+int inode_gravar_extensoes(InodeDisco *n, Arquivo *arq);
+void inode_ligar(int32_t pai, int32_t ino);
+void inode_desligar(int32_t pai, int32_t ino);
+int volume_registrar(Bloco *pai, Bloco *b);
+void volume_desregistrar(Bloco *pai, Bloco *b);
+void volume_mover(Bloco *pai, Bloco *destino, Bloco *b);
+Bloco* volume_materializar(int32_t ino);
+void dir_carregar(Bloco *d);
+void dir_carregar_filhos(Bloco *d);
+void sincronizar();
+uint64_t soma_fnv(uint64_t h, const void *dados, size_t n);
+int gravar_em(int fd, const void *dados, size_t n, off_t off);
+int diario_zerar(int fd, int64_t seq);
+long diario_recuperar(int fdImagem, const char *caminho);
+int diario_abrir(const char *caminho);
+void diario_fechar();
+void diario_sujar(const void *ptr, size_t len);
+long diario_iniciar();
+void diario_terminar();
+void diario_confirmar_travado();
+void diario_esperar(long tid);
+void diario_concluir(long tid);
+void diario_forcar();
+void diario_info();
+int buffers_iniciar(int quantidade);
+void buf_desligar_lru(Buffer *b);
+void buf_ligar_lru(Buffer *b, int recente);
+void buf_ligar_meio(Buffer *b);
+void buf_equilibrar_lru();
+Buffer* buf_procurar(long bloco);
+void buf_desligar_hash(Buffer *b);
+void buf_gravar(Buffer *b);
+Buffer* buf_reciclar(long bloco);
+Buffer* buf_obter(long bloco, int ler);
+void buf_antecipar(long bloco);
+void buf_descartar(long inicio, long tamanho);
+void buf_sincronizar();
+long arquivo_bloco_fisico(Arquivo *arq, long k);
+long arquivo_preencher(Arquivo *arq, long primeiro, long ultimo);
+int arquivo_transferir(Arquivo *arq, long offset, unsigned char *dados, long n, int escrita);
+int arquivo_zerar(Arquivo *arq, long offset, long n);
+int cauda_fatias(long bytes);
+int cauda_encaixar(uint64_t ocupadas, int n);
+void cauda_abrir(long bloco);
+int cauda_alocar(Arquivo *arq, int fatias);
+void cauda_liberar(Arquivo *arq);
+void cauda_transferir(Arquivo *arq, long offset, unsigned char *dados, long n, int escrita);
+long cauda_folga(Arquivo *arq);
+uint64_t impressao_bloco(const unsigned char *dados);
+int dedup_ligar();
+long dedup_buscar(uint64_t h, const unsigned char *dados);
+void dedup_indexar(long b, uint64_t h);
+void dedup_desindexar(long b);
+void dedup_soltar_travado(long b);
+void dedup_liberar(long inicio, long tamanho);
+void bloco_gravar(long b, const unsigned char *dados);
+int dedup_gravar(Arquivo *arq, long offset, const unsigned char *dados, long n);
+void extensao_juntar(Extensao *v, int *n, long inicio, long tamanho);
+int arquivo_remapear(Arquivo *arq, long k, long novo);
+int arquivo_compartilha_blocos(Arquivo *arq);
+long arquivo_blocos_compartilhados(Arquivo *arq);
+double arquivo_fisicos(Arquivo *arq);
+void dedup();
+void preenche();
+unsigned hash_ponteiro(const void *p);
+int32_t busca_entrada(void *chave);
+int32_t busca_nome(const char *texto, int criar);
+Trigrama* trigrama_buscar(uint32_t chave, int criar);
+int busca_ligar(void *chave, Diretorio *pai, const char *nome, int ehDir);
+void busca_desligar(int32_t e);
+int busca_montar();
+void busca_descartar();
+void busca_inserir(Bloco *pai, Bloco *b);
+void busca_remover(Bloco *b);
+void busca_trocar(void *velha, void *nova);
+void busca_copiou_dir(Diretorio *velho, Bloco *b);
+int busca_dentro(EntradaBusca *e, Diretorio *escopo);
+int busca_caminho(EntradaBusca *e, char *destino, size_t tam);
+long busca_candidatos(const char *padrao, int32_t **saida);
+void busca();
+Bloco* resolver_arquivo(char *caminho, int escrita, Bloco **pai);
+void escreve();
+void le();
+void cache();
 void criad();
+void criad_em(Bloco *atual, char *nome);
+Bloco* criad_ligar(Bloco *atual, const char *nome, long pos);
 void criaa();
+void criaa_em(Bloco *atual, char *nome, long file_size, int prealocar);
+long criaa_blocos(long tamanho, int *fatias);
+Arquivo* criaa_arquivo(long tamanho, int prealocar, Reserva *r);
+Bloco* criaa_ligar(Bloco *atual, const char *nome, Arquivo *arq);
 void removed();
+void removed_em(Bloco *atual, char *nome);
 void removea();
+void mover();
 void verd();
+void du();
+char mapa_simbolo(long i);
+long mapa_proximo_bit(long i, long fim, int livre);
+long mapa_fim_corrida(long i, long fim);
+long popcount_palavras(const uint64_t *v, long n);
+long contar_livres(long inicio, long fim);
+void mapa_conferir();
 void mapa();
+int percurso_iniciar(Percurso *p, Bloco *d, int maxNivel);
+Bloco* percurso_proximo(Percurso *p, int *nivel);
+void percurso_encerrar(Percurso *p);
+void escritor_por(Escritor *e, const char *s, size_t n);
+void escritor_descarregar(Escritor *e);
 void arvore();
 void verset();
+void frag();
+int defrag_mover(Arquivo *arq, long inicio);
+void defrag();
+void faixas_somar(Faixas *f, long inicio, long n);
+void faixas_mascara(Faixas *f, long w, uint64_t m);
+void faixas_imprimir(const char *rotulo, Faixas *f);
+int verifica_primeira_vez(Verificacao *v, void *obj);
+void verifica_marcar(Verificacao *v, long inicio, long n, const char *dono);
+void verifica_marcar_cauda(Verificacao *v, Arquivo *arq, const char *dono);
+void verifica_arquivo(Verificacao *v, Bloco *b);
+int verifica_reclamar(Verificacao *v, long p, int podeDividir);
+int verifica_reclamar_cauda(Verificacao *v, Arquivo *arq);
+void verifica_reparar_arquivo(Verificacao *v, Bloco *b);
+void verifica_reparar_dir(Verificacao *v, Bloco *b);
+void* verifica_trabalhar(void *arg);
+int verifica_percorrer(Verificacao *v, int threads);
+long verifica_comparar(Verificacao *v, int mostrar, Faixas *vazados, Faixas *perdidos);
+void verifica_recontar();
+void verifica_reparar(Verificacao *v);
+void verifica();
+int lote_acrescentar(LoteImporta *l, const char *nome, int32_t dir, long tamanho);
+void lote_liberar(LoteImporta *l);
+int importa_ler(Importacao *im, PendenteImporta *p, LoteImporta *l, PendenteImporta **novos, long *numNovos,
+                long *capNovos);
+void* importa_trabalhar(void *arg);
+int importa_destino(Importacao *im, int32_t id, Bloco *d);
+Bloco* importa_dir(Bloco *pai, const char *nome, Reserva *r, Uso *uso);
+int importa_inserir(Importacao *im, LoteImporta *l);
+int importa_confirmar(int sempre);
+Bloco* importa_raiz(char *caminho, Uso *uso, Bloco **paiCriado);
+void importa();
+int dir_copiar(Bloco *b);
+int arquivo_copiar(Bloco *b);
+void arquivo_soltar(Arquivo *arq);
+void arvore_soltar(Bloco *b);
+void religar_pais();
+Instantaneo* instantaneo_buscar(const char *nome);
+void instantaneo_medir(Instantaneo *inst);
+void snapshot();
+void rollback();
+char* parametro_valor(char *arg);
+void bench();
+void alocacao();
+void estresse();
 void ajuda();
+Comando* comando_buscar(const char *nome);
+void executar_comando(Comando *c, char **args);
+int executar_linha(char *linha);
+void modo_lote(const char *caminho);
+
+PoliticaAlocacao politicas[] = {
+    {"first-fit", alocar_primeiro, NULL, NULL, NULL},
+    {"next-fit", alocar_proximo, NULL, NULL, NULL},
+    {"best-fit", alocar_melhor, NULL, NULL, NULL},
+    {"worst-fit", alocar_pior, NULL, NULL, NULL},
+    {"buddy", buddy_alocar, buddy_liberar, buddy_iniciar, buddy_encerrar},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+PoliticaAlocacao *politica = &politicas[0];
+
+Comando comandos[] = {
+    {"ajuda", ajuda, VOLUME_COMPARTILHADO, 0},
+    {"arvore", arvore, VOLUME_EXCLUSIVO, 0},
+    {"mapa", mapa, VOLUME_EXCLUSIVO, 0},
+    {"verset", verset, VOLUME_COMPARTILHADO, 0},
+    {"verd", verd, VOLUME_COMPARTILHADO, 0},
+    {"du", du, VOLUME_COMPARTILHADO, 0},
+    {"criad", criad, VOLUME_COMPARTILHADO, 1},
+    {"removed", removed, VOLUME_COMPARTILHADO, 1},
+    {"criaa", criaa, VOLUME_COMPARTILHADO, 1},
+    {"removea", removea, VOLUME_COMPARTILHADO, 1},
+    {"move", mover, VOLUME_EXCLUSIVO, 1},
+    {"busca", busca, VOLUME_EXCLUSIVO, 0},
+    {"verifica", verifica, VOLUME_EXCLUSIVO, 1},
+    {"importa", importa, VOLUME_EXCLUSIVO, 1},
+    {"sync", sincronizar, VOLUME_EXCLUSIVO, 0},
+    {"bench", bench, VOLUME_EXCLUSIVO, 0},
+    {"stats", stats, VOLUME_EXCLUSIVO, 0},
+    {"escreve", escreve, VOLUME_COMPARTILHADO, 1},
+    {"le", le, VOLUME_COMPARTILHADO, 0},
+    {"preenche", preenche, VOLUME_COMPARTILHADO, 1},
+    {"dedup", dedup, VOLUME_EXCLUSIVO, 0},
+    {"cache", cache, VOLUME_EXCLUSIVO, 0},
+    {"estresse", estresse, VOLUME_LIVRE, 0},
+    {"diario", diario_info, VOLUME_EXCLUSIVO, 0},
+    {"frag", frag, VOLUME_EXCLUSIVO, 0},
+    {"defrag", defrag, VOLUME_EXCLUSIVO, 1},
+    {"politica", politica_cmd, VOLUME_EXCLUSIVO, 0},
+    {"alocacao", alocacao, VOLUME_EXCLUSIVO, 0},
+    {"snapshot", snapshot, VOLUME_EXCLUSIVO, 1},
+    {"rollback", rollback, VOLUME_EXCLUSIVO, 1},
+    {NULL, NULL, 0, 0}
+};
+
+int main(int argc, char *argv[]) {
+    int opt;
+    char in[256];
+    char *imagem = NULL;
+    char *script = NULL;
+    int numInodes = 0;
+    int quantidadeBuffers = BUFFERS_PADRAO;
+    int comDiario = 0;
+    int comDedup = 0;
+    PoliticaAlocacao *escolhida = politica;
+    while ((opt = getopt(argc, argv, "b:r:i:n:s:c:ja:dt:p")) != -1) {
+        switch (opt) {
+        case 'b':
+            totalBlocos = atol(optarg);
+            break;
+        case 'r':
+            blocosReservados = atol(optarg);
+            break;
+        case 'i':
+            imagem = optarg;
+            break;
+        case 'n':
+            numInodes = atoi(optarg);
+            break;
+        case 's':
+            script = optarg;
+            break;
+        case 'c':
+            quantidadeBuffers = atoi(optarg);
+            break;
+        case 'j':
+            comDiario = 1;
+            break;
+        case 'd':
+            comDedup = 1;
+            break;
+        case 't':
+            tamBloco = atol(optarg);
+            break;
+        case 'p':
+            caudasAtivas = 1;
+            break;
+        case 'a':
+            escolhida = politica_buscar(optarg);
+            if (escolhida == NULL) {
+                fprintf(stderr, "Erro: política de alocação '%s' desconhecida.\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Uso: %s [-b blocos] [-r reservados] [-i imagem [-j]] [-n inodes] [-s script] [-c buffers]"
+                    " [-a politica] [-d] [-t tamanho_bloco] [-p]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (totalBlocos <= 0 || blocosReservados < 0 || blocosReservados >= totalBlocos) {
+        fprintf(stderr, "Erro: parâmetros de disco inválidos.\n");
+        exit(1);
+    }
+    if (!tam_bloco_valido(tamBloco)) {
+        fprintf(stderr, "Erro: o tamanho do bloco deve ser uma potência de 2 entre %d e %d bytes.\n", TAM_BLOCO_MIN,
+                TAM_BLOCO_MAX);
+        exit(1);
+    }
+    if (comDiario && imagem == NULL) {
+        fprintf(stderr, "Erro: o diário (-j) exige um volume persistente (-i <imagem>).\n");
+        exit(1);
+    }
+    if (comDedup && imagem != NULL) {
+        fprintf(stderr, "Erro: a deduplicação (-d) só existe em volumes em memória.\n");
+        exit(1);
+    }
 
-int main() {
-    inicializar_blocos();
-    raiz = (Bloco*)malloc(sizeof(Bloco));
-    strcpy(raiz->nome, "raiz");
-    raiz->arq = NULL;
-    raiz->prox = NULL;
-    raiz->filho = NULL;
+    iniciar_memoria();
+    atexit(liberar_memoria);
+    if (imagem != NULL) {
+        if (numInodes <= 0)
+            numInodes = totalBlocos / 16 > 64 ? (int)(totalBlocos / 16) : 64;
+        if (volume_abrir(imagem, numInodes, comDiario) != 0)
+            exit(1);
+        atexit(volume_fechar);
+    } else {
+        inicializar_blocos();
+    }
+    politica_trocar(escolhida);
+    if (comDedup) {
+        if (dedup_ligar() != 0) {
+            printf("Erro: falha na alocação de memória.\n");
+            exit(1);
+        }
+        dedupAtivo = 1;
+    }
+    if (quantidadeBuffers < 1 || buffers_iniciar(quantidadeBuffers) != 0) {
+        printf("Erro: não foi possível criar o cache de buffers.\n");
+        exit(1);
+    }
+    raiz = (Bloco*)pool_alocar(&poolBlocos);
+    if (raiz == NULL || (raiz->dir = dir_criar()) == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        exit(1);
+    }
+    raiz->nome = nome_internar("raiz");
+    raiz->dir->attr.ino = mapaVolume != NULL ? 0 : -1;
+    if (mapaVolume != NULL)
+        raiz->dir->agregados = &inodes[0].agregados;
+    raiz->dir->carregado = mapaVolume == NULL;
     printf("Sistema de arquivos inicializado.\n");
 
+    if (script != NULL) {
+        modo_lote(script);
+        exit(0);
+    }
+
     while (1) {
         printf("[MyExplorer] >> ");
-        fgets(in, 256, stdin);
-        in[strlen(in) - 1] = '\0';
-        if (feof(stdin)) {
+        if (fgets(in, sizeof(in), stdin) == NULL) {
             printf("\n");
             exit(0);
         }
+        in[strcspn(in, "\n")] = '\0';
+        if (executar_linha(in))
+            exit(0);
+    }
+    return 0;
+}
 
-        int count = 0;
-        argList = (char**)malloc(256 * sizeof(char*));
-        char *token = strtok(in, " ");
-        while (token) {
-            argList[count++] = token;
-            token = strtok(NULL, " ");
-        }
-        argList[count] = NULL;
+/*
+ * Separa 'linha' em argumentos no próprio buffer e executa o comando pela
+ * tabela 'comandos'. Devolve 1 se o comando foi 'sair'.
+ */
+int executar_linha(char *linha) {
+    char *args[MAX_ARGS + 1];
+    int count = 0;
+    char *p = linha;
+    while (*p && count < MAX_ARGS) {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+        if (*p == '\0')
+            break;
+        args[count++] = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\r')
+            p++;
+        if (*p)
+            *p++ = '\0';
+    }
+    args[count] = NULL;
+    if (count == 0 || args[0][0] == '#')
+        return 0;
 
-        if (argList[1] != NULL) 
-            strcpy(argumentos, argList[1]);
+    if (!strcmp(args[0], "sair"))
+        return 1;
+    Comando *c = comando_buscar(args[0]);
+    if (c == NULL) {
+        printf("Comando inválido!\nDigite 'ajuda' para ver a lista de comandos disponíveis.\n");
+        return 0;
+    }
+    executar_comando(c, args);
+    return 0;
+}
 
-        if (!strcmp(argList[0], "sair")) 
-            exit(0);
-        if (!strcmp(argList[0], "ajuda")) {
-            ajuda();
-            continue;
-        }
-        if (!strcmp(argList[0], "arvore")) {
-            arvore();
-            continue;
-        }
-        if (!strcmp(argList[0], "mapa")) {
-            mapa();
-            continue;
-        }
-        if (!strcmp(argList[0], "verset")) {
-            verset();
-            continue;
-        }
-        if (!strcmp(argList[0], "verd")) {
-            verd();
-            continue;
-        }
-        if (!strcmp(argList[0], "criad")) {
-            criad();
-            continue;
-        }
-        if (!strcmp(argList[0], "removed")) {
-            removed();
-            continue;
+Comando* comando_buscar(const char *nome) {
+    for (Comando *c = comandos; c->nome != NULL; c++)
+        if (c->nome[0] == nome[0] && !strcmp(c->nome, nome))
+            return c;
+    return NULL;
+}
+
+/*
+ * Executa 'c' com os argumentos 'args' (terminados em NULL) sob travaVolume
+ * no modo do comando. Com diário, um comando que altera o volume é uma
+ * operação da transação em curso e a espera pela confirmação é feita já
+ * sem travaVolume.
+ */
+void executar_comando(Comando *c, char **args) {
+    int trava = c->trava;
+    /* Com instantâneos, alterar copia diretórios compartilhados ao longo do caminho: só com o volume exclusivo. */
+    if (trava == VOLUME_COMPARTILHADO && c->altera && __atomic_load_n(&numInstantaneos, __ATOMIC_ACQUIRE) > 0)
+        trava = VOLUME_EXCLUSIVO;
+    if (trava == VOLUME_EXCLUSIVO) {
+        pthread_rwlock_wrlock(&travaVolume);
+    } else if (trava == VOLUME_COMPARTILHADO) {
+        pthread_rwlock_rdlock(&travaVolume);
+        if (c->altera && __atomic_load_n(&numInstantaneos, __ATOMIC_ACQUIRE) > 0) {
+            pthread_rwlock_unlock(&travaVolume);
+            pthread_rwlock_wrlock(&travaVolume);
         }
-        if (!strcmp(argList[0], "criaa")) {
-            criaa();
-            continue;
+    }
+    long tid = c->altera ? diario_iniciar() : 0;
+    char **anterior = argList;
+    argList = args;
+    c->executar();
+    argList = anterior;
+    if (tid)
+        diario_terminar();
+    if (c->trava != VOLUME_LIVRE)
+        pthread_rwlock_unlock(&travaVolume);
+    if (tid)
+        diario_concluir(tid);
+}
+
+/*
+ * Executa um roteiro de comandos sem prompt. A entrada é lida em pedaços de
+ * TAM_LOTE bytes e cada linha é executada direto no buffer; a saída fica num
+ * buffer grande e só as mensagens de cada comando são impressas.
+ */
+void modo_lote(const char *caminho) {
+    int fd = strcmp(caminho, "-") == 0 ? STDIN_FILENO : open(caminho, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Erro: não foi possível abrir o roteiro '%s'.\n", caminho);
+        return;
+    }
+    char *buffer = (char*)malloc(TAM_LOTE + 1);
+    static char saida[TAM_LOTE];
+    if (buffer == NULL) {
+        fprintf(stderr, "Erro: falha na alocação de memória.\n");
+        return;
+    }
+    setvbuf(stdout, saida, _IOFBF, sizeof(saida));
+    verboso = 0;
+    esperarDiario = 0;
+    long confirmacoesAntes = diario.confirmacoes;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long executados = 0;
+    size_t usado = 0;
+    int fim = 0, sair = 0;
+    while (!fim && !sair) {
+        ssize_t n = read(fd, buffer + usado, TAM_LOTE - usado);
+        if (n <= 0) {
+            fim = 1;
+            n = 0;
         }
-        if (!strcmp(argList[0], "removea")) {
-            removea();
-            continue;
+        usado += n;
+
+        char *linha = buffer;
+        char *limite = buffer + usado;
+        while (!sair) {
+            char *nl = memchr(linha, '\n', limite - linha);
+            if (nl == NULL) {
+                /* Linha incompleta: fica para a próxima leitura, a menos que a entrada acabou ou o buffer encheu. */
+                if (linha == limite || (!fim && limite - linha < TAM_LOTE))
+                    break;
+                nl = limite;
+            }
+            *nl = '\0';
+            sair = executar_linha(linha);
+            executados++;
+            linha = nl + (nl < limite);
+            if (linha >= limite)
+                break;
         }
-        printf("Comando inválido!\nDigite 'ajuda' para ver a lista de comandos disponíveis.\n");
+        usado = limite - linha;
+        memmove(buffer, linha, usado);
     }
-    return 0;
+    diario_forcar();
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fflush(stdout);
+
+    double seg = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%ld comandos em %.3f s (%.0f comandos/s)\n", executados, seg, seg > 0 ? executados / seg : 0.0);
+    if (diarioAtivo)
+        fprintf(stderr, "Diário: %ld transação(ões) confirmada(s) com fsync\n", diario.confirmacoes - confirmacoesAntes);
+    free(buffer);
+    if (fd != STDIN_FILENO)
+        close(fd);
 }
 
 void ajuda() {
     printf("Comandos disponíveis:\n");
     printf("  criad <caminho/nome_do_diretorio> - Cria um novo diretório.\n");
-    printf("  criaa <caminho/nome_do_arquivo> <tamanho> - Cria um novo arquivo com o tamanho especificado.\n");
+    printf("  criaa <caminho/nome_do_arquivo> <tamanho> [--prealloc] - Cria um arquivo esparso (ou já com todos os blocos).\n");
     printf("  removed <caminho/nome_do_diretorio> - Remove um diretório vazio.\n");
     printf("  removea <caminho/nome_do_arquivo> - Remove um arquivo.\n");
+    printf("  move <origem> <destino> - Move ou renomeia um arquivo ou diretório sem copiar os dados.\n");
+    printf("  importa <diretorio_do_hospedeiro> <caminho> [--esparso] [threads=N] - Copia nomes e tamanhos de uma árvore real.\n");
     printf("  verd <caminho> - Lista o conteúdo de um diretório.\n");
+    printf("  du [caminho] - Mostra o uso de um diretório e de toda a sua subárvore.\n");
+    printf("  busca <padrao> [caminho] - Lista os caminhos com o nome exato ou que casam com o curinga (*, ?, [...]).\n");
     printf("  verset <caminho/nome_do_arquivo> - Mostra os setores ocupados por um arquivo.\n");
-    printf("  mapa - Mostra o mapa de setores do disco.\n");
-    printf("  arvore - Mostra a árvore de diretórios.\n");
+    printf("  escreve <caminho/nome_do_arquivo> <offset> <texto> - Grava texto no arquivo.\n");
+    printf("  le <caminho/nome_do_arquivo> <offset> <tamanho> - Lê bytes do arquivo.\n");
+    printf("  preenche <caminho/nome_do_arquivo> [texto] - Grava o arquivo inteiro com o texto repetido (ou zeros).\n");
+    printf("  dedup [on|off] - Liga ou desliga a deduplicação de blocos, ou mostra o espaço economizado.\n");
+    printf("  cache - Mostra as estatísticas do cache de buffers.\n");
+    printf("  mapa [inicio [fim]] [--rle | --zoom N] [--conferir] - Mostra o mapa de setores do disco.\n");
+    printf("  verifica [--reparar] [threads=N] - Confere o bitmap contra os blocos de cada entrada e corrige.\n");
+    printf("  frag - Mostra a fragmentação dos arquivos e do espaço livre.\n");
+    printf("  defrag [orcamento] - Move arquivos fragmentados para sequências contíguas (até 'orcamento' blocos, padrão %d).\n",
+           ORCAMENTO_DEFRAG);
+    printf("  arvore [caminho] [--profundidade N] [--dirs | --arquivos] - Mostra a árvore de diretórios.\n");
+    printf("  bench [chave=valor ...] - Mede vazão e latência das operações numa árvore sintética.\n");
+    printf("  estresse [chave=valor ...] - Executa operações em várias threads e confere os invariantes.\n");
+    printf("  politica [nome] - Mostra ou troca a política de alocação de blocos.\n");
+    printf("  snapshot [nome | --apagar nome] - Cria um instantâneo da árvore, apaga um ou lista todos.\n");
+    printf("  rollback <nome> - Volta a árvore ao instantâneo 'nome'.\n");
+    printf("  alocacao [chave=valor ...] - Repete um traço de alocações com cada política e compara.\n");
+    printf("  stats - Mostra as estatísticas dos pools de memória.\n");
+    printf("  diario - Mostra as estatísticas do diário de metadados (-j).\n");
+    printf("  sync - Grava os buffers sujos e o volume persistente no disco (msync, ou checkpoint com -j).\n");
     printf("  ajuda - Mostra esta mensagem de ajuda.\n");
     printf("  sair - Sai do sistema de arquivos.\n");
 }
 
+/* Símbolo do bloco 'i' no mapa. */
+char mapa_simbolo(long i) {
+    if (i < blocosReservados)
+        return 'B';
+    if (bloco_livre(i))
+        return '0';
+    return refsBlocos != NULL && refsBlocos[i] > 0 ? 'D' : '#';
+}
+
+/*
+ * Primeiro bloco em [i, fim) cujo bit no bitmap vale 'livre', ou 'fim'.
+ * Anda uma palavra de cada vez: corridas longas custam uma leitura a cada
+ * 64 blocos.
+ */
+long mapa_proximo_bit(long i, long fim, int livre) {
+    while (i < fim) {
+        uint64_t w = blocosLivres[i >> 6];
+        if (!livre)
+            w = ~w;
+        w &= ~(uint64_t)0 << (i & 63);
+        if (w != 0)
+            return (i & ~63L) + __builtin_ctzll(w) < fim ? (i & ~63L) + __builtin_ctzll(w) : fim;
+        i = (i & ~63L) + 64;
+    }
+    return fim;
+}
+
+/* Fim (exclusivo) da corrida de blocos com o mesmo símbolo que começa em 'i'. */
+long mapa_fim_corrida(long i, long fim) {
+    char s = mapa_simbolo(i);
+    if (s == 'B')
+        return blocosReservados < fim ? blocosReservados : fim;
+    if (s == '0')
+        return mapa_proximo_bit(i, fim, 0);
+    long f = mapa_proximo_bit(i, fim, 1);
+    if (refsBlocos == NULL)
+        return f;
+    long j = i + 1;
+    while (j < f && mapa_simbolo(j) == s)
+        j++;
+    return j;
+}
+
+/*
+ * Soma de popcount sobre 'n' palavras. Sem -mpopcnt o GCC chama
+ * __popcountdi2 a cada palavra; VERSOES_POPCOUNT gera também uma cópia com
+ * a instrução, usada quando o processador a tem. Quatro somas
+ * independentes não deixam o laço preso na latência de uma só.
+ */
+VERSOES_POPCOUNT
+long popcount_palavras(const uint64_t *v, long n) {
+    long s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    long i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += __builtin_popcountll(v[i]);
+        s1 += __builtin_popcountll(v[i + 1]);
+        s2 += __builtin_popcountll(v[i + 2]);
+        s3 += __builtin_popcountll(v[i + 3]);
+    }
+    for (; i < n; i++)
+        s0 += __builtin_popcountll(v[i]);
+    return s0 + s1 + s2 + s3;
+}
+
+/* Blocos livres em [inicio, fim), contados no bitmap. */
+long contar_livres(long inicio, long fim) {
+    if (inicio >= fim)
+        return 0;
+    long wi = inicio >> 6, wf = (fim - 1) >> 6;
+    if (wi == wf)
+        return __builtin_popcountll(blocosLivres[wi] & mascara_bits(inicio & 63, (int)(fim - inicio)));
+    return __builtin_popcountll(blocosLivres[wi] >> (inicio & 63))
+           + popcount_palavras(blocosLivres + wi + 1, wf - wi - 1)
+           + __builtin_popcountll(blocosLivres[wf] & mascara_bits(0, (int)((fim - 1) & 63) + 1));
+}
+
+/*
+ * Confere o bitmap contra o contador de livres e o resumo. Só relata: a
+ * correção fica com verifica --reparar.
+ */
+void mapa_conferir() {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long livres = popcount_palavras(blocosLivres, numPalavras);
+    long foraResumo = 0;
+    for (long w = 0; w < numPalavras; w++)
+        if (blocosLivres[w] != 0 && !((resumoLivres[w >> 6] >> (w & 63)) & 1))
+            foraResumo++;
+    long reservadosLivres = contar_livres(0, blocosReservados);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+
+    printf("Bitmap conferido em %.3f ms: %ld bloco(s) livre(s)", ms, livres);
+    if (livres == espacosLivres) {
+        printf(", contador ok.\n");
+    } else {
+        printf(".\n");
+        printf("Erro: o contador de livres diz %ld; use verifica --reparar para corrigi-lo.\n", espacosLivres);
+    }
+    if (foraResumo > 0)
+        printf("Erro: %ld palavra(s) do bitmap com blocos livres fora do resumo.\n", foraResumo);
+    if (reservadosLivres > 0)
+        printf("Erro: %ld bloco(s) reservado(s) marcado(s) como livre(s).\n", reservadosLivres);
+}
+
+/*
+ * mapa [inicio [fim]] [--rle | --zoom N] [--conferir]: sem opções, um
+ * símbolo por bloco; --rle mostra uma linha por corrida de blocos iguais;
+ * --zoom junta N blocos por célula e mostra quanto cada grupo está
+ * ocupado. A saída passa pelo Escritor, não por um printf por bloco.
+ */
 void mapa() {
-    for (int i = 0; i < 256; i++) {
-        if (i < 10) {
-            printf("B ");
+    long inicio = 0, fim = totalBlocos - 1, zoom = 0;
+    int rle = 0, conferir = 0, numeros = 0;
+    for (int i = 1; argList[i] != NULL; i++) {
+        if (strcmp(argList[i], "--rle") == 0) {
+            rle = 1;
+        } else if (strcmp(argList[i], "--zoom") == 0 && argList[i + 1] != NULL && atol(argList[i + 1]) > 0) {
+            zoom = atol(argList[++i]);
+        } else if (strcmp(argList[i], "--conferir") == 0) {
+            conferir = 1;
+        } else if (argList[i][0] >= '0' && argList[i][0] <= '9' && numeros < 2) {
+            if (numeros++ == 0)
+                inicio = atol(argList[i]);
+            else
+                fim = atol(argList[i]);
         } else {
-            printf(blocosLivres[i] ? "0 " : "# ");
+            printf("Erro: uso: mapa [inicio [fim]] [--rle | --zoom N] [--conferir]\n");
+            return;
         }
     }
-    printf("\nB-Boot 0-Livre #-Ocupado\n");
-}
+    if (numeros == 1)
+        fim = totalBlocos - 1;
+    if (inicio > fim || fim >= totalBlocos || (rle && zoom)) {
+        printf("Erro: uso: mapa [inicio [fim]] [--rle | --zoom N] [--conferir]\n");
+        return;
+    }
+    if (conferir) {
+        mapa_conferir();
+        if (!rle && !zoom && numeros == 0)
+            return;
+    }
 
-void arvore() {
-    printf("\nEstrutura de Diretórios:\n");
-    printf("Raiz\n");
-    Bloco* atual = raiz->filho;
-    if (atual != NULL) {
-        int nivel = 0;
-        Bloco* bloco = atual;
-        while (bloco != NULL) {
-            if (bloco->arq == NULL) {
-                for (int i = 0; i < nivel; i++) printf("  ");
-                printf("|- %s/\n", bloco->nome);
-            }
-            if (bloco->filho != NULL) {
-                bloco = bloco->filho;
-                nivel++;
-            } else if (bloco->prox != NULL) {
-                bloco = bloco->prox;
-            } else {
-                bloco = NULL;
+    Escritor *e = (Escritor*)malloc(sizeof(Escritor));
+    if (e == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        return;
+    }
+    e->usado = 0;
+    fflush(stdout);
+    char linha[96];
+    int len;
+    if (rle) {
+        for (long i = inicio; i <= fim;) {
+            long f = mapa_fim_corrida(i, fim + 1);
+            len = snprintf(linha, sizeof(linha), "%ld-%ld %c (%ld)\n", i, f - 1, mapa_simbolo(i), f - i);
+            escritor_por(e, linha, len);
+            i = f;
+        }
+    } else if (zoom) {
+        /* Cada célula: '.' vazia, '1'-'9' a dezena da ocupação, '#' cheia; os reservados contam como ocupados. */
+        long celula = 0;
+        for (long g = inicio; g <= fim; g += zoom, celula++) {
+            long f = g + zoom - 1 < fim ? g + zoom - 1 : fim;
+            long n = f - g + 1;
+            long ocupados = n - contar_livres(g, f + 1);
+            char c = ocupados == 0 ? '.' : ocupados == n ? '#' : (char)('0' + (ocupados * 10 / n ? ocupados * 10 / n : 1));
+            if (celula % 64 == 0) {
+                len = snprintf(linha, sizeof(linha), celula ? "\n%10ld " : "%10ld ", g);
+                escritor_por(e, linha, len);
             }
+            escritor_por(e, &c, 1);
+        }
+        len = snprintf(linha, sizeof(linha), "\n%ld bloco(s) por célula: . vazio, 1-9 dezenas de %% ocupadas, # cheio\n",
+                       zoom);
+        escritor_por(e, linha, len);
+    } else {
+        for (long i = inicio; i <= fim; i++) {
+            linha[0] = mapa_simbolo(i);
+            linha[1] = ' ';
+            escritor_por(e, linha, 2);
         }
     }
-}
+    escritor_descarregar(e);
+    free(e);
 
-void inicializar_blocos() {
-    for (int i = 0; i < 256; i++) {
-        blocosLivres[i] = (i < 10) ? 0 : 1;
+    if (!rle && !zoom) {
+        if (refsBlocos == NULL) {
+            printf("\nB-Boot 0-Livre #-Ocupado\n");
+        } else {
+            printf("\nB-Boot 0-Livre #-Ocupado D-Compartilhado pelo dedup\n");
+        }
+    }
+    if (rle || zoom || numeros > 0) {
+        long n = fim - inicio + 1, livres = contar_livres(inicio, fim + 1);
+        printf("Blocos %ld-%ld: %ld livre(s), %ld ocupado(s) (%.1f%%)\n", inicio, fim, livres, n - livres,
+               100.0 * (n - livres) / n);
+    }
+    if (refsBlocos != NULL) {
+        long fisicos = totalBlocos - blocosReservados - espacosLivres;
+        printf("Uso lógico: %ld bloco(s), físico: %ld bloco(s)\n", fisicos + blocosEconomizados, fisicos);
     }
-    espacosLivres = 256 - 10;
-    printf("Blocos inicializados.\n");
 }
 
-void liberar_bloco(int i) {
-    if (i >= 0 && i < 256 && !blocosLivres[i]) {
-        blocosLivres[i] = 1;
-        espacosLivres++;
-        printf("Bloco %d liberado.\n", i);
-    }
+/* Começa um percurso pelos filhos de 'd' (nível 0); 'maxNivel' limita quantos níveis são visitados. */
+int percurso_iniciar(Percurso *p, Bloco *d, int maxNivel) {
+    p->pilha = (Bloco**)malloc(PILHA_PERCURSO * sizeof(Bloco*));
+    p->cap = PILHA_PERCURSO;
+    p->topo = 0;
+    p->maxNivel = maxNivel;
+    p->erro = 0;
+    if (p->pilha == NULL)
+        return -1;
+    dir_carregar(d);
+    if (d->filho != NULL && maxNivel != 0)
+        p->pilha[p->topo++] = d->filho;
+    return 0;
 }
 
-int alocar_bloco() {
-    for (int i = 10; i < 256; i++) {
-        if (blocosLivres[i]) {
-            blocosLivres[i] = 0;
-            espacosLivres--;
-            printf("Bloco %d alocado.\n", i);
-            return i;
+/* Devolve a próxima entrada em pré-ordem e o seu nível, ou NULL no fim. Cada entrada aparece uma vez. */
+Bloco* percurso_proximo(Percurso *p, int *nivel) {
+    while (p->topo > 0) {
+        Bloco *b = p->pilha[p->topo - 1];
+        if (b == NULL) {
+            p->topo--;
+            continue;
+        }
+        int n = p->topo - 1;
+        p->pilha[n] = b->prox;
+        if (b->arq == NULL && (p->maxNivel < 0 || n + 1 < p->maxNivel)) {
+            dir_carregar(b);
+            if (b->filho != NULL) {
+                if (p->topo == p->cap) {
+                    Bloco **maior = (Bloco**)realloc(p->pilha, 2 * p->cap * sizeof(Bloco*));
+                    if (maior == NULL) {
+                        p->erro = 1;
+                        p->topo = 0;
+                        return NULL;
+                    }
+                    p->pilha = maior;
+                    p->cap *= 2;
+                }
+                p->pilha[p->topo++] = b->filho;
+            }
         }
+        if (nivel != NULL)
+            *nivel = n;
+        return b;
     }
-    printf("Erro: não há mais blocos livres.\n");
-    return -1;
+    return NULL;
 }
 
-char* obter_data_atual() {
-    static char time_string[20];
-    time_t now = time(NULL);
-    struct tm *ptm = localtime(&now);
+void percurso_encerrar(Percurso *p) {
+    free(p->pilha);
+    p->pilha = NULL;
+    p->topo = 0;
+}
 
-    if (ptm != NULL) {
-        strftime(time_string, sizeof(time_string), "%d/%m/%Y %H:%M:%S", ptm);
-    } else {
-        strcpy(time_string, "Data Inválida");
+void escritor_por(Escritor *e, const char *s, size_t n) {
+    if (e->usado + n > sizeof(e->buf))
+        escritor_descarregar(e);
+    if (n > sizeof(e->buf)) {
+        fwrite(s, 1, n, stdout);
+        return;
     }
+    memcpy(e->buf + e->usado, s, n);
+    e->usado += n;
+}
 
-    return time_string;
+void escritor_descarregar(Escritor *e) {
+    fwrite(e->buf, 1, e->usado, stdout);
+    e->usado = 0;
 }
 
-char* substituir_string(const char *string, const char *search, const char *replacement) {
-    const char *pos = strstr(string, search);
-    if (!pos) return strdup(string);
+/*
+ * arvore [caminho] [--profundidade N] [--dirs | --arquivos]: mostra a
+ * subárvore de 'caminho' (a raiz por padrão), só com diretórios a menos que
+ * --arquivos seja dado, até N níveis abaixo dele.
+ */
+void arvore() {
+    char *caminho = NULL;
+    int maxNivel = -1, arquivos = 0;
+    for (int i = 1; argList[i] != NULL; i++) {
+        if ((strcmp(argList[i], "--profundidade") == 0 || strcmp(argList[i], "--depth") == 0)
+            && argList[i + 1] != NULL && atoi(argList[i + 1]) >= 0) {
+            maxNivel = atoi(argList[++i]);
+        } else if (strcmp(argList[i], "--dirs") == 0) {
+            arquivos = 0;
+        } else if (strcmp(argList[i], "--arquivos") == 0) {
+            arquivos = 1;
+        } else if (argList[i][0] != '-' && caminho == NULL) {
+            caminho = argList[i];
+        } else {
+            printf("Erro: uso: arvore [caminho] [--profundidade N] [--dirs | --arquivos]\n");
+            return;
+        }
+    }
+    Bloco *d = raiz;
+    if (caminho != NULL) {
+        d = resolver_dir(caminho, 0);
+        if (d == NULL)
+            return;
+        dir_destravar(d);
+    }
 
-    size_t new_length = strlen(string) - strlen(search) + strlen(replacement) + 1;
-    char *newstr = (char *)malloc(new_length);
-    if (!newstr) return NULL;
+    Escritor *e = (Escritor*)malloc(sizeof(Escritor));
+    Percurso p;
+    if (e == NULL || percurso_iniciar(&p, d, maxNivel) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        free(e);
+        return;
+    }
+    e->usado = 0;
+    printf("\nEstrutura de Diretórios:\n");
+    printf("%s\n", d == raiz ? "Raiz" : caminho);
+    fflush(stdout);
 
-    size_t prefix_length = pos - string;
-    strncpy(newstr, string, prefix_length);
+    static const char recuo[] = "                                                                ";
+    Bloco *b;
+    int nivel;
+    while ((b = percurso_proximo(&p, &nivel)) != NULL) {
+        if (b->arq != NULL && !arquivos)
+            continue;
+        for (size_t falta = 2 * (size_t)nivel; falta > 0;) {
+            size_t parte = falta < sizeof(recuo) - 1 ? falta : sizeof(recuo) - 1;
+            escritor_por(e, recuo, parte);
+            falta -= parte;
+        }
+        escritor_por(e, "|- ", 3);
+        escritor_por(e, b->nome, strlen(b->nome));
+        escritor_por(e, b->arq == NULL ? "/\n" : "\n", b->arq == NULL ? 2 : 1);
+    }
+    escritor_descarregar(e);
+    if (p.erro)
+        printf("Erro: falha na alocação de memória; a árvore foi mostrada só em parte.\n");
+    percurso_encerrar(&p);
+    free(e);
+}
+
+void inicializar_blocos() {
+    numPalavras = (totalBlocos + 63) / 64;
+    numResumo = (numPalavras + 63) / 64;
+    free(blocosLivres);
+    free(resumoLivres);
+    blocosLivres = (uint64_t*)calloc(numPalavras, sizeof(uint64_t));
+    resumoLivres = (uint64_t*)calloc(numResumo, sizeof(uint64_t));
+    if (blocosLivres == NULL || resumoLivres == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        exit(1);
+    }
+    formatar_bitmap();
+    printf("Blocos inicializados.\n");
+}
+
+/* Marca todos os blocos como livres, menos os reservados, em blocosLivres/resumoLivres já alocados. */
+void formatar_bitmap() {
+    memset(resumoLivres, 0, numResumo * sizeof(uint64_t));
+    for (long w = 0; w < numPalavras; w++) {
+        long base = w * 64;
+        uint64_t palavra = ~(uint64_t)0;
+        if (base + 64 > totalBlocos)
+            palavra = ((uint64_t)1 << (totalBlocos - base)) - 1;
+        if (base < blocosReservados)
+            palavra &= (blocosReservados - base >= 64) ? 0 : ~(((uint64_t)1 << (blocosReservados - base)) - 1);
+        blocosLivres[w] = palavra;
+        if (palavra)
+            resumoLivres[w >> 6] |= (uint64_t)1 << (w & 63);
+    }
+    espacosLivres = totalBlocos - blocosReservados;
+    dicaResumo = 0;
+}
+
+int bloco_livre(long i) {
+    return (__atomic_load_n(&blocosLivres[i >> 6], __ATOMIC_RELAXED) >> (i & 63)) & 1;
+}
+
+void liberar_bloco(long i) {
+    if (i < blocosReservados || i >= totalBlocos || bloco_livre(i)) {
+        __atomic_fetch_add(&liberacoesInvalidas, 1, __ATOMIC_RELAXED);
+        printf("Erro: bloco %ld não está ocupado e não foi liberado.\n", i);
+        return;
+    }
+    liberar_extensao(i, 1);
+}
+
+long alocar_bloco() {
+    long i;
+    if (alocar_extensao(1, &i) == 1)
+        return i;
+    printf("Erro: não há mais blocos livres.\n");
+    return -1;
+}
+
+/* Máscara com os bits [b, b + n) de uma palavra ligados (0 <= b, 1 <= n, b + n <= 64). */
+uint64_t mascara_bits(int b, int n) {
+    uint64_t m = (n == 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1);
+    return m << b;
+}
+
+/*
+ * A palavra w ficou sem blocos livres: apaga seu bit no resumo. Uma liberação
+ * concorrente liga o bit da palavra antes do bit do resumo, então basta
+ * conferir a palavra depois de apagar e religar se ela voltou a ter livres.
+ */
+void resumo_esvaziou(long w) {
+    uint64_t bit = (uint64_t)1 << (w & 63);
+    __atomic_fetch_and(&resumoLivres[w >> 6], ~bit, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&blocosLivres[w], __ATOMIC_SEQ_CST) != 0)
+        __atomic_fetch_or(&resumoLivres[w >> 6], bit, __ATOMIC_SEQ_CST);
+}
+
+void dica_baixar(long r) {
+    long atual = __atomic_load_n(&dicaResumo, __ATOMIC_RELAXED);
+    while (r < atual && !__atomic_compare_exchange_n(&dicaResumo, &atual, r, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Tira da palavra w, com compare-and-swap, até 'maximo' blocos livres
+ * consecutivos: a partir do bit b, ou da primeira corrida livre se b < 0.
+ * Devolve quantos foram tirados e o bit inicial em *bit.
+ */
+int palavra_tomar(long w, int b, long maximo, int *bit) {
+    uint64_t palavra = __atomic_load_n(&blocosLivres[w], __ATOMIC_RELAXED);
+    for (;;) {
+        int ini = b >= 0 ? b : (palavra ? __builtin_ctzll(palavra) : 64);
+        if (ini >= 64 || !((palavra >> ini) & 1))
+            return 0;
+        uint64_t livres = palavra >> ini;
+        int corrida = (~livres == 0) ? 64 : __builtin_ctzll(~livres);
+        if (corrida > maximo)
+            corrida = (int)maximo;
+        uint64_t resto = palavra & ~mascara_bits(ini, corrida);
+        if (__atomic_compare_exchange_n(&blocosLivres[w], &palavra, resto, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            diario_sujar(&blocosLivres[w], sizeof(uint64_t));
+            if (resto == 0)
+                resumo_esvaziou(w);
+            *bit = ini;
+            return corrida;
+        }
+    }
+}
+
+/*
+ * Política first-fit: aloca uma sequência contígua de até 'desejado' blocos
+ * começando no primeiro bloco livre. Devolve quantos blocos foram alocados e o início
+ * em *inicio, ou 0 se o disco está cheio. A sequência é medida palavra a
+ * palavra com count-trailing-zeros, então o custo é proporcional ao número de
+ * extensões e não ao número de blocos.
+ *
+ * Cada palavra é tomada com compare-and-swap, então várias threads alocam ao
+ * mesmo tempo sem trava. Uma thread com palavraLocal >= 0 começa a busca ali
+ * (e dá a volta no disco se preciso) em vez de em dicaResumo, para que
+ * threads diferentes não disputem as mesmas palavras.
+ *
+ * Com 'exato' só serve uma sequência de 'desejado' blocos inteira, então a
+ * busca é pela primeira sequência livre grande o bastante.
+ *
+ * Sem 'exato', um pedido de vários blocos olha antes as SONDAGEM_CORRIDAS
+ * primeiras sequências livres a partir do mesmo ponto e fica com a primeira
+ * que comporta o pedido inteiro ou, se nenhuma comporta, com a maior delas:
+ * um buraco pequeno no começo do disco não parte um arquivo grande que cabe
+ * inteiro logo adiante. O número de sequências olhadas é limitado para que o
+ * custo não cresça com a fragmentação do espaço livre.
+ */
+long alocar_primeiro(long desejado, int exato, long *inicio) {
+    if (exato)
+        return alocar_varrendo(desejado, 1, inicio, AJUSTE_PRIMEIRO);
+    long dica = __atomic_load_n(&dicaResumo, __ATOMIC_RELAXED);
+    long primeira = palavraLocal >= 0 ? palavraLocal : dica << 6;
+    int voltas = palavraLocal > 0 ? 2 : 1;
+    long w = 0, obtido = 0;
+    int b = 0;
+
+    if (desejado > 1) {
+        long escolhido = -1, tamEscolhido = 0, ini, n;
+        long p = primeira << 6;
+        for (int k = 0; k < SONDAGEM_CORRIDAS && (n = corrida_livre(p, desejado, &ini)) > 0; k++, p = ini + n) {
+            if (n > tamEscolhido) {
+                escolhido = ini;
+                tamEscolhido = n;
+            }
+            if (n >= desejado)
+                break;
+        }
+        if (escolhido >= 0 && (obtido = tomar_corrida(escolhido, tamEscolhido < desejado ? tamEscolhido : desejado)) > 0) {
+            if (palavraLocal >= 0)
+                palavraLocal = escolhido >> 6;
+            *inicio = escolhido;
+            return obtido;
+        }
+    }
+
+    for (int volta = 0; volta < voltas && obtido == 0; volta++) {
+        long de = volta == 0 ? primeira : 0;
+        long ate = volta == 0 ? numPalavras : primeira;
+        for (long r = de >> 6; (r << 6) < ate && obtido == 0; r++) {
+            uint64_t resumo = __atomic_load_n(&resumoLivres[r], __ATOMIC_RELAXED);
+            if (r == de >> 6)
+                resumo &= ~(uint64_t)0 << (de & 63);
+            while (resumo != 0 && obtido == 0) {
+                w = (r << 6) + __builtin_ctzll(resumo);
+                resumo &= resumo - 1;
+                if (w >= ate)
+                    break;
+                obtido = palavra_tomar(w, -1, desejado, &b);
+                if (obtido == 0 && __atomic_load_n(&blocosLivres[w], __ATOMIC_SEQ_CST) == 0)
+                    resumo_esvaziou(w);
+            }
+        }
+    }
+    if (obtido == 0) {
+        if (palavraLocal < 0)
+            __atomic_compare_exchange_n(&dicaResumo, &dica, numResumo, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        return 0;
+    }
+    /* Só avança a dica se ninguém a baixou enquanto procurávamos. */
+    if (palavraLocal < 0)
+        __atomic_compare_exchange_n(&dicaResumo, &dica, w >> 6, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    else
+        palavraLocal = w;
+    *inicio = (w << 6) + b;
+
+    /* A corrida chegou ao fim da palavra: continua nos bits baixos das seguintes. */
+    while (obtido < desejado && (*inicio + obtido) % 64 == 0 && ++w < numPalavras) {
+        long n = palavra_tomar(w, 0, desejado - obtido, &b);
+        if (n == 0)
+            break;
+        obtido += n;
+    }
+    __atomic_fetch_sub(&espacosLivres, obtido, __ATOMIC_RELAXED);
+    return obtido;
+}
+
+/* Aloca uma sequência de até 'desejado' blocos pela política em uso. */
+long alocar_extensao(long desejado, long *inicio) {
+    long obtido = politica->alocar(desejado, 0, inicio);
+    if (obtido == 0 || !verboso)
+        return obtido;
+    if (obtido == 1)
+        printf("Bloco %ld alocado.\n", *inicio);
+    else
+        printf("Blocos %ld-%ld alocados.\n", *inicio, *inicio + obtido - 1);
+    return obtido;
+}
+
+void liberar_extensao(long inicio, long tamanho) {
+    if (inicio < blocosReservados)
+        return;
+    if (inicio + tamanho > totalBlocos)
+        tamanho = totalBlocos - inicio;
+    if (refsBlocos != NULL)
+        dedup_liberar(inicio, tamanho);
+    else
+        extensao_devolver(inicio, tamanho);
+}
+
+/* Devolve blocos que ninguém mais usa. */
+void extensao_devolver(long inicio, long tamanho) {
+    /* Os buffers saem antes de os blocos voltarem ao bitmap, senão um novo dono poderia ler dados velhos. */
+    buf_descartar(inicio, tamanho);
+    bitmap_devolver(inicio, tamanho);
+
+    if (!verboso)
+        return;
+    if (tamanho == 1)
+        printf("Bloco %ld liberado.\n", inicio);
+    else if (tamanho > 1)
+        printf("Blocos %ld-%ld liberados.\n", inicio, inicio + tamanho - 1);
+}
+
+/* Devolve [inicio, inicio + tamanho) ao bitmap e avisa a política só das sequências que estavam ocupadas. */
+void bitmap_devolver(long inicio, long tamanho) {
+    long liberados = 0;
+    long corrida = 0, fimCorrida = -1;
+    long i = inicio;
+    long fim = inicio + tamanho;
+    while (i < fim) {
+        long w = i >> 6;
+        int b = i & 63;
+        int n = (fim - i < 64 - b) ? (int)(fim - i) : 64 - b;
+        uint64_t m = mascara_bits(b, n);
+        uint64_t antes = __atomic_fetch_or(&blocosLivres[w], m, __ATOMIC_SEQ_CST);
+        diario_sujar(&blocosLivres[w], sizeof(uint64_t));
+        liberados += __builtin_popcountll(m & ~antes);
+        if (m & antes)
+            __atomic_fetch_add(&liberacoesInvalidas, __builtin_popcountll(m & antes), __ATOMIC_RELAXED);
+        __atomic_fetch_or(&resumoLivres[w >> 6], (uint64_t)1 << (w & 63), __ATOMIC_SEQ_CST);
+        dica_baixar(w >> 6);
+        /* Blocos que já estavam livres não voltam à política (o buddy os teria duas vezes nas listas). */
+        for (uint64_t soltos = politica->liberar != NULL ? m & ~antes : 0; soltos != 0;) {
+            int s = __builtin_ctzll(soltos);
+            uint64_t resto = soltos >> s;
+            int k = ~resto == 0 ? 64 : __builtin_ctzll(~resto);
+            long p = (w << 6) + s;
+            if (p != fimCorrida) {
+                if (fimCorrida > corrida)
+                    politica->liberar(corrida, fimCorrida - corrida);
+                corrida = p;
+            }
+            fimCorrida = p + k;
+            soltos &= ~mascara_bits(s, k);
+        }
+        i += n;
+    }
+    __atomic_fetch_add(&espacosLivres, liberados, __ATOMIC_RELAXED);
+    if (fimCorrida > corrida)
+        politica->liberar(corrida, fimCorrida - corrida);
+}
+
+/*
+ * Procura a primeira sequência de blocos livres que começa em 'de' ou
+ * depois. Devolve o tamanho (0 se não há mais nenhuma) e o início em
+ * *inicio. As palavras cheias são puladas pelo resumo, 64 de cada vez; a
+ * medição para assim que o tamanho chega a 'maximo'.
+ */
+long corrida_livre(long de, long maximo, long *inicio) {
+    long w = de >> 6;
+    if (w >= numPalavras)
+        return 0;
+    uint64_t palavra = __atomic_load_n(&blocosLivres[w], __ATOMIC_RELAXED) & (~(uint64_t)0 << (de & 63));
+    while (palavra == 0) {
+        long r = ++w >> 6;
+        if (w >= numPalavras)
+            return 0;
+        uint64_t resumo = __atomic_load_n(&resumoLivres[r], __ATOMIC_RELAXED) & (~(uint64_t)0 << (w & 63));
+        while (resumo == 0) {
+            if (++r >= numResumo)
+                return 0;
+            resumo = __atomic_load_n(&resumoLivres[r], __ATOMIC_RELAXED);
+        }
+        w = (r << 6) + __builtin_ctzll(resumo);
+        if (w >= numPalavras)
+            return 0;
+        palavra = __atomic_load_n(&blocosLivres[w], __ATOMIC_RELAXED);
+    }
+    int b = __builtin_ctzll(palavra);
+    *inicio = (w << 6) + b;
+    uint64_t livres = palavra >> b;
+    long n = ~livres == 0 ? 64 : __builtin_ctzll(~livres);
+    while (n < maximo && (*inicio + n) % 64 == 0 && ++w < numPalavras) {
+        palavra = __atomic_load_n(&blocosLivres[w], __ATOMIC_RELAXED);
+        if (~palavra != 0) {
+            n += __builtin_ctzll(~palavra);
+            break;
+        }
+        n += 64;
+    }
+    return n;
+}
+
+/* Aloca 'tamanho' blocos numa única sequência pela política em uso, ou devolve -1 se não houver. */
+long alocar_contiguo(long tamanho) {
+    long inicio;
+    return politica->alocar(tamanho, 1, &inicio) == tamanho ? inicio : -1;
+}
+
+/* Pede 'n' blocos ao alocador, em tantas sequências quantas precisar, para 'r'. Devolve quantos conseguiu. */
+long reserva_pedir(Reserva *r, long n) {
+    long obtidos = 0;
+    while (obtidos < n) {
+        if (r->num == r->cap) {
+            int cap = r->cap ? r->cap * 2 : 16;
+            Extensao *maior = (Extensao*)realloc(r->seq, cap * sizeof(Extensao));
+            if (maior == NULL)
+                break;
+            r->seq = maior;
+            r->cap = cap;
+        }
+        long inicio;
+        long k = alocar_extensao(n - obtidos, &inicio);
+        if (k == 0)
+            break;
+        r->seq[r->num].inicio = inicio;
+        r->seq[r->num].tamanho = k;
+        r->num++;
+        obtidos += k;
+    }
+    return obtidos;
+}
+
+/* Como alocar_extensao, mas tirando da reserva 'r' (do alocador, se 'r' é NULL); 0 quando ela acabou. */
+long reserva_tirar(Reserva *r, long n, long *inicio) {
+    if (r == NULL)
+        return alocar_extensao(n, inicio);
+    if (r->atual == r->num)
+        return 0;
+    Extensao *e = &r->seq[r->atual];
+    long k = e->tamanho - r->usado < n ? e->tamanho - r->usado : n;
+    *inicio = e->inicio + r->usado;
+    r->usado += k;
+    if (r->usado == e->tamanho) {
+        r->atual++;
+        r->usado = 0;
+    }
+    return k;
+}
+
+/* Devolve ao bitmap o que não foi tirado de 'r' e a esvazia. */
+void reserva_devolver(Reserva *r) {
+    for (int i = r->atual; i < r->num; i++) {
+        long de = i == r->atual ? r->usado : 0;
+        liberar_extensao(r->seq[i].inicio + de, r->seq[i].tamanho - de);
+    }
+    r->num = r->atual = 0;
+    r->usado = 0;
+}
+
+/*
+ * Toma do bitmap os blocos livres consecutivos a partir de 'inicio', até
+ * 'n'. Devolve quantos conseguiu (menos que 'n' se outra thread chegou
+ * antes a algum deles).
+ */
+long tomar_corrida(long inicio, long n) {
+    long obtido = 0;
+    int b;
+    while (obtido < n) {
+        long i = inicio + obtido;
+        long k = palavra_tomar(i >> 6, (int)(i & 63), n - obtido, &b);
+        if (k == 0)
+            break;
+        obtido += k;
+    }
+    __atomic_fetch_sub(&espacosLivres, obtido, __ATOMIC_RELAXED);
+    return obtido;
+}
+
+/*
+ * Políticas que escolhem uma das sequências livres do bitmap por varredura
+ * (o custo é proporcional ao número de sequências livres):
+ *   AJUSTE_PRIMEIRO - a primeira que comporta o pedido;
+ *   AJUSTE_PROXIMO  - a primeira que comporta o pedido a partir de onde a
+ *                     alocação anterior parou, dando a volta no disco;
+ *   AJUSTE_MELHOR   - a menor que comporta o pedido;
+ *   AJUSTE_PIOR     - a maior.
+ * Se nenhuma comporta o pedido inteiro, a maior é usada e o chamador pede o
+ * resto de novo; com 'exato' devolve 0 nesse caso.
+ */
+long alocar_varrendo(long desejado, int exato, long *inicio, int modo) {
+    for (;;) {
+        long de = modo == AJUSTE_PROXIMO ? __atomic_load_n(&cursorProximo, __ATOMIC_RELAXED) : 0;
+        /* Primeira e próxima só precisam saber se a sequência comporta o pedido. */
+        long medir = modo == AJUSTE_PRIMEIRO || modo == AJUSTE_PROXIMO ? desejado : totalBlocos;
+        long escolhido = -1, tamEscolhido = 0, maior = -1, tamMaior = 0;
+        long ini, n;
+        for (int volta = 0; volta < (de > 0 ? 2 : 1) && escolhido < 0; volta++) {
+            long ate = volta == 0 ? totalBlocos : de;
+            for (long p = volta == 0 ? de : 0; p < ate && (n = corrida_livre(p, medir, &ini)) > 0; p = ini + n) {
+                if (ini >= ate)
+                    break;
+                if (n > tamMaior) {
+                    maior = ini;
+                    tamMaior = n;
+                }
+                if (n < desejado || (modo == AJUSTE_MELHOR && escolhido >= 0 && n >= tamEscolhido))
+                    continue;
+                escolhido = ini;
+                tamEscolhido = n;
+                if (modo == AJUSTE_PRIMEIRO || modo == AJUSTE_PROXIMO || (modo == AJUSTE_MELHOR && n == desejado))
+                    break;
+            }
+        }
+        if (modo == AJUSTE_PIOR && maior >= 0 && (tamMaior >= desejado || !exato)) {
+            escolhido = maior;
+            tamEscolhido = tamMaior;
+        }
+        if (escolhido < 0 && !exato) {
+            escolhido = maior;
+            tamEscolhido = tamMaior;
+        }
+        if (escolhido < 0)
+            return 0;
+        long quer = tamEscolhido < desejado ? tamEscolhido : desejado;
+        long obtido = tomar_corrida(escolhido, quer);
+        if (obtido > 0 && (obtido == quer || !exato)) {
+            if (modo == AJUSTE_PROXIMO)
+                __atomic_store_n(&cursorProximo, escolhido + obtido, __ATOMIC_RELAXED);
+            *inicio = escolhido;
+            return obtido;
+        }
+        /* Outra thread tomou parte da sequência escolhida: devolve o que pegou e procura de novo. */
+        if (obtido > 0)
+            bitmap_devolver(escolhido, obtido);
+    }
+}
+
+long alocar_proximo(long desejado, int exato, long *inicio) {
+    return alocar_varrendo(desejado, exato, inicio, AJUSTE_PROXIMO);
+}
+
+long alocar_melhor(long desejado, int exato, long *inicio) {
+    return alocar_varrendo(desejado, exato, inicio, AJUSTE_MELHOR);
+}
+
+long alocar_pior(long desejado, int exato, long *inicio) {
+    return alocar_varrendo(desejado, exato, inicio, AJUSTE_PIOR);
+}
+
+/*
+ * Buddy binário. O espaço livre fica também em listas por ordem: cada
+ * pedaço livre tem 2^k blocos e começa num múltiplo de 2^k. Um pedido de n
+ * blocos pega o menor pedaço de ordem >= log2(n) (dividindo os maiores ao
+ * meio até chegar nela) e devolve às listas a sobra depois dos n blocos,
+ * então não há fragmentação interna. Ao liberar, um pedaço se funde com o
+ * seu par (o outro meio do pedaço de ordem acima) sempre que o par está
+ * livre inteiro. O bitmap continua sendo a referência do que está ocupado;
+ * as listas são reconstruídas a partir dele quando a política é escolhida.
+ */
+void buddy_tirar(long i) {
+    int k = ordemBuddy[i];
+    if (anteriorBuddy[i] >= 0)
+        proximoBuddy[anteriorBuddy[i]] = proximoBuddy[i];
+    else
+        listasBuddy[k] = proximoBuddy[i];
+    if (proximoBuddy[i] >= 0)
+        anteriorBuddy[proximoBuddy[i]] = anteriorBuddy[i];
+    ordemBuddy[i] = -1;
+}
+
+void buddy_por(long i, int k) {
+    ordemBuddy[i] = (int8_t)k;
+    anteriorBuddy[i] = -1;
+    proximoBuddy[i] = listasBuddy[k];
+    if (listasBuddy[k] >= 0)
+        anteriorBuddy[listasBuddy[k]] = i;
+    listasBuddy[k] = i;
+}
+
+/* Põe nas listas o pedaço livre de ordem k em 'i', fundindo-o com os pares livres. */
+void buddy_fundir(long i, int k) {
+    while (k + 1 < ORDENS_BUDDY) {
+        long par = i ^ (1L << k);
+        if (par + (1L << k) > totalBlocos || ordemBuddy[par] != k)
+            break;
+        buddy_tirar(par);
+        i &= ~(1L << k);
+        k++;
+    }
+    buddy_por(i, k);
+}
+
+/* Quebra a faixa livre [inicio, inicio + n) nos maiores pedaços alinhados e os põe nas listas. */
+void buddy_faixa(long inicio, long n) {
+    while (n > 0) {
+        int k = inicio > 0 ? __builtin_ctzl(inicio) : ORDENS_BUDDY - 1;
+        if (k > ORDENS_BUDDY - 1)
+            k = ORDENS_BUDDY - 1;
+        while ((1L << k) > n)
+            k--;
+        buddy_fundir(inicio, k);
+        inicio += 1L << k;
+        n -= 1L << k;
+    }
+}
+
+void buddy_iniciar() {
+    buddy_encerrar();
+    ordemBuddy = (int8_t*)malloc(totalBlocos);
+    proximoBuddy = (long*)malloc(totalBlocos * sizeof(long));
+    anteriorBuddy = (long*)malloc(totalBlocos * sizeof(long));
+    if (ordemBuddy == NULL || proximoBuddy == NULL || anteriorBuddy == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        exit(1);
+    }
+    memset(ordemBuddy, -1, totalBlocos);
+    for (int k = 0; k < ORDENS_BUDDY; k++)
+        listasBuddy[k] = -1;
+    long ini, n;
+    for (long de = 0; (n = corrida_livre(de, totalBlocos, &ini)) > 0; de = ini + n)
+        buddy_faixa(ini, n);
+}
+
+void buddy_encerrar() {
+    free(ordemBuddy);
+    free(proximoBuddy);
+    free(anteriorBuddy);
+    ordemBuddy = NULL;
+    proximoBuddy = anteriorBuddy = NULL;
+}
+
+long buddy_alocar(long desejado, int exato, long *inicio) {
+    int k = 0;
+    while (k < ORDENS_BUDDY - 1 && (1L << k) < desejado)
+        k++;
+    pthread_mutex_lock(&travaBuddy);
+    int j = k;
+    while (j < ORDENS_BUDDY && listasBuddy[j] < 0)
+        j++;
+    if (j == ORDENS_BUDDY) {
+        /* Nenhum pedaço comporta o pedido: sem 'exato', usa o maior que houver. */
+        for (j = k - 1; j >= 0 && listasBuddy[j] < 0; j--)
+            ;
+        if (exato || j < 0) {
+            pthread_mutex_unlock(&travaBuddy);
+            return 0;
+        }
+    }
+    long s = listasBuddy[j];
+    buddy_tirar(s);
+    while (j > k) {
+        j--;
+        buddy_por(s + (1L << j), j);
+    }
+    long n = (1L << j) < desejado ? (1L << j) : desejado;
+    if ((1L << j) > n)
+        buddy_faixa(s + n, (1L << j) - n);
+    long obtido = tomar_corrida(s, n);
+    pthread_mutex_unlock(&travaBuddy);
+    *inicio = s;
+    return obtido;
+}
+
+void buddy_liberar(long inicio, long tamanho) {
+    pthread_mutex_lock(&travaBuddy);
+    buddy_faixa(inicio, tamanho);
+    pthread_mutex_unlock(&travaBuddy);
+}
+
+PoliticaAlocacao* politica_buscar(const char *nome) {
+    for (PoliticaAlocacao *p = politicas; p->nome != NULL; p++)
+        if (!strcmp(p->nome, nome))
+            return p;
+    return NULL;
+}
+
+/* Troca a política em uso, montando o estado da nova a partir do bitmap. */
+void politica_trocar(PoliticaAlocacao *p) {
+    if (politica->encerrar != NULL)
+        politica->encerrar();
+    politica = p;
+    if (politica->iniciar != NULL)
+        politica->iniciar();
+}
+
+void politica_cmd() {
+    if (argList[1] == NULL) {
+        printf("Política de alocação: %s. Disponíveis:", politica->nome);
+        for (PoliticaAlocacao *p = politicas; p->nome != NULL; p++)
+            printf(" %s", p->nome);
+        printf("\n");
+        return;
+    }
+    PoliticaAlocacao *p = politica_buscar(argList[1]);
+    if (p == NULL) {
+        printf("Erro: política '%s' desconhecida.\n", argList[1]);
+        return;
+    }
+    politica_trocar(p);
+    printf("Política de alocação: %s.\n", politica->nome);
+}
+
+
+/* Buraco só emenda em buraco, e uma extensão com blocos só na anterior que termina onde ela começa. */
+int extensao_emenda(Extensao *ultima, long inicio) {
+    if (inicio == BURACO || ultima->inicio == BURACO)
+        return inicio == ultima->inicio;
+    return ultima->inicio + ultima->tamanho == inicio;
+}
+
+int arquivo_adicionar_extensao(Arquivo *arq, long inicio, long tamanho) {
+    if (arq->numExt > 0) {
+        Extensao *ultima = &arq->ext[arq->numExt - 1];
+        if (extensao_emenda(ultima, inicio)) {
+            ultima->tamanho += tamanho;
+            return 0;
+        }
+    }
+    if (arq->numExt == arq->capExt) {
+        int cap = arq->capExt ? arq->capExt * 2 : 4;
+        Extensao *novo = (Extensao*)arena_realocar(arq->ext, arq->capExt * sizeof(Extensao), cap * sizeof(Extensao));
+        if (novo == NULL)
+            return -1;
+        arq->ext = novo;
+        arq->capExt = cap;
+    }
+    arq->ext[arq->numExt].inicio = inicio;
+    arq->ext[arq->numExt].tamanho = tamanho;
+    arq->numExt++;
+    /* Buracos não fragmentam: conta só se a extensão não continua no disco a anterior com blocos. */
+    if (inicio != BURACO && !arq->fragmentado) {
+        int j = arq->numExt - 2;
+        while (j >= 0 && arq->ext[j].inicio == BURACO)
+            j--;
+        if (j >= 0 && arq->ext[j].inicio + arq->ext[j].tamanho != inicio)
+            frag_ligar(arq);
+    }
+    return 0;
+}
+
+/* 1 se alguma extensão com blocos de 'arq' não continua no disco a anterior com blocos. */
+int arquivo_fragmentado(Arquivo *arq) {
+    long fim = BURACO;
+    for (int j = 0; j < arq->numExt; j++) {
+        if (arq->ext[j].inicio == BURACO)
+            continue;
+        if (fim != BURACO && arq->ext[j].inicio != fim)
+            return 1;
+        fim = arq->ext[j].inicio + arq->ext[j].tamanho;
+    }
+    return 0;
+}
+
+/* Liga ou desliga 'arq' da lista de fragmentados depois que as extensões foram refeitas. */
+void frag_atualizar(Arquivo *arq) {
+    int f = arquivo_fragmentado(arq);
+    if (f && !arq->fragmentado)
+        frag_ligar(arq);
+    else if (!f && arq->fragmentado)
+        frag_desligar(arq);
+}
+
+/* Primeiro bloco com dados de 'arq' (o que o inode guarda como posição), ou a cauda, ou -1. */
+long arquivo_posicao(Arquivo *arq) {
+    for (int j = 0; j < arq->numExt; j++)
+        if (arq->ext[j].inicio != BURACO)
+            return arq->ext[j].inicio;
+    return arq->caudaFatias > 0 ? arq->cauda : -1;
+}
+
+void arquivo_liberar(Arquivo *arq) {
+    if (arq->fragmentado)
+        frag_desligar(arq);
+    cauda_liberar(arq);
+    for (int j = 0; j < arq->numExt; j++)
+        if (arq->ext[j].inicio != BURACO)
+            liberar_extensao(arq->ext[j].inicio, arq->ext[j].tamanho);
+    arena_liberar(arq->ext, arq->capExt * sizeof(Extensao));
+    pool_liberar(&poolArquivos, arq);
+}
+
+/* Solta uma das entradas que apontam 'arq'; os blocos só voltam ao bitmap quando a última sai. */
+void arquivo_soltar(Arquivo *arq) {
+    if (arq->compartilhado > 0) {
+        arq->compartilhado--;
+        return;
+    }
+    arquivo_liberar(arq);
+}
+
+/* Põe 'arq' no fim da lista de arquivos fragmentados. */
+void frag_ligar(Arquivo *arq) {
+    pthread_mutex_lock(&travaFrag);
+    arq->proxFrag = NULL;
+    arq->antFrag = fragFim;
+    if (fragFim != NULL)
+        fragFim->proxFrag = arq;
+    else
+        fragInicio = arq;
+    fragFim = arq;
+    arq->fragmentado = 1;
+    numFragmentados++;
+    pthread_mutex_unlock(&travaFrag);
+}
+
+void frag_desligar(Arquivo *arq) {
+    pthread_mutex_lock(&travaFrag);
+    if (arq->antFrag != NULL)
+        arq->antFrag->proxFrag = arq->proxFrag;
+    else
+        fragInicio = arq->proxFrag;
+    if (arq->proxFrag != NULL)
+        arq->proxFrag->antFrag = arq->antFrag;
+    else
+        fragFim = arq->antFrag;
+    arq->antFrag = arq->proxFrag = NULL;
+    arq->fragmentado = 0;
+    numFragmentados--;
+    pthread_mutex_unlock(&travaFrag);
+}
+
+/* FNV-1a sobre o nome, com o tipo misturado para separar arquivo e diretório homônimos. */
+unsigned hash_nome(const char *nome, int ehDir) {
+    unsigned h = 2166136261u;
+    while (*nome) {
+        h ^= (unsigned char)*nome++;
+        h *= 16777619u;
+    }
+    h ^= ehDir ? SAL_DIR : 0;
+    return h;
+}
+
+Diretorio* dir_criar() {
+    Diretorio *d = (Diretorio*)pool_alocar(&poolDiretorios);
+    if (d == NULL)
+        return NULL;
+    d->capTabela = 8;
+    d->numFilhos = 0;
+    d->carregado = 1;
+    d->agregados = &d->proprios;
+    d->tabela = (Bloco**)arena_alocar(d->capTabela * sizeof(Bloco*));
+    if (d->tabela == NULL) {
+        pool_liberar(&poolDiretorios, d);
+        return NULL;
+    }
+    pthread_rwlock_init(&d->trava, NULL);
+    return d;
+}
+
+void dir_destruir(Diretorio *d) {
+    if (d == NULL)
+        return;
+    pthread_rwlock_destroy(&d->trava);
+    arena_liberar(d->tabela, d->capTabela * sizeof(Bloco*));
+    pool_liberar(&poolDiretorios, d);
+}
+
+Bloco* dir_buscar(Bloco *pai, const char *nome, int ehDir) {
+    dir_carregar(pai);
+    Diretorio *d = pai->dir;
+    unsigned h = hash_nome(nome, ehDir);
+    Bloco *b = d->tabela[h & (d->capTabela - 1)];
+    while (b != NULL) {
+        if (b->hash == h && (b->arq == NULL) == (ehDir != 0) && (b->nome == nome || strcmp(b->nome, nome) == 0))
+            return b;
+        b = b->proxHash;
+    }
+    return NULL;
+}
+
+/* Dobra a tabela quando o fator de carga passa de 1; o encadeamento é refeito pelos hashes guardados. */
+int dir_crescer(Diretorio *d) {
+    unsigned cap = d->capTabela * 2;
+    Bloco **tabela = (Bloco**)arena_alocar(cap * sizeof(Bloco*));
+    if (tabela == NULL)
+        return -1;
+    for (unsigned k = 0; k < d->capTabela; k++) {
+        Bloco *b = d->tabela[k];
+        while (b != NULL) {
+            Bloco *prox = b->proxHash;
+            b->proxHash = tabela[b->hash & (cap - 1)];
+            tabela[b->hash & (cap - 1)] = b;
+            b = prox;
+        }
+    }
+    arena_liberar(d->tabela, d->capTabela * sizeof(Bloco*));
+    d->tabela = tabela;
+    d->capTabela = cap;
+    return 0;
+}
+
+/* Liga 'novo' no início da lista de filhos de 'pai' (mesma ordem de listagem de antes) e no índice. */
+int dir_inserir(Bloco *pai, Bloco *novo) {
+    dir_carregar(pai);
+    return dir_ligar(pai, novo);
+}
+
+/* dir_inserir sem carregar 'pai' do volume; usada pelo próprio carregamento. */
+int dir_ligar(Bloco *pai, Bloco *novo) {
+    Diretorio *d = pai->dir;
+    if (d->numFilhos >= d->capTabela && dir_crescer(d) != 0)
+        return -1;
+    /* O hash do nome já está no nome internado; só falta misturar o tipo. */
+    NomeInterno *ni = (NomeInterno*)(novo->nome - offsetof(NomeInterno, texto));
+    novo->hash = ni->hash ^ (novo->arq == NULL ? SAL_DIR : 0);
+    novo->proxHash = d->tabela[novo->hash & (d->capTabela - 1)];
+    d->tabela[novo->hash & (d->capTabela - 1)] = novo;
+    novo->ant = NULL;
+    novo->prox = pai->filho;
+    if (pai->filho != NULL)
+        pai->filho->ant = novo;
+    pai->filho = novo;
+    d->numFilhos++;
+    if (novo->dir != NULL)
+        novo->dir->pai = pai;
+    return 0;
+}
+
+/*
+ * Soma (sinal = 1) ou subtrai (sinal = -1) 'u' nos agregados diretos de
+ * 'd' e nos totais de 'd' e de todos os seus ancestrais. Chamada com 'd'
+ * travado para escrita; os ancestrais não estão travados, então as somas
+ * são atômicas. Nenhum ancestral pode sumir no meio, porque um diretório
+ * só é removido vazio.
+ */
+void agregados_somar(Bloco *d, Uso u, int sinal) {
+    Agregados *a = d->dir->agregados;
+    __atomic_fetch_add(&a->direto.arquivos, sinal * u.arquivos, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&a->direto.diretorios, sinal * u.diretorios, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&a->direto.bytes, sinal * u.bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&a->direto.blocos, sinal * u.blocos, __ATOMIC_RELAXED);
+    agregados_subir(d, u, sinal);
+}
+
+/* Só a parte dos totais de agregados_somar: 'u' está abaixo dos filhos diretos de 'd' (ver mover). */
+void agregados_subir(Bloco *d, Uso u, int sinal) {
+    for (Bloco *b = d; b != NULL; b = b->dir->pai) {
+        Agregados *a = b->dir->agregados;
+        __atomic_fetch_add(&a->total.arquivos, sinal * u.arquivos, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&a->total.diretorios, sinal * u.diretorios, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&a->total.bytes, sinal * u.bytes, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&a->total.blocos, sinal * u.blocos, __ATOMIC_RELAXED);
+        diario_sujar(a, sizeof(Agregados));
+    }
+}
+
+/* Blocos alocados de 'arq', sem os buracos nem a cauda. */
+long arquivo_blocos(Arquivo *arq) {
+    long n = 0;
+    for (int j = 0; j < arq->numExt; j++)
+        if (arq->ext[j].inicio != BURACO)
+            n += arq->ext[j].tamanho;
+    return n;
+}
+
+/* Bytes que 'arq' ocupa no disco: os blocos alocados e as fatias da cauda. */
+long arquivo_bytes_alocados(Arquivo *arq) {
+    return arquivo_blocos(arq) * tamBloco + arq->caudaFatias * (tamBloco / FATIAS_CAUDA);
+}
+
+/* Blocos lógicos que as extensões cobrem, buracos incluídos. */
+long arquivo_blocos_logicos(Arquivo *arq) {
+    long n = 0;
+    for (int j = 0; j < arq->numExt; j++)
+        n += arq->ext[j].tamanho;
+    return n;
+}
+
+void dir_remover(Bloco *pai, Bloco *alvo) {
+    Diretorio *d = pai->dir;
+    Bloco **pp = &d->tabela[alvo->hash & (d->capTabela - 1)];
+    while (*pp != alvo)
+        pp = &(*pp)->proxHash;
+    *pp = alvo->proxHash;
+
+    if (alvo->ant != NULL)
+        alvo->ant->prox = alvo->prox;
+    else
+        pai->filho = alvo->prox;
+    if (alvo->prox != NULL)
+        alvo->prox->ant = alvo->ant;
+    d->numFilhos--;
+}
+
+void dir_travar(Bloco *b, int escrita) {
+    if (escrita)
+        pthread_rwlock_wrlock(&b->dir->trava);
+    else
+        pthread_rwlock_rdlock(&b->dir->trava);
+}
+
+int dir_tentar_travar(Bloco *b, int escrita) {
+    if (escrita)
+        return pthread_rwlock_trywrlock(&b->dir->trava) == 0;
+    return pthread_rwlock_tryrdlock(&b->dir->trava) == 0;
+}
+
+void dir_destravar(Bloco *b) {
+    pthread_rwlock_unlock(&b->dir->trava);
+}
+
+/* Remove barras repetidas, iniciais e finais, no próprio buffer ("/a//b/" vira "a/b"). */
+void normalizar_caminho(char *caminho) {
+    char *l = caminho, *e = caminho;
+    while (*l) {
+        if (*l == '/' && (e == caminho || e[-1] == '/')) {
+            l++;
+            continue;
+        }
+        *e++ = *l++;
+    }
+    if (e > caminho && e[-1] == '/')
+        e--;
+    *e = '\0';
+}
+
+EntradaCache* cache_buscar(const char *caminho, unsigned h) {
+    EntradaCache *e = tabelaCache[h & (TAM_CACHE_CAMINHOS * 2 - 1)];
+    while (e != NULL) {
+        if (e->hash == h && strcmp(e->caminho, caminho) == 0)
+            return e;
+        e = e->proxHash;
+    }
+    return NULL;
+}
+
+void cache_desligar_lru(EntradaCache *e) {
+    if (e->antLRU != NULL)
+        e->antLRU->proxLRU = e->proxLRU;
+    else
+        lruInicio = e->proxLRU;
+    if (e->proxLRU != NULL)
+        e->proxLRU->antLRU = e->antLRU;
+    else
+        lruFim = e->antLRU;
+}
+
+void cache_ligar_lru(EntradaCache *e) {
+    e->antLRU = NULL;
+    e->proxLRU = lruInicio;
+    if (lruInicio != NULL)
+        lruInicio->antLRU = e;
+    lruInicio = e;
+    if (lruFim == NULL)
+        lruFim = e;
+}
+
+void cache_desligar_hash(EntradaCache *e) {
+    EntradaCache **pp = &tabelaCache[e->hash & (TAM_CACHE_CAMINHOS * 2 - 1)];
+    while (*pp != e)
+        pp = &(*pp)->proxHash;
+    *pp = e->proxHash;
+}
+
+void cache_inserir(const char *caminho, unsigned h, Bloco *no) {
+    if (strlen(caminho) >= MAX_CAMINHO)
+        return;
+    EntradaCache *e;
+    if (vagasCache != NULL) {
+        e = vagasCache;
+        vagasCache = e->proxHash;
+    } else if (numEntradasCache < TAM_CACHE_CAMINHOS) {
+        e = &entradasCache[numEntradasCache++];
+    } else {
+        e = lruFim;
+        cache_desligar_lru(e);
+        cache_desligar_hash(e);
+    }
+    strcpy(e->caminho, caminho);
+    e->hash = h;
+    e->no = no;
+    e->proxHash = tabelaCache[h & (TAM_CACHE_CAMINHOS * 2 - 1)];
+    tabelaCache[h & (TAM_CACHE_CAMINHOS * 2 - 1)] = e;
+    cache_ligar_lru(e);
+}
+
+/* Descarta a entrada de 'caminho' (já normalizado), se houver; a posição volta para a lista de vagas. */
+void cache_invalidar(const char *caminho) {
+    pthread_mutex_lock(&travaCache);
+    EntradaCache *e = cache_buscar(caminho, hash_nome(caminho, 1));
+    if (e != NULL) {
+        cache_desligar_hash(e);
+        cache_desligar_lru(e);
+        e->no = NULL;
+        e->proxHash = vagasCache;
+        vagasCache = e;
+    }
+    pthread_mutex_unlock(&travaCache);
+}
+
+/*
+ * Descarta as entradas de diretórios cujo pai é 'b'. Usada depois de
+ * dir_copiar: as entradas novas dos filhos ainda não estão no cache, então
+ * as que sobram com esse pai são as antigas, que agora são só dos
+ * instantâneos. O caminho do próprio 'b' e os mais fundos continuam valendo.
+ */
+void cache_invalidar_filhos(Bloco *b) {
+    pthread_mutex_lock(&travaCache);
+    for (int i = 0; i < numEntradasCache; i++) {
+        EntradaCache *e = &entradasCache[i];
+        if (e->no == NULL || e->no->dir->pai != b)
+            continue;
+        cache_desligar_hash(e);
+        cache_desligar_lru(e);
+        e->no = NULL;
+        e->proxHash = vagasCache;
+        vagasCache = e;
+    }
+    pthread_mutex_unlock(&travaCache);
+}
+
+void cache_limpar() {
+    memset(tabelaCache, 0, sizeof(tabelaCache));
+    lruInicio = lruFim = NULL;
+    vagasCache = NULL;
+    numEntradasCache = 0;
+}
+
+/*
+ * Resolve o diretório indicado por 'caminho' (normalizado no próprio buffer).
+ * Caminhos já vistos saem do cache com uma única busca; os demais são
+ * percorridos componente a componente pelo índice de cada diretório e o
+ * resultado entra no cache. Em caso de erro, imprime a mensagem e devolve NULL.
+ *
+ * O diretório é devolvido travado (para escrita se 'escrita') e o chamador o
+ * solta com dir_destravar. Na descida cada componente é travado antes de o
+ * anterior ser solto, então ninguém remove um diretório que está sendo
+ * atravessado. Pelo cache a trava do diretório só é tentada, já que removed
+ * segura o diretório antes de pedir travaCache; se a tentativa falha, o
+ * caminho é percorrido normalmente.
+ */
+Bloco* resolver_dir(char *caminho, int escrita) {
+    normalizar_caminho(caminho);
+    if (escrita && numInstantaneos > 0)
+        return resolver_copiando(caminho);
+    if (*caminho == '\0') {
+        dir_travar(raiz, escrita);
+        return raiz;
+    }
+
+    unsigned h = hash_nome(caminho, 1);
+    pthread_mutex_lock(&travaCache);
+    EntradaCache *e = cache_buscar(caminho, h);
+    if (e != NULL && dir_tentar_travar(e->no, escrita)) {
+        Bloco *no = e->no;
+        cache_desligar_lru(e);
+        cache_ligar_lru(e);
+        pthread_mutex_unlock(&travaCache);
+        return no;
+    }
+    pthread_mutex_unlock(&travaCache);
+
+    char componente[MAX_CAMINHO];
+    Bloco* atual = raiz;
+    dir_travar(atual, 0);
+    const char *p = caminho;
+    while (*p) {
+        const char *fim = strchr(p, '/');
+        size_t len = fim ? (size_t)(fim - p) : strlen(p);
+        if (len >= sizeof(componente))
+            len = sizeof(componente) - 1;
+        memcpy(componente, p, len);
+        componente[len] = '\0';
+        Bloco* proximo = dir_buscar(atual, componente, 1);
+        if (proximo == NULL) {
+            dir_destravar(atual);
+            printf("Erro: diretório '%s' não encontrado.\n", componente);
+            return NULL;
+        }
+        dir_travar(proximo, fim == NULL ? escrita : 0);
+        dir_destravar(atual);
+        atual = proximo;
+        p = fim ? fim + 1 : p + len;
+    }
+    pthread_mutex_lock(&travaCache);
+    if (cache_buscar(caminho, h) == NULL)
+        cache_inserir(caminho, h, atual);
+    pthread_mutex_unlock(&travaCache);
+    return atual;
+}
+
+/*
+ * Separa o último componente de 'caminho' em *nome e resolve o diretório que
+ * o contém, travado como em resolver_dir. O buffer é normalizado e cortado no
+ * lugar, como o strtok fazia.
+ */
+Bloco* resolver_pai(char *caminho, char **nome, int escrita) {
+    normalizar_caminho(caminho);
+    char *barra = strrchr(caminho, '/');
+    *nome = barra == NULL ? caminho : barra + 1;
+    if (**nome == '\0') {
+        printf("Erro: caminho inválido.\n");
+        return NULL;
+    }
+    if (strlen(*nome) >= MAX_NOME) {
+        printf("Erro: nome '%s' muito longo.\n", *nome);
+        return NULL;
+    }
+    if (barra == NULL) {
+        if (escrita && numInstantaneos > 0)
+            return resolver_copiando("");
+        dir_travar(raiz, escrita);
+        return raiz;
+    }
+    *barra = '\0';
+    Bloco* pai = resolver_dir(caminho, escrita);
+    *barra = '/';
+    return pai;
+}
+
+/*
+ * resolver_dir para escrita enquanto há instantâneos, com o volume
+ * exclusivo: cada diretório compartilhado no caminho, a raiz inclusive,
+ * ganha uma cópia própria antes de a descida continuar, então o diretório
+ * devolvido e todos os seus ancestrais são só da árvore atual. Os pais são
+ * religados na descida, para agregados_somar subir pelo caminho certo.
+ */
+Bloco* resolver_copiando(const char *caminho) {
+    if (raiz->dir->compartilhado > 0 && dir_copiar(raiz) != 0)
+        return NULL;
+    char componente[MAX_CAMINHO];
+    Bloco *atual = raiz;
+    const char *p = caminho;
+    while (*p) {
+        const char *fim = strchr(p, '/');
+        size_t len = fim ? (size_t)(fim - p) : strlen(p);
+        if (len >= sizeof(componente))
+            len = sizeof(componente) - 1;
+        memcpy(componente, p, len);
+        componente[len] = '\0';
+        Bloco *proximo = dir_buscar(atual, componente, 1);
+        if (proximo == NULL) {
+            printf("Erro: diretório '%s' não encontrado.\n", componente);
+            return NULL;
+        }
+        if (proximo->dir->compartilhado > 0 && dir_copiar(proximo) != 0)
+            return NULL;
+        proximo->dir->pai = atual;
+        atual = proximo;
+        p = fim ? fim + 1 : p + len;
+    }
+    dir_travar(atual, 1);
+    return atual;
+}
+
+/* Formata 't' em 'destino' (20 bytes). Entradas criadas no mesmo segundo reaproveitam a última formatação. */
+void formatar_data(int64_t t, char *destino) {
+    static _Thread_local int64_t ultimo = -1;
+    static _Thread_local char formatada[20];
+    if (t != ultimo) {
+        time_t now = (time_t)t;
+        struct tm tm;
+        struct tm *ptm = localtime_r(&now, &tm);
+
+        if (ptm != NULL) {
+            strftime(formatada, sizeof(formatada), "%d/%m/%Y %H:%M:%S", ptm);
+        } else {
+            strcpy(formatada, "Data Inválida");
+        }
+        ultimo = t;
+    }
+    memcpy(destino, formatada, sizeof(formatada));
+}
+
+int tam_bloco_valido(long tam) {
+    return tam >= TAM_BLOCO_MIN && tam <= TAM_BLOCO_MAX && (tam & (tam - 1)) == 0;
+}
+
+/*
+ * Volume persistente. A imagem é o próprio disco: o bloco n fica no byte
+ * n * tamBloco do arquivo, e os blocos reservados guardam o superbloco, o bitmap
+ * (blocosLivres), o resumo (resumoLivres) e a tabela de inodes. O arquivo
+ * inteiro é mapeado com mmap e os comandos alteram essas estruturas direto
+ * no mapeamento, então abrir um volume grande não lê nada além do
+ * superbloco. Os Blocos em memória são materializados sob demanda: um
+ * diretório só carrega seus filhos da tabela de inodes no primeiro acesso.
+ */
+int volume_calcular_layout(Superbloco *sb) {
+    long palavras = (sb->totalBlocos + 63) / 64;
+    long resumo = (palavras + 63) / 64;
+    int64_t off = 512;
+    sb->offBitmap = off;
+    off += (palavras * 8 + 511) / 512 * 512;
+    sb->offResumo = off;
+    off += (resumo * 8 + 511) / 512 * 512;
+    sb->offInodes = off;
+    off += ((int64_t)sb->numInodes * sizeof(InodeDisco) + 511) / 512 * 512;
+    if (sb->blocosReservados < (off + sb->tamBloco - 1) / sb->tamBloco)
+        sb->blocosReservados = (off + sb->tamBloco - 1) / sb->tamBloco;
+    return sb->blocosReservados < sb->totalBlocos ? 0 : -1;
+}
+
+void volume_apontar() {
+    super = (Superbloco*)mapaVolume;
+    totalBlocos = super->totalBlocos;
+    blocosReservados = super->blocosReservados;
+    numPalavras = (totalBlocos + 63) / 64;
+    numResumo = (numPalavras + 63) / 64;
+    blocosLivres = (uint64_t*)(mapaVolume + super->offBitmap);
+    resumoLivres = (uint64_t*)(mapaVolume + super->offResumo);
+    inodes = (InodeDisco*)(mapaVolume + super->offInodes);
+    dicaResumo = 0;
+}
+
+/*
+ * Abre a imagem em 'caminho', ou cria e formata uma nova com os parâmetros
+ * atuais (totalBlocos, blocosReservados, numInodes) se ela não existir.
+ * Um diário deixado por uma sessão com -j é refeito antes de qualquer
+ * leitura; com 'comDiario' a imagem é mapeada como privada e as alterações
+ * passam a ir para o disco pelo diário.
+ */
+int volume_abrir(const char *caminho, int numInodes, int comDiario) {
+    char caminhoDiario[MAX_CAMINHO + 8];
+    snprintf(caminhoDiario, sizeof(caminhoDiario), "%s.diario", caminho);
+    int novo = 0;
+    int fd = open(caminho, O_RDWR);
+    if (fd < 0) {
+        fd = open(caminho, O_RDWR | O_CREAT | O_EXCL, 0644);
+        novo = 1;
+    }
+    if (fd < 0) {
+        printf("Erro: não foi possível abrir a imagem '%s'.\n", caminho);
+        return -1;
+    }
+    /* Um diário de outra imagem com o mesmo nome não pode ser refeito sobre esta. */
+    if (novo)
+        unlink(caminhoDiario);
+    else if (diario_recuperar(fd, caminhoDiario) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    Superbloco sb;
+    if (novo) {
+        memset(&sb, 0, sizeof(sb));
+        sb.magico = MAGICO_VOLUME;
+        sb.versao = VERSAO_VOLUME;
+        sb.totalBlocos = totalBlocos;
+        sb.blocosReservados = blocosReservados;
+        sb.numInodes = numInodes;
+        sb.tamBloco = (int32_t)tamBloco;
+        if (volume_calcular_layout(&sb) != 0 || ftruncate(fd, (off_t)totalBlocos * tamBloco) != 0) {
+            printf("Erro: disco pequeno demais para os metadados do volume.\n");
+            close(fd);
+            unlink(caminho);
+            return -1;
+        }
+    } else if (pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb) || sb.magico != MAGICO_VOLUME
+               || sb.versao != VERSAO_VOLUME || (sb.tamBloco != 0 && !tam_bloco_valido(sb.tamBloco))) {
+        printf("Erro: '%s' não é uma imagem de volume válida.\n", caminho);
+        close(fd);
+        return -1;
+    } else {
+        tamBloco = sb.tamBloco != 0 ? sb.tamBloco : TAM_BLOCO_MIN;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sb.totalBlocos * tamBloco) {
+        printf("Erro: imagem '%s' truncada.\n", caminho);
+        close(fd);
+        return -1;
+    }
+    tamMapa = (size_t)sb.totalBlocos * tamBloco;
+    mapaVolume = (unsigned char*)mmap(NULL, tamMapa, PROT_READ | PROT_WRITE, comDiario ? MAP_PRIVATE : MAP_SHARED,
+                                      fd, 0);
+    if (mapaVolume == MAP_FAILED) {
+        printf("Erro: falha ao mapear a imagem '%s'.\n", caminho);
+        close(fd);
+        mapaVolume = NULL;
+        return -1;
+    }
+    fdVolume = fd;
+
+    if (novo) {
+        memcpy(mapaVolume, &sb, sizeof(sb));
+        volume_apontar();
+        formatar_bitmap();
+        InodeDisco *r = &inodes[0];
+        strcpy(r->nome, "raiz");
+        r->tipo = TIPO_DIR;
+        r->criado = time(NULL);
+        r->pai = r->filho = r->prox = r->ant = -1;
+        r->extIndireto = -1;
+        super->proximoInode = 1;
+        super->inodeLivre = -1;
+        super->espacosLivres = espacosLivres;
+        printf("Volume '%s' formatado: %ld blocos, %ld reservados, %d inodes.\n",
+               caminho, totalBlocos, blocosReservados, super->numInodes);
+    } else {
+        volume_apontar();
+        if (super->limpo) {
+            espacosLivres = super->espacosLivres;
+        } else {
+            /*
+             * Não foi fechado corretamente: o contador e o resumo podem estar
+             * velhos (nenhum dos dois passa pelo diário), refazemos pelo bitmap.
+             */
+            espacosLivres = 0;
+            memset(resumoLivres, 0, numResumo * sizeof(uint64_t));
+            for (long w = 0; w < numPalavras; w++) {
+                espacosLivres += __builtin_popcountll(blocosLivres[w]);
+                if (blocosLivres[w])
+                    resumoLivres[w >> 6] |= (uint64_t)1 << (w & 63);
+            }
+        }
+        printf("Volume '%s' aberto: %ld blocos, %ld livres.\n", caminho, totalBlocos, espacosLivres);
+    }
+    super->limpo = 0;
+    if (comDiario) {
+        /* O mapeamento é privado: o formato novo, ou o 'limpo' apagado, tem de ir para o arquivo agora. */
+        if (diario_abrir(caminhoDiario) != 0 || volume_gravar_metadados(novo ? blocosReservados : 1) != 0) {
+            diario_fechar();
+            munmap(mapaVolume, tamMapa);
+            close(fd);
+            mapaVolume = NULL;
+            fdVolume = -1;
+            return -1;
+        }
+        printf("Diário '%s' ativo.\n", caminhoDiario);
+    }
+    return 0;
+}
+
+/* Grava os 'blocos' primeiros blocos do mapeamento na imagem e espera o disco (modo com diário). */
+int volume_gravar_metadados(long blocos) {
+    if (gravar_em(fdVolume, mapaVolume, (size_t)blocos * tamBloco, 0) != 0 || fsync(fdVolume) != 0) {
+        printf("Erro: falha ao gravar os metadados do volume.\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Sem diário, o msync leva o mapeamento inteiro para a imagem. Com diário,
+ * os dados já foram gravados por buf_sincronizar: as transações pendentes
+ * são confirmadas, os metadados inteiros (com o resumo e o contador de
+ * livres) vão para o lugar e o diário pode ser esvaziado.
+ */
+void volume_sincronizar() {
+    if (mapaVolume == NULL)
+        return;
+    buf_sincronizar();
+    super->espacosLivres = espacosLivres;
+    if (diarioAtivo) {
+        diario_forcar();
+        if (volume_gravar_metadados(blocosReservados) != 0)
+            return;
+        pthread_mutex_lock(&diario.trava);
+        if (!diario.gravando && diario_zerar(diario.fd, diario.seq) == 0)
+            diario.fim = 512;
+        pthread_mutex_unlock(&diario.trava);
+        return;
+    }
+    if (msync(mapaVolume, tamMapa, MS_SYNC) != 0)
+        printf("Erro: falha ao sincronizar o volume.\n");
+}
+
+void volume_fechar() {
+    if (mapaVolume == NULL)
+        return;
+    super->limpo = 1;
+    volume_sincronizar();
+    diario_fechar();
+    munmap(mapaVolume, tamMapa);
+    close(fdVolume);
+    mapaVolume = NULL;
+    fdVolume = -1;
+}
+
+int32_t inode_alocar() {
+    int32_t ino;
+    pthread_mutex_lock(&travaInodes);
+    if (super->inodeLivre >= 0) {
+        ino = super->inodeLivre;
+        super->inodeLivre = inodes[ino].prox;
+    } else if (super->proximoInode < super->numInodes) {
+        ino = super->proximoInode++;
+    } else {
+        ino = -1;
+    }
+    pthread_mutex_unlock(&travaInodes);
+    if (ino < 0)
+        return -1;
+    diario_sujar(super, sizeof(Superbloco));
+    memset(&inodes[ino], 0, sizeof(InodeDisco));
+    inodes[ino].pai = inodes[ino].filho = inodes[ino].prox = inodes[ino].ant = -1;
+    inodes[ino].extIndireto = -1;
+    diario_sujar(&inodes[ino], sizeof(InodeDisco));
+    return ino;
+}
+
+void inode_liberar(int32_t ino) {
+    InodeDisco *n = &inodes[ino];
+    inode_liberar_indiretos(n);
+    memset(n, 0, sizeof(InodeDisco));
+    pthread_mutex_lock(&travaInodes);
+    n->prox = super->inodeLivre;
+    super->inodeLivre = ino;
+    pthread_mutex_unlock(&travaInodes);
+    diario_sujar(n, sizeof(InodeDisco));
+    diario_sujar(super, sizeof(Superbloco));
+}
+
+/* Libera os blocos de extensões encadeados no inode. */
+void inode_liberar_indiretos(InodeDisco *n) {
+    int64_t ind = n->extIndireto;
+    while (ind >= 0) {
+        BlocoExtensoes *be = (BlocoExtensoes*)(mapaVolume + ind * tamBloco);
+        int64_t prox = be->prox;
+        liberar_extensao(ind, 1);
+        ind = prox;
+    }
+    n->extIndireto = -1;
+}
+
+/* Grava as extensões de 'arq' no inode: as primeiras EXT_INODE ficam no próprio inode, o resto em blocos encadeados. */
+int inode_gravar_extensoes(InodeDisco *n, Arquivo *arq) {
+    int j = 0;
+    n->cauda = arq->cauda;
+    n->caudaFatia = (uint8_t)arq->caudaFatia;
+    n->caudaFatias = (uint8_t)arq->caudaFatias;
+    n->numExt = arq->numExt;
+    for (; j < arq->numExt && j < EXT_INODE; j++)
+        n->ext[j] = arq->ext[j];
+    int64_t *elo = &n->extIndireto;
+    while (j < arq->numExt) {
+        long ind;
+        if (alocar_extensao(1, &ind) != 1)
+            return -1;
+        BlocoExtensoes *be = (BlocoExtensoes*)(mapaVolume + ind * tamBloco);
+        be->prox = -1;
+        be->num = 0;
+        for (; j < arq->numExt && be->num < EXT_POR_BLOCO; j++)
+            be->ext[be->num++] = arq->ext[j];
+        diario_sujar(be, sizeof(BlocoExtensoes));
+        *elo = ind;
+        elo = &be->prox;
+    }
+    return 0;
+}
+
+/* Cria o inode de 'b' (recém-ligado em memória) e o liga no início da lista de filhos do pai no disco. */
+int volume_registrar(Bloco *pai, Bloco *b) {
+    if (mapaVolume == NULL)
+        return 0;
+    int32_t ino = inode_alocar();
+    if (ino < 0) {
+        printf("Erro: tabela de inodes cheia.\n");
+        return -1;
+    }
+    InodeDisco *n = &inodes[ino];
+    Atributos *a = atributos(b);
+    strcpy(n->nome, b->nome);
+    n->tipo = b->arq == NULL ? TIPO_DIR : TIPO_ARQ;
+    n->tamanho = b->arq != NULL ? b->arq->tamanho : 0;
+    n->escritoAte = b->arq != NULL ? b->arq->escritoAte : 0;
+    n->criado = a->criado;
+    n->posicao = a->posicao;
+    if (b->arq != NULL && inode_gravar_extensoes(n, b->arq) != 0) {
+        printf("Erro: não há blocos livres para as extensões do arquivo.\n");
+        inode_liberar(ino);
+        return -1;
+    }
+    if (b->dir != NULL) {
+        n->agregados = *b->dir->agregados;
+        b->dir->agregados = &n->agregados;
+    }
+    inode_ligar(pai->dir->attr.ino, ino);
+    a->ino = ino;
+    return 0;
+}
+
+/* Liga o inode 'ino' no início da lista de filhos do inode 'pai'. */
+void inode_ligar(int32_t pai, int32_t ino) {
+    InodeDisco *p = &inodes[pai];
+    InodeDisco *n = &inodes[ino];
+    n->pai = pai;
+    n->ant = -1;
+    n->prox = p->filho;
+    if (p->filho >= 0) {
+        inodes[p->filho].ant = ino;
+        diario_sujar(&inodes[p->filho], sizeof(InodeDisco));
+    }
+    p->filho = ino;
+    diario_sujar(p, sizeof(InodeDisco));
+    diario_sujar(n, sizeof(InodeDisco));
+}
+
+/* Tira o inode 'ino' da lista de filhos do inode 'pai'. */
+void inode_desligar(int32_t pai, int32_t ino) {
+    InodeDisco *n = &inodes[ino];
+    InodeDisco *anterior = n->ant >= 0 ? &inodes[n->ant] : NULL;
+    if (anterior != NULL) {
+        anterior->prox = n->prox;
+        diario_sujar(anterior, sizeof(InodeDisco));
+    } else {
+        inodes[pai].filho = n->prox;
+        diario_sujar(&inodes[pai], sizeof(InodeDisco));
+    }
+    if (n->prox >= 0) {
+        inodes[n->prox].ant = n->ant;
+        diario_sujar(&inodes[n->prox], sizeof(InodeDisco));
+    }
+}
+
+void volume_desregistrar(Bloco *pai, Bloco *b) {
+    Atributos *a = atributos(b);
+    if (mapaVolume == NULL || a->ino < 0)
+        return;
+    inode_desligar(pai->dir->attr.ino, a->ino);
+    inode_liberar(a->ino);
+    a->ino = -1;
+}
+
+/*
+ * Passa o inode de 'b' da lista de 'pai' para o início da lista de
+ * 'destino', com o nome que 'b' tem agora. O inode, as extensões e, num
+ * diretório, os filhos no disco continuam onde estavam.
+ */
+void volume_mover(Bloco *pai, Bloco *destino, Bloco *b) {
+    Atributos *a = atributos(b);
+    if (mapaVolume == NULL || a->ino < 0)
+        return;
+    inode_desligar(pai->dir->attr.ino, a->ino);
+    strcpy(inodes[a->ino].nome, b->nome);
+    inode_ligar(destino->dir->attr.ino, a->ino);
+}
+
+Bloco* volume_materializar(int32_t ino) {
+    InodeDisco *n = &inodes[ino];
+    Bloco *b = (Bloco*)pool_alocar(&poolBlocos);
+    if (b == NULL)
+        return NULL;
+    Atributos *a;
+    if (n->tipo == TIPO_DIR) {
+        b->dir = dir_criar();
+        if (b->dir == NULL) {
+            pool_liberar(&poolBlocos, b);
+            return NULL;
+        }
+        b->dir->carregado = 0;
+        b->dir->agregados = &n->agregados;
+        a = &b->dir->attr;
+    } else {
+        b->arq = (Arquivo*)pool_alocar(&poolArquivos);
+        if (b->arq == NULL) {
+            pool_liberar(&poolBlocos, b);
+            return NULL;
+        }
+        b->arq->tamanho = n->tamanho;
+        b->arq->escritoAte = n->escritoAte;
+        /* Fatias impossíveis contam como sem cauda; um bloco fora do disco fica para o verifica. */
+        if (n->caudaFatias > 0 && n->caudaFatia >= 1 && n->caudaFatia + n->caudaFatias <= FATIAS_CAUDA) {
+            b->arq->cauda = n->cauda;
+            b->arq->caudaFatia = n->caudaFatia;
+            b->arq->caudaFatias = n->caudaFatias;
+        }
+        a = &b->arq->attr;
+    }
+    b->nome = nome_internar(n->nome);
+    a->criado = n->criado;
+    a->posicao = n->posicao;
+    a->ino = ino;
+    if (b->dir != NULL)
+        return b;
+
+    for (int j = 0; j < n->numExt && j < EXT_INODE; j++)
+        arquivo_adicionar_extensao(b->arq, n->ext[j].inicio, n->ext[j].tamanho);
+    /* Uma cadeia estragada (elo fora da área de dados, contagem impossível) é cortada ali; verifica aponta o resto. */
+    int64_t ind = n->extIndireto;
+    for (int passos = 0; ind >= blocosReservados && ind < totalBlocos && passos <= n->numExt / EXT_POR_BLOCO; passos++) {
+        BlocoExtensoes *be = (BlocoExtensoes*)(mapaVolume + ind * tamBloco);
+        for (int j = 0; j < be->num && j < EXT_POR_BLOCO; j++)
+            arquivo_adicionar_extensao(b->arq, be->ext[j].inicio, be->ext[j].tamanho);
+        ind = be->prox;
+    }
+    return b;
+}
+
+/*
+ * Traz os filhos de 'd' da tabela de inodes para a memória, se ainda não
+ * vieram. Pode ser chamada com 'd' travado só para leitura, então vários
+ * leitores podem chegar juntos: travaCarga deixa um só materializar, e
+ * 'carregado' só é ligado depois que a tabela está completa.
+ */
+void dir_carregar(Bloco *d) {
+    if (__atomic_load_n(&d->dir->carregado, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&travaCarga);
+    if (!d->dir->carregado)
+        dir_carregar_filhos(d);
+    __atomic_store_n(&d->dir->carregado, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&travaCarga);
+}
+
+void dir_carregar_filhos(Bloco *d) {
+    int n = 0;
+    for (int32_t f = inodes[d->dir->attr.ino].filho; f >= 0; f = inodes[f].prox)
+        n++;
+    int32_t *ordem = (int32_t*)malloc((n ? n : 1) * sizeof(int32_t));
+    if (ordem == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        return;
+    }
+    n = 0;
+    for (int32_t f = inodes[d->dir->attr.ino].filho; f >= 0; f = inodes[f].prox)
+        ordem[n++] = f;
+    /* dir_inserir põe no início da lista, então inserimos do último para o primeiro. */
+    while (n-- > 0) {
+        Bloco *b = volume_materializar(ordem[n]);
+        if (b == NULL || dir_ligar(d, b) != 0) {
+            printf("Erro: falha na alocação de memória.\n");
+            break;
+        }
+    }
+    free(ordem);
+}
+
+void sincronizar() {
+    long antes = statsBuffers.bytesGravados;
+    buf_sincronizar();
+    if (mapaVolume == NULL) {
+        printf("%ld bytes gravados; nenhum volume persistente aberto.\n", statsBuffers.bytesGravados - antes);
+        return;
+    }
+    volume_sincronizar();
+    printf("Volume sincronizado (%ld bytes de buffers gravados).\n", statsBuffers.bytesGravados - antes);
+}
+
+/*
+ * Diário de metadados (write-ahead log) do volume aberto com -j. A imagem é
+ * mapeada como privada, então o que os comandos alteram no mapeamento só
+ * chega ao arquivo por gravações explícitas, nesta ordem: primeiro no
+ * diário '<imagem>.diario', e só depois do fdatasync do diário no lugar
+ * definitivo (checkpoint).
+ *
+ * Cada comando que altera o volume é uma operação: diario_iniciar a põe na
+ * transação em curso e diario_sujar anota os pedaços de 512 bytes que ela
+ * altera (palavras do bitmap, superbloco, inodes, blocos de extensões). A
+ * transação é composta: quem confirma espera as operações abertas
+ * terminarem, copia todos os blocos anotados e grava descritor, blocos e
+ * registro de confirmação com um único fdatasync. Enquanto uma confirmação
+ * está no disco as novas operações já entram na próxima, então threads
+ * concorrentes (e os comandos de um roteiro, que nem esperam) dividem o
+ * mesmo fsync (group commit).
+ *
+ * Os dados dos arquivos não passam pelo diário, mas vão antes dele (modo
+ * ordenado): quem confirma grava os buffers sujos na imagem e faz o
+ * fdatasync dela antes de gravar a transação, para que um escritoAte ou uma
+ * extensão confirmados nunca apontem para o conteúdo antigo dos blocos.
+ *
+ * O resumo do bitmap e o contador de livres não passam pelo diário: são
+ * recalculados do bitmap sempre que o volume não foi fechado limpo.
+ */
+uint64_t soma_fnv(uint64_t h, const void *dados, size_t n) {
+    const unsigned char *p = (const unsigned char*)dados;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+int gravar_em(int fd, const void *dados, size_t n, off_t off) {
+    const unsigned char *p = (const unsigned char*)dados;
+    while (n > 0) {
+        ssize_t k = pwrite(fd, p, n, off);
+        if (k <= 0)
+            return -1;
+        p += k;
+        n -= k;
+        off += k;
+    }
+    return 0;
+}
+
+/* Deixa o diário só com o cabeçalho; a próxima transação gravada terá o número 'seq'. */
+int diario_zerar(int fd, int64_t seq) {
+    unsigned char bloco[512];
+    RegistroDiario cab = {MAGICO_DIARIO, VERSAO_DIARIO, seq, 0, 0};
+    memset(bloco, 0, sizeof(bloco));
+    memcpy(bloco, &cab, sizeof(cab));
+    if (gravar_em(fd, bloco, sizeof(bloco), 0) != 0 || ftruncate(fd, sizeof(bloco)) != 0 || fsync(fd) != 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * Refaz na imagem 'fdImagem' as transações completas do diário em
+ * 'caminho', em ordem, até a primeira incompleta ou corrompida (a que
+ * estava sendo gravada na queda), e esvazia o diário. Os registros são
+ * imagens inteiras de blocos, então refazer de novo depois de uma queda no
+ * meio da recuperação dá o mesmo resultado. Devolve quantas foram refeitas.
+ */
+long diario_recuperar(int fdImagem, const char *caminho) {
+    int fd = open(caminho, O_RDWR);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    RegistroDiario cab;
+    if (fstat(fdImagem, &st) != 0 || pread(fd, &cab, sizeof(cab), 0) != (ssize_t)sizeof(cab)
+        || cab.magico != MAGICO_DIARIO || cab.tipo != VERSAO_DIARIO) {
+        printf("Erro: diário '%s' inválido; ignorado.\n", caminho);
+        close(fd);
+        return 0;
+    }
+    long limite = st.st_size / 512;
+    int64_t seq = cab.seq;
+    off_t pos = 512;
+    unsigned char *dados = NULL;
+    size_t cap = 0;
+    long refeitas = 0;
+    for (;;) {
+        RegistroDiario d, c;
+        if (pread(fd, &d, sizeof(d), pos) != (ssize_t)sizeof(d) || d.magico != MAGICO_DIARIO
+            || d.tipo != REG_DESCRITOR || d.seq != seq || d.numBlocos <= 0 || d.numBlocos > limite)
+            break;
+        size_t tamDesc = (sizeof(d) + d.numBlocos * 8 + 511) / 512 * 512;
+        size_t total = tamDesc + d.numBlocos * 512 + 512;
+        if (total > cap) {
+            unsigned char *novo = (unsigned char*)realloc(dados, total);
+            if (novo == NULL)
+                break;
+            dados = novo;
+            cap = total;
+        }
+        if (pread(fd, dados, total, pos) != (ssize_t)total)
+            break;
+        memcpy(&c, dados + total - 512, sizeof(c));
+        int64_t *lista = (int64_t*)(dados + sizeof(d));
+        uint64_t soma = soma_fnv(0xcbf29ce484222325ull, lista, d.numBlocos * 8);
+        soma = soma_fnv(soma, dados + tamDesc, d.numBlocos * 512);
+        if (c.magico != MAGICO_DIARIO || c.tipo != REG_CONFIRMACAO || c.seq != seq || c.numBlocos != d.numBlocos
+            || c.soma != soma)
+            break;
+        long i;
+        for (i = 0; i < d.numBlocos && lista[i] >= 0 && lista[i] < limite; i++)
+            ;
+        if (i < d.numBlocos)
+            break;
+        for (i = 0; i < d.numBlocos; i++) {
+            if (gravar_em(fdImagem, dados + tamDesc + i * 512, 512, (off_t)lista[i] * 512) != 0) {
+                printf("Erro: falha ao refazer o diário na imagem.\n");
+                free(dados);
+                close(fd);
+                return -1;
+            }
+        }
+        refeitas++;
+        seq++;
+        pos += total;
+    }
+    free(dados);
+    if (refeitas > 0 && fsync(fdImagem) != 0) {
+        printf("Erro: falha ao refazer o diário na imagem.\n");
+        close(fd);
+        return -1;
+    }
+    diario_zerar(fd, seq);
+    close(fd);
+    if (refeitas > 0)
+        printf("Diário: %ld transação(ões) refeita(s).\n", refeitas);
+    return refeitas;
+}
+
+int diario_abrir(const char *caminho) {
+    diario.fd = open(caminho, O_RDWR | O_CREAT, 0644);
+    diario.marcados = (uint64_t*)calloc((tamMapa / TAM_BLOCO_MIN + 63) / 64, sizeof(uint64_t));
+    if (diario.fd < 0 || diario.marcados == NULL || diario_zerar(diario.fd, 1) != 0) {
+        printf("Erro: não foi possível criar o diário '%s'.\n", caminho);
+        return -1;
+    }
+    diario.seq = 1;
+    diario.fim = 512;
+    diarioAtivo = 1;
+    return 0;
+}
+
+void diario_fechar() {
+    if (!diarioAtivo)
+        return;
+    close(diario.fd);
+    free(diario.marcados);
+    free(diario.sujos);
+    free(diario.buffer);
+    diario.fd = -1;
+    diarioAtivo = 0;
+}
+
+/* Anota os pedaços de 512 bytes do mapeamento em [ptr, ptr + len) na transação em curso. */
+void diario_sujar(const void *ptr, size_t len) {
+    if (!diarioAtivo)
+        return;
+    long primeiro = ((const unsigned char*)ptr - mapaVolume) / 512;
+    long ultimo = ((const unsigned char*)ptr + len - 1 - mapaVolume) / 512;
+    for (long b = primeiro; b <= ultimo; b++) {
+        uint64_t bit = (uint64_t)1 << (b & 63);
+        if (__atomic_fetch_or(&diario.marcados[b >> 6], bit, __ATOMIC_RELAXED) & bit)
+            continue;
+        pthread_mutex_lock(&diario.trava);
+        if (diario.numSujos == diario.capSujos) {
+            long cap = diario.capSujos ? diario.capSujos * 2 : 256;
+            long *novo = (long*)realloc(diario.sujos, cap * sizeof(long));
+            if (novo == NULL) {
+                pthread_mutex_unlock(&diario.trava);
+                printf("Erro: falha na alocação de memória.\n");
+                return;
+            }
+            diario.sujos = novo;
+            diario.capSujos = cap;
+        }
+        diario.sujos[diario.numSujos++] = b;
+        pthread_mutex_unlock(&diario.trava);
+    }
+}
+
+/* Abre uma operação na transação em curso; devolve o número da transação, ou 0 sem diário. */
+long diario_iniciar() {
+    if (!diarioAtivo)
+        return 0;
+    pthread_mutex_lock(&diario.trava);
+    while (diario.fechando)
+        pthread_cond_wait(&diario.aberta, &diario.trava);
+    diario.ativas++;
+    long tid = diario.atual;
+    pthread_mutex_unlock(&diario.trava);
+    return tid;
+}
+
+void diario_terminar() {
+    pthread_mutex_lock(&diario.trava);
+    diario.ativas--;
+    diario.operacoes++;
+    if (diario.ativas == 0 && diario.fechando)
+        pthread_cond_signal(&diario.drenada);
+    pthread_mutex_unlock(&diario.trava);
+}
+
+/*
+ * Fecha e grava a transação em curso. Chamada com diario.trava, que é
+ * solta durante as gravações: novas operações entram na transação seguinte.
+ */
+void diario_confirmar_travado() {
+    diario.gravando = 1;
+    diario.fechando = 1;
+    while (diario.ativas > 0)
+        pthread_cond_wait(&diario.drenada, &diario.trava);
+
+    long tid = diario.atual;
+    long n = diario.numSujos;
+    size_t tamDesc = (sizeof(RegistroDiario) + n * 8 + 511) / 512 * 512;
+    size_t total = tamDesc + n * 512 + 512;
+    int erro = 0;
+    if (n > 0 && total > diario.capBuffer) {
+        unsigned char *novo = (unsigned char*)realloc(diario.buffer, total);
+        if (novo != NULL) {
+            diario.buffer = novo;
+            diario.capBuffer = total;
+        } else {
+            erro = 1;
+        }
+    }
+    if (n > 0 && !erro) {
+        memset(diario.buffer, 0, tamDesc);
+        memset(diario.buffer + total - 512, 0, 512);
+        int64_t *lista = (int64_t*)(diario.buffer + sizeof(RegistroDiario));
+        for (long i = 0; i < n; i++) {
+            lista[i] = diario.sujos[i];
+            memcpy(diario.buffer + tamDesc + i * 512, mapaVolume + diario.sujos[i] * 512, 512);
+        }
+    }
+    for (long i = 0; i < n; i++)
+        diario.marcados[diario.sujos[i] >> 6] &= ~((uint64_t)1 << (diario.sujos[i] & 63));
+    diario.numSujos = 0;
+    diario.atual++;
+    diario.fechando = 0;
+    pthread_cond_broadcast(&diario.aberta);
+    pthread_mutex_unlock(&diario.trava);
+
+    /* Modo ordenado: os dados que as operações deixaram nos buffers (e os já expulsos para a imagem) ficam duráveis
+       antes do registro de confirmação; senão, depois de uma queda, o arquivo mostraria o que o bloco tinha antes. */
+    if (n > 0 && !erro) {
+        buf_sincronizar();
+        pthread_mutex_lock(&travaBuffers);
+        long gravados = statsBuffers.bytesGravados;
+        pthread_mutex_unlock(&travaBuffers);
+        if (gravados != diario.dadosDuraveis) {
+            erro = fdatasync(fdVolume) != 0;
+            diario.dadosDuraveis = gravados;
+        }
+    }
+    if (n > 0 && !erro) {
+        int64_t *lista = (int64_t*)(diario.buffer + sizeof(RegistroDiario));
+        uint64_t soma = soma_fnv(0xcbf29ce484222325ull, lista, n * 8);
+        soma = soma_fnv(soma, diario.buffer + tamDesc, n * 512);
+        RegistroDiario d = {MAGICO_DIARIO, REG_DESCRITOR, diario.seq, n, 0};
+        RegistroDiario c = {MAGICO_DIARIO, REG_CONFIRMACAO, diario.seq, n, soma};
+        memcpy(diario.buffer, &d, sizeof(d));
+        memcpy(diario.buffer + total - 512, &c, sizeof(c));
+        erro = gravar_em(diario.fd, diario.buffer, total, diario.fim) != 0 || fdatasync(diario.fd) != 0;
+        for (long i = 0; i < n && !erro; i++)
+            erro = gravar_em(fdVolume, diario.buffer + tamDesc + i * 512, 512, (off_t)lista[i] * 512) != 0;
+        diario.fim += total;
+        diario.seq++;
+        diario.confirmacoes++;
+        diario.blocosRegistrados += n;
+        /* Diário grande: com a imagem em disco, as transações já gravadas no lugar não são mais necessárias. */
+        if (!erro && diario.fim > TAM_MAX_DIARIO) {
+            erro = fsync(fdVolume) != 0 || diario_zerar(diario.fd, diario.seq) != 0;
+            diario.fim = 512;
+            diario.checkpoints++;
+        }
+    }
+    if (erro)
+        printf("Erro: falha ao gravar o diário.\n");
+
+    pthread_mutex_lock(&diario.trava);
+    diario.confirmada = tid;
+    diario.gravando = 0;
+    pthread_cond_broadcast(&diario.concluida);
+}
+
+/* Espera a transação 'tid' ficar durável, confirmando-a se ninguém estiver gravando. */
+void diario_esperar(long tid) {
+    pthread_mutex_lock(&diario.trava);
+    while (diario.confirmada < tid) {
+        if (diario.gravando)
+            pthread_cond_wait(&diario.concluida, &diario.trava);
+        else
+            diario_confirmar_travado();
+    }
+    pthread_mutex_unlock(&diario.trava);
+}
+
+/* Depois de diario_terminar: espera a confirmação, a menos que os comandos não esperem e a transação ainda seja pequena. */
+void diario_concluir(long tid) {
+    pthread_mutex_lock(&diario.trava);
+    int esperar = esperarDiario || diario.numSujos > LIMITE_SUJOS_LOTE;
+    pthread_mutex_unlock(&diario.trava);
+    if (esperar)
+        diario_esperar(tid);
+}
+
+/* Torna duráveis todas as operações já terminadas. */
+void diario_forcar() {
+    if (!diarioAtivo)
+        return;
+    pthread_mutex_lock(&diario.trava);
+    long tid = diario.atual;
+    pthread_mutex_unlock(&diario.trava);
+    diario_esperar(tid);
+}
+
+void diario_info() {
+    if (!diarioAtivo) {
+        printf("Diário desativado (abra a imagem com -i <imagem> -j).\n");
+        return;
+    }
+    printf("Operações registradas: %ld\n", diario.operacoes);
+    printf("Transações confirmadas (fsync): %ld (%.1f operações por fsync)\n", diario.confirmacoes,
+           diario.confirmacoes ? (double)diario.operacoes / diario.confirmacoes : 0.0);
+    printf("Blocos registrados: %ld\n", diario.blocosRegistrados);
+    printf("Tamanho do diário: %ld bytes; esvaziado %ld vez(es) por checkpoint\n", (long)diario.fim, diario.checkpoints);
+}
+
+/*
+ * Pools de memória. Cada tipo de nó (Bloco, Diretorio, Arquivo) vem de um
+ * pool próprio: os objetos são cortados de slabs de 64 KiB e os liberados
+ * voltam para uma lista livre do pool, sem passar pelo malloc. Vetores de
+ * tamanho variável (extensões, tabelas hash) usam a arena, que é um pool por
+ * classe de tamanho em potências de dois; acima de TAM_MAX_CLASSE o pedido
+ * vai para o malloc, mas fica numa lista para a liberação em bloco.
+ */
+void pool_iniciar(Pool *p, const char *nome, size_t tamObjeto) {
+    memset(p, 0, sizeof(Pool));
+    pthread_mutex_init(&p->trava, NULL);
+    p->nome = nome;
+    p->tamObjeto = (tamObjeto + 15) & ~(size_t)15;
+    size_t tamSlab = TAM_SLAB > 8 * p->tamObjeto ? TAM_SLAB : 8 * p->tamObjeto;
+    p->objetosPorSlab = (tamSlab - sizeof(Slab)) / p->tamObjeto;
+}
+
+void* pool_alocar(Pool *p) {
+    pthread_mutex_lock(&p->trava);
+    if (p->livres == NULL) {
+        Slab *s = (Slab*)malloc(sizeof(Slab) + p->objetosPorSlab * p->tamObjeto);
+        if (s == NULL) {
+            pthread_mutex_unlock(&p->trava);
+            return NULL;
+        }
+        s->prox = p->slabs;
+        p->slabs = s;
+        p->numSlabs++;
+        char *obj = (char*)(s + 1);
+        for (size_t i = 0; i < p->objetosPorSlab; i++) {
+            *(void**)(obj + i * p->tamObjeto) = p->livres;
+            p->livres = obj + i * p->tamObjeto;
+        }
+    }
+    void *obj = p->livres;
+    p->livres = *(void**)obj;
+    p->emUso++;
+    p->alocacoes++;
+    pthread_mutex_unlock(&p->trava);
+    memset(obj, 0, p->tamObjeto);
+    return obj;
+}
+
+void pool_liberar(Pool *p, void *obj) {
+    if (obj == NULL)
+        return;
+    pthread_mutex_lock(&p->trava);
+    *(void**)obj = p->livres;
+    p->livres = obj;
+    p->emUso--;
+    p->liberacoes++;
+    pthread_mutex_unlock(&p->trava);
+}
+
+/* Devolve todos os slabs de uma vez, sem percorrer os objetos. */
+void pool_destruir(Pool *p) {
+    Slab *s = p->slabs;
+    while (s != NULL) {
+        Slab *prox = s->prox;
+        free(s);
+        s = prox;
+    }
+    p->slabs = NULL;
+    p->livres = NULL;
+    p->numSlabs = 0;
+    p->emUso = 0;
+}
+
+int classe_arena(size_t tam) {
+    int c = 0;
+    while (((size_t)TAM_MIN_CLASSE << c) < tam)
+        c++;
+    return c;
+}
+
+void* arena_alocar(size_t tam) {
+    if (tam <= TAM_MAX_CLASSE)
+        return pool_alocar(&classesArena[classe_arena(tam)]);
+    Grande *g = (Grande*)calloc(1, sizeof(Grande) + tam);
+    if (g == NULL)
+        return NULL;
+    pthread_mutex_lock(&travaGrandes);
+    g->ant = NULL;
+    g->prox = grandes;
+    if (grandes != NULL)
+        grandes->ant = g;
+    grandes = g;
+    pthread_mutex_unlock(&travaGrandes);
+    return g + 1;
+}
+
+void arena_liberar(void *ptr, size_t tam) {
+    if (ptr == NULL)
+        return;
+    if (tam <= TAM_MAX_CLASSE) {
+        pool_liberar(&classesArena[classe_arena(tam)], ptr);
+        return;
+    }
+    Grande *g = (Grande*)ptr - 1;
+    pthread_mutex_lock(&travaGrandes);
+    if (g->ant != NULL)
+        g->ant->prox = g->prox;
+    else
+        grandes = g->prox;
+    if (g->prox != NULL)
+        g->prox->ant = g->ant;
+    pthread_mutex_unlock(&travaGrandes);
+    free(g);
+}
+
+void* arena_realocar(void *ptr, size_t tamAntigo, size_t tamNovo) {
+    if (ptr != NULL && tamAntigo <= TAM_MAX_CLASSE && tamNovo <= TAM_MAX_CLASSE
+        && classe_arena(tamAntigo) == classe_arena(tamNovo))
+        return ptr;
+    void *novo = arena_alocar(tamNovo);
+    if (novo == NULL)
+        return NULL;
+    if (ptr != NULL) {
+        memcpy(novo, ptr, tamAntigo < tamNovo ? tamAntigo : tamNovo);
+        arena_liberar(ptr, tamAntigo);
+    }
+    return novo;
+}
+
+void iniciar_memoria() {
+    pool_iniciar(&poolBlocos, "Bloco", sizeof(Bloco));
+    pool_iniciar(&poolDiretorios, "Diretorio", sizeof(Diretorio));
+    pool_iniciar(&poolArquivos, "Arquivo", sizeof(Arquivo));
+    static char nomesClasses[NUM_CLASSES][16];
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        snprintf(nomesClasses[c], sizeof(nomesClasses[c]), "arena %zu", (size_t)TAM_MIN_CLASSE << c);
+        pool_iniciar(&classesArena[c], nomesClasses[c], (size_t)TAM_MIN_CLASSE << c);
+    }
+}
+
+/* Desmonta toda a árvore em memória liberando os pools inteiros, sem visitar os nós. */
+void liberar_memoria() {
+    pool_destruir(&poolBlocos);
+    pool_destruir(&poolDiretorios);
+    pool_destruir(&poolArquivos);
+    for (int c = 0; c < NUM_CLASSES; c++)
+        pool_destruir(&classesArena[c]);
+    while (grandes != NULL) {
+        Grande *prox = grandes->prox;
+        free(grandes);
+        grandes = prox;
+    }
+    cache_limpar();
+    raiz = NULL;
+    while (instantaneos != NULL) {
+        Instantaneo *prox = instantaneos->prox;
+        free(instantaneos);
+        instantaneos = prox;
+    }
+    numInstantaneos = 0;
+}
+
+void imprimir_pool(Pool *p) {
+    long capacidade = p->numSlabs * (long)p->objetosPorSlab;
+    printf("%-12s %8zu %10ld %10ld %8ld %7.1f%% %12ld %12ld\n", p->nome, p->tamObjeto, p->emUso,
+           capacidade - p->emUso, p->numSlabs, capacidade ? 100.0 * p->emUso / capacidade : 0.0,
+           p->alocacoes, p->liberacoes);
+}
+
+void stats() {
+    printf("%-12s %8s %10s %10s %8s %8s %12s %12s\n", "pool", "objeto", "em uso", "livres", "slabs",
+           "ocupação", "alocações", "liberações");
+    imprimir_pool(&poolBlocos);
+    imprimir_pool(&poolDiretorios);
+    imprimir_pool(&poolArquivos);
+    for (int c = 0; c < NUM_CLASSES; c++)
+        if (classesArena[c].alocacoes > 0)
+            imprimir_pool(&classesArena[c]);
+    long numGrandes = 0;
+    for (Grande *g = grandes; g != NULL; g = g->prox)
+        numGrandes++;
+    if (numGrandes > 0)
+        printf("%ld vetor(es) acima de %d bytes fora dos pools\n", numGrandes, TAM_MAX_CLASSE);
+}
+
+/*
+ * Cache de buffers. Os dados dos arquivos são lidos e gravados em blocos de
+ * tamBloco bytes do dispositivo (a imagem mapeada, ou uma região anônima quando
+ * o volume é só em memória) sempre através de um conjunto fixo de buffers.
+ * Os buffers ficam numa tabela hash por número de bloco e numa lista LRU;
+ * buffers alterados são marcados sujos e só voltam ao dispositivo quando
+ * são expulsos ou no sync. Leituras sequenciais disparam leitura antecipada.
+ */
+int buffers_iniciar(int quantidade) {
+    if (mapaVolume != NULL) {
+        dispositivo = mapaVolume;
+    } else {
+        dispositivo = (unsigned char*)mmap(NULL, (size_t)totalBlocos * tamBloco, PROT_READ | PROT_WRITE,
+                                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (dispositivo == MAP_FAILED) {
+            dispositivo = NULL;
+            return -1;
+        }
+    }
+    numBuffers = quantidade;
+    capHashBuffers = 1;
+    while (capHashBuffers < 2 * (unsigned)quantidade)
+        capHashBuffers *= 2;
+    buffers = (Buffer*)calloc(quantidade, sizeof(Buffer));
+    memoriaBuffers = (unsigned char*)malloc((size_t)quantidade * tamBloco);
+    hashBuffers = (Buffer**)calloc(capHashBuffers, sizeof(Buffer*));
+    if (buffers == NULL || memoriaBuffers == NULL || hashBuffers == NULL)
+        return -1;
+    for (int i = 0; i < quantidade; i++) {
+        buffers[i].bloco = -1;
+        buffers[i].dados = memoriaBuffers + (size_t)i * tamBloco;
+        buf_ligar_lru(&buffers[i], 0);
+    }
+    return 0;
+}
+
+void buf_desligar_lru(Buffer *b) {
+    if (b->velho) {
+        if (b == meioLRU)
+            meioLRU = b->proxLRU;
+        b->velho = 0;
+        numVelhos--;
+    }
+    if (b->antLRU != NULL)
+        b->antLRU->proxLRU = b->proxLRU;
+    else
+        buffersMRU = b->proxLRU;
+    if (b->proxLRU != NULL)
+        b->proxLRU->antLRU = b->antLRU;
+    else
+        buffersLRU = b->antLRU;
+    buf_equilibrar_lru();
+}
+
+/* Liga 'b' na ponta mais recente da LRU, ou na menos recente (para buffers vazios). */
+void buf_ligar_lru(Buffer *b, int recente) {
+    if (recente) {
+        b->antLRU = NULL;
+        b->proxLRU = buffersMRU;
+        if (buffersMRU != NULL)
+            buffersMRU->antLRU = b;
+        buffersMRU = b;
+        if (buffersLRU == NULL)
+            buffersLRU = b;
+    } else {
+        b->proxLRU = NULL;
+        b->antLRU = buffersLRU;
+        if (buffersLRU != NULL)
+            buffersLRU->proxLRU = b;
+        buffersLRU = b;
+        if (buffersMRU == NULL)
+            buffersMRU = b;
+        b->velho = 1;
+        numVelhos++;
+        if (meioLRU == NULL)
+            meioLRU = b;
+    }
+    buf_equilibrar_lru();
+}
+
+/* Liga 'b' no começo da parte antiga da LRU: é expulso antes de tudo o que foi usado há pouco. */
+void buf_ligar_meio(Buffer *b) {
+    if (meioLRU == NULL) {
+        buf_ligar_lru(b, 0);
+        return;
+    }
+    b->proxLRU = meioLRU;
+    b->antLRU = meioLRU->antLRU;
+    if (b->antLRU != NULL)
+        b->antLRU->proxLRU = b;
+    else
+        buffersMRU = b;
+    meioLRU->antLRU = b;
+    meioLRU = b;
+    b->velho = 1;
+    numVelhos++;
+    buf_equilibrar_lru();
+}
+
+/* Move meioLRU até a parte antiga ter 3/8 dos buffers ligados. */
+void buf_equilibrar_lru() {
+    int alvo = numBuffers * 3 / 8;
+    while (numVelhos > alvo && meioLRU != NULL) {
+        meioLRU->velho = 0;
+        meioLRU = meioLRU->proxLRU;
+        numVelhos--;
+    }
+    while (numVelhos < alvo) {
+        Buffer *b = meioLRU != NULL ? meioLRU->antLRU : buffersLRU;
+        if (b == NULL)
+            break;
+        b->velho = 1;
+        meioLRU = b;
+        numVelhos++;
+    }
+}
+
+Buffer* buf_procurar(long bloco) {
+    for (Buffer *b = hashBuffers[(unsigned long)bloco & (capHashBuffers - 1)]; b != NULL; b = b->proxHash)
+        if (b->bloco == bloco)
+            return b;
+    return NULL;
+}
+
+void buf_desligar_hash(Buffer *b) {
+    Buffer **pp = &hashBuffers[(unsigned long)b->bloco & (capHashBuffers - 1)];
+    while (*pp != b)
+        pp = &(*pp)->proxHash;
+    *pp = b->proxHash;
+}
+
+void buf_gravar(Buffer *b) {
+    if (!b->sujo)
+        return;
+    memcpy(dispositivo + b->bloco * tamBloco, b->dados, tamBloco);
+    /* Com diário o mapeamento é privado: os dados vão para a imagem à parte (sem passar pelo diário). */
+    if (diarioAtivo && gravar_em(fdVolume, b->dados, tamBloco, (off_t)b->bloco * tamBloco) != 0)
+        printf("Erro: falha ao gravar o bloco %ld na imagem.\n", b->bloco);
+    b->sujo = 0;
+    statsBuffers.bytesGravados += tamBloco;
+}
+
+/* Pega o buffer menos usado, gravando-o antes se estiver sujo, e o associa a 'bloco'. */
+Buffer* buf_reciclar(long bloco) {
+    Buffer *b = buffersLRU;
+    if (b->bloco >= 0) {
+        buf_gravar(b);
+        buf_desligar_hash(b);
+        statsBuffers.expulsoes++;
+    }
+    b->bloco = bloco;
+    b->antecipado = 0;
+    b->proxHash = hashBuffers[(unsigned long)bloco & (capHashBuffers - 1)];
+    hashBuffers[(unsigned long)bloco & (capHashBuffers - 1)] = b;
+    return b;
+}
+
+/*
+ * Devolve o buffer do bloco físico 'bloco'. Com 'ler' = 0 o chamador vai
+ * sobrescrever o bloco inteiro e o conteúdo antigo não é lido do dispositivo.
+ */
+Buffer* buf_obter(long bloco, int ler) {
+    Buffer *b = buf_procurar(bloco);
+    if (b != NULL) {
+        statsBuffers.acertos++;
+        if (b->antecipado) {
+            statsBuffers.acertosAntecipados++;
+            b->antecipado = 0;
+        }
+    } else {
+        statsBuffers.faltas++;
+        b = buf_reciclar(bloco);
+        if (ler)
+            memcpy(b->dados, dispositivo + bloco * tamBloco, tamBloco);
+    }
+    buf_desligar_lru(b);
+    buf_ligar_lru(b, 1);
+    return b;
+}
+
+/*
+ * Traz 'bloco' para o cache sem contar como acesso. Fica no começo da parte
+ * antiga da LRU, e não na ponta mais recente, para não expulsar o que está
+ * em uso; se for lido antes de chegar ao fim da fila, buf_obter o promove.
+ */
+void buf_antecipar(long bloco) {
+    if (buf_procurar(bloco) != NULL)
+        return;
+    Buffer *b = buf_reciclar(bloco);
+    memcpy(b->dados, dispositivo + bloco * tamBloco, tamBloco);
+    b->antecipado = 1;
+    buf_desligar_lru(b);
+    buf_ligar_meio(b);
+    statsBuffers.antecipados++;
+}
+
+/* Descarta sem gravar os buffers de blocos liberados. */
+void buf_descartar(long inicio, long tamanho) {
+    if (buffers == NULL)
+        return;
+    pthread_mutex_lock(&travaBuffers);
+    if (tamanho <= numBuffers) {
+        for (long i = inicio; i < inicio + tamanho; i++) {
+            Buffer *b = buf_procurar(i);
+            if (b != NULL) {
+                buf_desligar_hash(b);
+                b->bloco = -1;
+                b->sujo = 0;
+                buf_desligar_lru(b);
+                buf_ligar_lru(b, 0);
+            }
+        }
+        pthread_mutex_unlock(&travaBuffers);
+        return;
+    }
+    for (int k = 0; k < numBuffers; k++) {
+        Buffer *b = &buffers[k];
+        if (b->bloco >= inicio && b->bloco < inicio + tamanho) {
+            buf_desligar_hash(b);
+            b->bloco = -1;
+            b->sujo = 0;
+            buf_desligar_lru(b);
+            buf_ligar_lru(b, 0);
+        }
+    }
+    pthread_mutex_unlock(&travaBuffers);
+}
+
+void buf_sincronizar() {
+    pthread_mutex_lock(&travaBuffers);
+    for (int k = 0; k < numBuffers; k++)
+        if (buffers[k].bloco >= 0)
+            buf_gravar(&buffers[k]);
+    pthread_mutex_unlock(&travaBuffers);
+}
+
+/* Converte o bloco lógico 'k' do arquivo no bloco físico; devolve -1 se 'k' passa do fim ou cai num buraco. */
+long arquivo_bloco_fisico(Arquivo *arq, long k) {
+    for (int j = 0; j < arq->numExt; j++) {
+        if (k < arq->ext[j].tamanho)
+            return arq->ext[j].inicio == BURACO ? -1 : arq->ext[j].inicio + k;
+        k -= arq->ext[j].tamanho;
+    }
+    return -1;
+}
+
+/*
+ * Dá blocos zerados aos buracos de 'arq' entre os blocos lógicos 'primeiro'
+ * e 'ultimo'. Tudo ou nada: os blocos são pedidos antes de mexer nas
+ * extensões e voltam ao bitmap se faltar espaço ou memória. Devolve quantos
+ * blocos alocou, ou -1.
+ */
+long arquivo_preencher(Arquivo *arq, long primeiro, long ultimo) {
+    long faltam = 0, base = 0;
+    for (int j = 0; j < arq->numExt; j++) {
+        long de = base > primeiro ? base : primeiro;
+        long ate = base + arq->ext[j].tamanho - 1 < ultimo ? base + arq->ext[j].tamanho - 1 : ultimo;
+        if (arq->ext[j].inicio == BURACO && de <= ate)
+            faltam += ate - de + 1;
+        base += arq->ext[j].tamanho;
+    }
+    if (faltam == 0)
+        return 0;
+
+    Extensao *pedacos = NULL;
+    int numPedacos = 0, capPedacos = 0;
+    for (long restantes = faltam; restantes > 0;) {
+        long inicio;
+        long obtido = 0;
+        if (numPedacos == capPedacos) {
+            capPedacos = capPedacos ? capPedacos * 2 : 4;
+            Extensao *maior = (Extensao*)realloc(pedacos, capPedacos * sizeof(Extensao));
+            if (maior != NULL)
+                pedacos = maior;
+            else
+                capPedacos = numPedacos;
+        }
+        if (numPedacos < capPedacos)
+            obtido = alocar_extensao(restantes, &inicio);
+        if (obtido == 0) {
+            for (int r = 0; r < numPedacos; r++)
+                liberar_extensao(pedacos[r].inicio, pedacos[r].tamanho);
+            free(pedacos);
+            printf("Erro: não há mais blocos livres.\n");
+            return -1;
+        }
+        pedacos[numPedacos].inicio = inicio;
+        pedacos[numPedacos].tamanho = obtido;
+        numPedacos++;
+        restantes -= obtido;
+    }
+
+    /* Cada extensão vira no máximo: buraco antes, um trecho por pedaço e por buraco, buraco depois. */
+    int cap = 3 * arq->numExt + numPedacos;
+    Extensao *ext = (Extensao*)arena_alocar(cap * sizeof(Extensao));
+    if (ext == NULL) {
+        for (int r = 0; r < numPedacos; r++)
+            liberar_extensao(pedacos[r].inicio, pedacos[r].tamanho);
+        free(pedacos);
+        printf("Erro: falha na alocação de memória.\n");
+        return -1;
+    }
+    pthread_mutex_lock(&travaBuffers);
+    for (int r = 0; r < numPedacos; r++) {
+        for (long i = 0; i < pedacos[r].tamanho; i++) {
+            Buffer *b = buf_obter(pedacos[r].inicio + i, 0);
+            memset(b->dados, 0, tamBloco);
+            b->sujo = 1;
+        }
+    }
+    pthread_mutex_unlock(&travaBuffers);
+
+    int n = 0, r = 0;
+    long usado = 0;
+    base = 0;
+    for (int j = 0; j < arq->numExt; j++) {
+        Extensao e = arq->ext[j];
+        long fim = base + e.tamanho;
+        if (e.inicio != BURACO || fim <= primeiro || base > ultimo) {
+            extensao_juntar(ext, &n, e.inicio, e.tamanho);
+            base = fim;
+            continue;
+        }
+        long de = base > primeiro ? base : primeiro;
+        long ate = fim - 1 < ultimo ? fim : ultimo + 1;
+        if (de > base)
+            extensao_juntar(ext, &n, BURACO, de - base);
+        while (de < ate) {
+            long parte = pedacos[r].tamanho - usado < ate - de ? pedacos[r].tamanho - usado : ate - de;
+            extensao_juntar(ext, &n, pedacos[r].inicio + usado, parte);
+            de += parte;
+            usado += parte;
+            if (usado == pedacos[r].tamanho) {
+                r++;
+                usado = 0;
+            }
+        }
+        if (fim > ate)
+            extensao_juntar(ext, &n, BURACO, fim - ate);
+        base = fim;
+    }
+    free(pedacos);
+    arena_liberar(arq->ext, arq->capExt * sizeof(Extensao));
+    arq->ext = ext;
+    arq->capExt = cap;
+    arq->numExt = n;
+    arq->attr.posicao = arquivo_posicao(arq);
+    frag_atualizar(arq);
+    if (mapaVolume != NULL && arq->attr.ino >= 0) {
+        InodeDisco *nd = &inodes[arq->attr.ino];
+        inode_liberar_indiretos(nd);
+        if (inode_gravar_extensoes(nd, arq) != 0)
+            printf("Erro: não há blocos livres para as extensões do arquivo.\n");
+        nd->posicao = arq->attr.posicao;
+        diario_sujar(nd, sizeof(InodeDisco));
+    }
+    return faltam;
+}
+
+/*
+ * Copia 'n' bytes a partir de 'offset' entre 'dados' e o arquivo, bloco a
+ * bloco, pelo cache. travaBuffers fica com a cópia inteira: um buffer obtido
+ * não pode ser reciclado por outra thread antes do memcpy.
+ */
+int arquivo_transferir(Arquivo *arq, long offset, unsigned char *dados, long n, int escrita) {
+    /* O que passa do fim das extensões está na cauda. */
+    if (arq->caudaFatias > 0) {
+        long limite = arquivo_blocos_logicos(arq) * tamBloco;
+        if (offset + n > limite) {
+            long antes = offset < limite ? limite - offset : 0;
+            cauda_transferir(arq, offset + antes - limite, dados + antes, n - antes, escrita);
+            n = antes;
+        }
+    }
+    /* Escrever num buraco aloca o bloco antes; ler um buraco dá zeros. */
+    if (escrita && n > 0 && arquivo_preencher(arq, offset / tamBloco, (offset + n - 1) / tamBloco) < 0)
+        return -1;
+    if (escrita && refsBlocos != NULL)
+        return dedup_gravar(arq, offset, dados, n);
+    pthread_mutex_lock(&travaBuffers);
+    while (n > 0) {
+        long k = offset / tamBloco;
+        int dentro = (int)(offset % tamBloco);
+        int parte = n < tamBloco - dentro ? (int)n : tamBloco - dentro;
+        long fisico = arquivo_bloco_fisico(arq, k);
+        if (escrita) {
+            Buffer *b = buf_obter(fisico, parte < tamBloco);
+            memcpy(b->dados + dentro, dados, parte);
+            b->sujo = 1;
+        } else if (fisico < 0) {
+            memset(dados, 0, parte);
+        } else {
+            Buffer *b = buf_obter(fisico, 1);
+            memcpy(dados, b->dados + dentro, parte);
+        }
+        offset += parte;
+        dados += parte;
+        n -= parte;
+    }
+    pthread_mutex_unlock(&travaBuffers);
+    return 0;
+}
+
+/* Grava zeros em [offset, offset + n), bloco a bloco; buracos já são lidos como zero e continuam buracos. */
+int arquivo_zerar(Arquivo *arq, long offset, long n) {
+    static unsigned char zeros[TAM_BLOCO_MAX];
+    while (n > 0) {
+        long parte = tamBloco - offset % tamBloco;
+        if (parte > n)
+            parte = n;
+        long k = offset / tamBloco;
+        int buraco = k < arquivo_blocos_logicos(arq) && arquivo_bloco_fisico(arq, k) < 0;
+        if (!buraco && arquivo_transferir(arq, offset, zeros, parte, 1) != 0)
+            return -1;
+        offset += parte;
+        n -= parte;
+    }
+    return 0;
+}
+
+/* Fatias de cauda para 'bytes' (um arquivo vazio ainda ocupa uma). */
+int cauda_fatias(long bytes) {
+    long tamFatia = tamBloco / FATIAS_CAUDA;
+    return bytes <= 0 ? 1 : (int)((bytes + tamFatia - 1) / tamFatia);
+}
+
+/* Primeira fatia de uma sequência de 'n' livres em 'ocupadas', ou -1. */
+int cauda_encaixar(uint64_t ocupadas, int n) {
+    uint64_t livres = ~ocupadas;
+    uint64_t inicios = livres;
+    for (int i = 1; i < n && inicios != 0; i++)
+        inicios &= livres >> i;
+    return inicios != 0 ? __builtin_ctzll(inicios) : -1;
+}
+
+/* Põe 'bloco' na lista de blocos de caudas com fatias livres; cheia, esquece o mais antigo. Com travaCaudas. */
+void cauda_abrir(long bloco) {
+    if (numCaudasAbertas == MAX_CAUDAS_ABERTAS) {
+        memmove(caudasAbertas, caudasAbertas + 1, (MAX_CAUDAS_ABERTAS - 1) * sizeof(long));
+        numCaudasAbertas--;
+    }
+    caudasAbertas[numCaudasAbertas++] = bloco;
+}
+
+/*
+ * Dá a 'arq' uma cauda de 'fatias' fatias: no primeiro bloco aberto onde
+ * caibam seguidas, ou num bloco novo. A máscara da fatia 0 é lida e
+ * gravada pelo cache, com travaBuffers.
+ */
+int cauda_alocar(Arquivo *arq, int fatias) {
+    uint64_t m = mascara_bits(0, fatias);
+    long bloco = -1;
+    int fatia = -1;
+    pthread_mutex_lock(&travaCaudas);
+    for (int i = 0; i < numCaudasAbertas && fatia < 0; i++) {
+        pthread_mutex_lock(&travaBuffers);
+        Buffer *buf = buf_obter(caudasAbertas[i], 1);
+        uint64_t ocupadas;
+        memcpy(&ocupadas, buf->dados, sizeof(ocupadas));
+        fatia = cauda_encaixar(ocupadas, fatias);
+        if (fatia >= 0) {
+            ocupadas |= m << fatia;
+            memcpy(buf->dados, &ocupadas, sizeof(ocupadas));
+            buf->sujo = 1;
+            bloco = caudasAbertas[i];
+            if (ocupadas == ~(uint64_t)0)
+                caudasAbertas[i] = caudasAbertas[--numCaudasAbertas];
+        }
+        pthread_mutex_unlock(&travaBuffers);
+    }
+    if (fatia < 0) {
+        bloco = alocar_bloco();
+        if (bloco < 0) {
+            pthread_mutex_unlock(&travaCaudas);
+            return -1;
+        }
+        fatia = 1;
+        uint64_t ocupadas = 1 | (m << fatia);
+        pthread_mutex_lock(&travaBuffers);
+        Buffer *buf = buf_obter(bloco, 0);
+        memset(buf->dados, 0, tamBloco);
+        memcpy(buf->dados, &ocupadas, sizeof(ocupadas));
+        buf->sujo = 1;
+        pthread_mutex_unlock(&travaBuffers);
+        if (ocupadas != ~(uint64_t)0)
+            cauda_abrir(bloco);
+    }
+    pthread_mutex_unlock(&travaCaudas);
+    arq->cauda = bloco;
+    arq->caudaFatia = (int16_t)fatia;
+    arq->caudaFatias = (int16_t)fatias;
+    return 0;
+}
+
+/* Devolve as fatias da cauda de 'arq'; o bloco volta ao bitmap quando só sobra a máscara. */
+void cauda_liberar(Arquivo *arq) {
+    if (arq->caudaFatias == 0)
+        return;
+    long bloco = arq->cauda;
+    uint64_t minhas = mascara_bits(arq->caudaFatia, arq->caudaFatias);
+    arq->caudaFatias = 0;
+    if (bloco < blocosReservados || bloco >= totalBlocos)
+        return;
+    pthread_mutex_lock(&travaCaudas);
+    pthread_mutex_lock(&travaBuffers);
+    Buffer *buf = buf_obter(bloco, 1);
+    uint64_t ocupadas;
+    memcpy(&ocupadas, buf->dados, sizeof(ocupadas));
+    ocupadas &= ~minhas;
+    memcpy(buf->dados, &ocupadas, sizeof(ocupadas));
+    buf->sujo = 1;
+    pthread_mutex_unlock(&travaBuffers);
+    int i = 0;
+    while (i < numCaudasAbertas && caudasAbertas[i] != bloco)
+        i++;
+    if ((ocupadas & ~(uint64_t)1) == 0) {
+        if (i < numCaudasAbertas)
+            caudasAbertas[i] = caudasAbertas[--numCaudasAbertas];
+        liberar_bloco(bloco);
+    } else if (i == numCaudasAbertas) {
+        cauda_abrir(bloco);
+    }
+    pthread_mutex_unlock(&travaCaudas);
+}
+
+/* Copia 'n' bytes entre 'dados' e a cauda de 'arq', a partir do byte 'offset' da cauda. */
+void cauda_transferir(Arquivo *arq, long offset, unsigned char *dados, long n, int escrita) {
+    if (n <= 0)
+        return;
+    /* Uma cauda fora da área de dados (volume estragado, ver verifica) lê zeros e não guarda nada. */
+    if (arq->cauda < blocosReservados || arq->cauda >= totalBlocos) {
+        if (!escrita)
+            memset(dados, 0, n);
+        return;
+    }
+    long base = arq->caudaFatia * (tamBloco / FATIAS_CAUDA) + offset;
+    pthread_mutex_lock(&travaBuffers);
+    Buffer *b = buf_obter(arq->cauda, 1);
+    if (escrita) {
+        memcpy(b->dados + base, dados, n);
+        b->sujo = 1;
+    } else {
+        memcpy(dados, b->dados + base, n);
+    }
+    pthread_mutex_unlock(&travaBuffers);
+}
+
+/* Bytes de folga que a cauda de 'arq' poupa em relação a um bloco inteiro. */
+long cauda_folga(Arquivo *arq) {
+    return arq->caudaFatias > 0 ? tamBloco - arq->caudaFatias * (tamBloco / FATIAS_CAUDA) : 0;
+}
+
+/*
+ * Resolve 'caminho' até um arquivo; imprime o erro e devolve NULL se não
+ * existir. Se encontrou, o diretório que o contém fica travado em *pai.
+ */
+Bloco* resolver_arquivo(char *caminho, int escrita, Bloco **pai) {
+    char *nome;
+    Bloco* atual = resolver_pai(caminho, &nome, escrita);
+    if (atual == NULL)
+        return NULL;
+    Bloco* alvo = dir_buscar(atual, nome, 0);
+    if (alvo == NULL) {
+        dir_destravar(atual);
+        printf("Erro: arquivo '%s' não encontrado.\n", nome);
+        return NULL;
+    }
+    *pai = atual;
+    return alvo;
+}
+
+void escreve() {
+    if (argList[1] == NULL || argList[2] == NULL || argList[3] == NULL) {
+        printf("Erro: uso: escreve <caminho/nome_do_arquivo> <offset> <texto>\n");
+        return;
+    }
+    Bloco *pai;
+    Bloco* alvo = resolver_arquivo(argList[1], 1, &pai);
+    if (alvo == NULL)
+        return;
+    Arquivo *arq = alvo->arq;
+
+    /* O texto é o resto da linha: os argumentos voltam a ser separados por um espaço. */
+    char texto[MAX_ARGS * MAX_CAMINHO];
+    size_t len = 0;
+    for (int i = 3; argList[i] != NULL; i++) {
+        size_t l = strlen(argList[i]);
+        if (len + l + 1 >= sizeof(texto))
+            break;
+        if (i > 3)
+            texto[len++] = ' ';
+        memcpy(texto + len, argList[i], l);
+        len += l;
+    }
+
+    long offset = atol(argList[2]);
+    if (offset < 0 || offset + (long)len > arq->tamanho) {
+        printf("Erro: escrita fora do arquivo (tamanho %ld bytes).\n", arq->tamanho);
+        dir_destravar(pai);
+        return;
+    }
+    if (arq->compartilhado > 0) {
+        if (arquivo_copiar(alvo) != 0) {
+            dir_destravar(pai);
+            return;
+        }
+        arq = alvo->arq;
+    }
+    /* Bytes entre o fim do que já foi escrito e 'offset' ainda não têm dado válido no disco: zeramos. */
+    long blocosAntes = arquivo_blocos(arq);
+    int falhou = (offset > arq->escritoAte && arquivo_zerar(arq, arq->escritoAte, offset - arq->escritoAte) != 0)
+        || arquivo_transferir(arq, offset, (unsigned char*)texto, (long)len, 1) != 0;
+    /* Buracos preenchidos pela escrita passam a contar nos blocos dos ancestrais. */
+    if (arquivo_blocos(arq) != blocosAntes)
+        agregados_somar(pai, (Uso){0, 0, 0, arquivo_blocos(arq) - blocosAntes}, 1);
+    if (falhou) {
+        dir_destravar(pai);
+        return;
+    }
+    if (offset + (long)len > arq->escritoAte) {
+        arq->escritoAte = offset + (long)len;
+        if (mapaVolume != NULL && arq->attr.ino >= 0) {
+            inodes[arq->attr.ino].escritoAte = arq->escritoAte;
+            diario_sujar(&inodes[arq->attr.ino], sizeof(InodeDisco));
+        }
+    }
+    printf("%zu byte(s) escrito(s) em '%s'.\n", len, alvo->nome);
+    dir_destravar(pai);
+}
+
+void le() {
+    if (argList[1] == NULL || argList[2] == NULL || argList[3] == NULL) {
+        printf("Erro: uso: le <caminho/nome_do_arquivo> <offset> <tamanho>\n");
+        return;
+    }
+    Bloco *pai;
+    Bloco* alvo = resolver_arquivo(argList[1], 0, &pai);
+    if (alvo == NULL)
+        return;
+    Arquivo *arq = alvo->arq;
+    long offset = atol(argList[2]);
+    long n = atol(argList[3]);
+    if (offset < 0 || n < 0 || offset > arq->tamanho) {
+        printf("Erro: leitura fora do arquivo (tamanho %ld bytes).\n", arq->tamanho);
+        dir_destravar(pai);
+        return;
+    }
+    if (offset + n > arq->tamanho)
+        n = arq->tamanho - offset;
+
+    unsigned char pedaco[4096];
+    long lidos = 0;
+    while (lidos < n) {
+        long parte = n - lidos < (long)sizeof(pedaco) ? n - lidos : (long)sizeof(pedaco);
+        long pos = offset + lidos;
+        /* Depois de escritoAte o conteúdo é zero por definição; não lemos o disco. */
+        long validos = arq->escritoAte - pos;
+        if (validos < 0)
+            validos = 0;
+        if (validos > parte)
+            validos = parte;
+        arquivo_transferir(arq, pos, pedaco, validos, 0);
+        memset(pedaco + validos, 0, parte - validos);
+        for (long i = 0; i < parte; i++)
+            putchar(pedaco[i] >= 32 && pedaco[i] < 127 ? pedaco[i] : '.');
+        lidos += parte;
+    }
+    putchar('\n');
+
+    /*
+     * Leitura sequencial: se esta começou onde a anterior parou, traz os
+     * próximos blocos. Leitores do mesmo diretório rodam juntos, então
+     * proxLeitura é só uma dica lida e gravada atomicamente.
+     */
+    long fim = offset + n;
+    if (offset == __atomic_load_n(&arq->proxLeitura, __ATOMIC_RELAXED) && fim < arq->escritoAte) {
+        long k = (fim + tamBloco - 1) / tamBloco;
+        long ultimo = (arq->escritoAte - 1) / tamBloco;
+        /* Os antecipados entram na parte antiga da LRU: a janela não pode passar de metade dela. */
+        long janela = JANELA_LEITURA < numBuffers * 3 / 16 ? JANELA_LEITURA : numBuffers * 3 / 16;
+        pthread_mutex_lock(&travaBuffers);
+        for (long j = 0; j < janela && k + j <= ultimo; j++) {
+            long fisico = arquivo_bloco_fisico(arq, k + j);
+            if (fisico < 0)
+                break;
+            buf_antecipar(fisico);
+        }
+        pthread_mutex_unlock(&travaBuffers);
+    }
+    __atomic_store_n(&arq->proxLeitura, fim, __ATOMIC_RELAXED);
+    dir_destravar(pai);
+}
+
+void cache() {
+    long acessos = statsBuffers.acertos + statsBuffers.faltas;
+    long sujos = 0, ocupados = 0;
+    for (int k = 0; k < numBuffers; k++) {
+        ocupados += buffers[k].bloco >= 0;
+        sujos += buffers[k].sujo;
+    }
+    printf("Cache de buffers: %d buffers de %ld bytes, %ld ocupados, %ld sujos\n", numBuffers, tamBloco, ocupados,
+           sujos);
+    printf("  acessos: %ld   acertos: %ld (%.1f%%)   faltas: %ld\n", acessos, statsBuffers.acertos,
+           acessos ? 100.0 * statsBuffers.acertos / acessos : 0.0, statsBuffers.faltas);
+    printf("  leitura antecipada: %ld blocos, %ld aproveitados\n", statsBuffers.antecipados,
+           statsBuffers.acertosAntecipados);
+    printf("  expulsões: %ld   bytes gravados no disco: %ld\n", statsBuffers.expulsoes, statsBuffers.bytesGravados);
+}
+
+/*
+ * Deduplicação por conteúdo. Com refsBlocos criado, toda escrita de dados
+ * passa por dedup_gravar, bloco a bloco: o conteúdo novo do bloco é montado
+ * fora do cache e, com o dedup ligado, procurado no índice de impressões.
+ * Se outro bloco já tem exatamente esse conteúdo, o bloco lógico passa a
+ * apontá-lo; senão, um bloco compartilhado é copiado antes de ser alterado
+ * e um bloco próprio é gravado no lugar. travaDedup fica com a escrita
+ * inteira, então índice e contagens nunca são vistos pela metade.
+ */
+uint64_t impressao_bloco(const unsigned char *dados) {
+    uint64_t h[4] = {0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full, 0x165667b19e3779f9ull, 0x27d4eb2f165667c5ull};
+    for (int i = 0; i < tamBloco / 8; i += 4) {
+        for (int l = 0; l < 4; l++) {
+            uint64_t w;
+            memcpy(&w, dados + (i + l) * 8, sizeof(w));
+            h[l] ^= w * 0xc2b2ae3d27d4eb4full;
+            h[l] = ((h[l] << 31) | (h[l] >> 33)) * 0x9e3779b97f4a7c15ull;
+        }
+    }
+    uint64_t r = h[0] ^ ((h[1] << 7) | (h[1] >> 57)) ^ ((h[2] << 12) | (h[2] >> 52)) ^ ((h[3] << 18) | (h[3] >> 46));
+    r ^= r >> 33;
+    r *= 0xff51afd7ed558ccdull;
+    r ^= r >> 33;
+    return r;
+}
+
+int dedup_ligar() {
+    if (refsBlocos != NULL)
+        return 0;
+    capImpressoes = 1;
+    while (capImpressoes < totalBlocos)
+        capImpressoes *= 2;
+    uint32_t *refs = (uint32_t*)calloc(totalBlocos, sizeof(uint32_t));
+    impressaoBloco = (uint64_t*)malloc(totalBlocos * sizeof(uint64_t));
+    proxImpressao = (long*)malloc(totalBlocos * sizeof(long));
+    tabelaImpressoes = (long*)malloc(capImpressoes * sizeof(long));
+    if (refs == NULL || impressaoBloco == NULL || proxImpressao == NULL || tabelaImpressoes == NULL) {
+        free(refs);
+        free(impressaoBloco);
+        free(proxImpressao);
+        free(tabelaImpressoes);
+        impressaoBloco = NULL;
+        proxImpressao = tabelaImpressoes = NULL;
+        return -1;
+    }
+    for (long i = 0; i < totalBlocos; i++)
+        proxImpressao[i] = FORA_INDICE;
+    for (long i = 0; i < capImpressoes; i++)
+        tabelaImpressoes[i] = -1;
+    /* Por último: refsBlocos != NULL é o que faz as escritas e liberações passarem por aqui. */
+    refsBlocos = refs;
+    return 0;
+}
+
+/* Bloco indexado com exatamente o conteúdo 'dados', ou -1. Impressões iguais são conferidas byte a byte. */
+long dedup_buscar(uint64_t h, const unsigned char *dados) {
+    for (long b = tabelaImpressoes[h & (capImpressoes - 1)]; b >= 0; b = proxImpressao[b]) {
+        if (impressaoBloco[b] != h)
+            continue;
+        pthread_mutex_lock(&travaBuffers);
+        int igual = memcmp(buf_obter(b, 1)->dados, dados, tamBloco) == 0;
+        pthread_mutex_unlock(&travaBuffers);
+        if (igual)
+            return b;
+    }
+    return -1;
+}
+
+void dedup_indexar(long b, uint64_t h) {
+    impressaoBloco[b] = h;
+    proxImpressao[b] = tabelaImpressoes[h & (capImpressoes - 1)];
+    tabelaImpressoes[h & (capImpressoes - 1)] = b;
+}
+
+void dedup_desindexar(long b) {
+    if (proxImpressao[b] == FORA_INDICE)
+        return;
+    long *pp = &tabelaImpressoes[impressaoBloco[b] & (capImpressoes - 1)];
+    while (*pp != b)
+        pp = &proxImpressao[*pp];
+    *pp = proxImpressao[b];
+    proxImpressao[b] = FORA_INDICE;
+}
+
+/* Solta uma referência ao bloco 'b'; a última o tira do índice e o devolve. Com travaDedup. */
+void dedup_soltar_travado(long b) {
+    if (refsBlocos[b] > 0) {
+        refsBlocos[b]--;
+        blocosEconomizados--;
+        return;
+    }
+    dedup_desindexar(b);
+    extensao_devolver(b, 1);
+}
+
+/* liberar_extensao com contagens: só as sequências de blocos sem outras referências voltam ao bitmap. */
+void dedup_liberar(long inicio, long tamanho) {
+    pthread_mutex_lock(&travaDedup);
+    long fim = inicio + tamanho;
+    for (long i = inicio; i < fim;) {
+        if (refsBlocos[i] > 0) {
+            refsBlocos[i]--;
+            blocosEconomizados--;
+            i++;
+            continue;
+        }
+        long j = i;
+        while (j < fim && refsBlocos[j] == 0)
+            dedup_desindexar(j++);
+        extensao_devolver(i, j - i);
+        i = j;
+    }
+    pthread_mutex_unlock(&travaDedup);
+}
+
+void bloco_gravar(long b, const unsigned char *dados) {
+    pthread_mutex_lock(&travaBuffers);
+    Buffer *buf = buf_obter(b, 0);
+    memcpy(buf->dados, dados, tamBloco);
+    buf->sujo = 1;
+    pthread_mutex_unlock(&travaBuffers);
+}
+
+int dedup_gravar(Arquivo *arq, long offset, const unsigned char *dados, long n) {
+    unsigned char bloco[TAM_BLOCO_MAX];
+    pthread_mutex_lock(&travaDedup);
+    while (n > 0) {
+        long k = offset / tamBloco;
+        int dentro = (int)(offset % tamBloco);
+        int parte = n < tamBloco - dentro ? (int)n : tamBloco - dentro;
+        long velho = arquivo_bloco_fisico(arq, k);
+        if (parte < tamBloco) {
+            pthread_mutex_lock(&travaBuffers);
+            memcpy(bloco, buf_obter(velho, 1)->dados, tamBloco);
+            pthread_mutex_unlock(&travaBuffers);
+        }
+        memcpy(bloco + dentro, dados, parte);
+
+        uint64_t h = 0;
+        long igual = -1;
+        if (dedupAtivo) {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            h = impressao_bloco(bloco);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            nsHash += (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+            dedupHashes++;
+            igual = dedup_buscar(h, bloco);
+        }
+        if (igual >= 0 && igual != velho) {
+            if (arquivo_remapear(arq, k, igual) != 0) {
+                pthread_mutex_unlock(&travaDedup);
+                printf("Erro: falha na alocação de memória.\n");
+                return -1;
+            }
+            refsBlocos[igual]++;
+            blocosEconomizados++;
+            dedupAcertos++;
+            dedup_soltar_travado(velho);
+        } else if (igual < 0 && refsBlocos[velho] > 0) {
+            long novo;
+            if (alocar_extensao(1, &novo) == 0) {
+                pthread_mutex_unlock(&travaDedup);
+                printf("Erro: não há mais blocos livres.\n");
+                return -1;
+            }
+            if (arquivo_remapear(arq, k, novo) != 0) {
+                extensao_devolver(novo, 1);
+                pthread_mutex_unlock(&travaDedup);
+                printf("Erro: falha na alocação de memória.\n");
+                return -1;
+            }
+            bloco_gravar(novo, bloco);
+            refsBlocos[velho]--;
+            blocosEconomizados--;
+            dedupCopias++;
+            if (dedupAtivo)
+                dedup_indexar(novo, h);
+        } else if (igual < 0) {
+            dedup_desindexar(velho);
+            bloco_gravar(velho, bloco);
+            if (dedupAtivo)
+                dedup_indexar(velho, h);
+        }
+        offset += parte;
+        dados += parte;
+        n -= parte;
+    }
+    pthread_mutex_unlock(&travaDedup);
+    return 0;
+}
+
+/* Acrescenta [inicio, inicio + tamanho) a 'v', emendando na última extensão se for contígua. */
+void extensao_juntar(Extensao *v, int *n, long inicio, long tamanho) {
+    if (*n > 0 && extensao_emenda(&v[*n - 1], inicio)) {
+        v[*n - 1].tamanho += tamanho;
+        return;
+    }
+    v[*n].inicio = inicio;
+    v[*n].tamanho = tamanho;
+    (*n)++;
+}
+
+/* Faz o bloco lógico 'k' de 'arq' apontar para o bloco físico 'novo', partindo a extensão que o continha. */
+int arquivo_remapear(Arquivo *arq, long k, long novo) {
+    int cap = arq->numExt + 2;
+    Extensao *ext = (Extensao*)arena_alocar(cap * sizeof(Extensao));
+    if (ext == NULL)
+        return -1;
+    int n = 0;
+    long base = 0;
+    for (int j = 0; j < arq->numExt; j++) {
+        Extensao e = arq->ext[j];
+        if (k < base || k >= base + e.tamanho) {
+            extensao_juntar(ext, &n, e.inicio, e.tamanho);
+        } else {
+            long dentro = k - base;
+            if (dentro > 0)
+                extensao_juntar(ext, &n, e.inicio, dentro);
+            extensao_juntar(ext, &n, novo, 1);
+            if (dentro + 1 < e.tamanho)
+                extensao_juntar(ext, &n, e.inicio == BURACO ? BURACO : e.inicio + dentro + 1,
+                                e.tamanho - dentro - 1);
+        }
+        base += e.tamanho;
+    }
+    arena_liberar(arq->ext, arq->capExt * sizeof(Extensao));
+    arq->ext = ext;
+    arq->capExt = cap;
+    arq->numExt = n;
+    arq->attr.posicao = arquivo_posicao(arq);
+    frag_atualizar(arq);
+    return 0;
+}
+
+int arquivo_compartilha_blocos(Arquivo *arq) {
+    for (int j = 0; j < arq->numExt; j++)
+        for (long i = 0; i < arq->ext[j].tamanho && arq->ext[j].inicio != BURACO; i++)
+            if (refsBlocos[arq->ext[j].inicio + i] > 0)
+                return 1;
+    return 0;
+}
+
+/* Blocos de 'arq' com mais de uma referência. */
+long arquivo_blocos_compartilhados(Arquivo *arq) {
+    long n = 0;
+    for (int j = 0; j < arq->numExt; j++)
+        for (long i = 0; i < arq->ext[j].tamanho && arq->ext[j].inicio != BURACO; i++)
+            n += refsBlocos[arq->ext[j].inicio + i] > 0;
+    return n;
+}
+
+/* Blocos físicos que cabem a 'arq': um bloco com r referências conta 1/r para cada uma. Com travaDedup. */
+double arquivo_fisicos(Arquivo *arq) {
+    double n = 0;
+    for (int j = 0; j < arq->numExt; j++)
+        for (long i = 0; i < arq->ext[j].tamanho && arq->ext[j].inicio != BURACO; i++)
+            n += 1.0 / (refsBlocos[arq->ext[j].inicio + i] + 1);
+    return n;
+}
+
+/* dedup [on|off]: liga ou desliga a deduplicação das escritas, ou mostra o que ela economizou. */
+void dedup() {
+    if (argList[1] != NULL) {
+        if (strcmp(argList[1], "on") != 0 && strcmp(argList[1], "off") != 0) {
+            printf("Erro: uso: dedup [on|off]\n");
+            return;
+        }
+        if (strcmp(argList[1], "off") == 0) {
+            dedupAtivo = 0;
+            printf("Deduplicação desligada.\n");
+            return;
+        }
+        if (mapaVolume != NULL) {
+            printf("Erro: a deduplicação só existe em volumes em memória.\n");
+            return;
+        }
+        if (dedup_ligar() != 0) {
+            printf("Erro: falha na alocação de memória.\n");
+            return;
+        }
+        dedupAtivo = 1;
+        printf("Deduplicação ligada.\n");
+        return;
+    }
+    long fisicos = totalBlocos - blocosReservados - espacosLivres;
+    printf("Deduplicação %s.\n", dedupAtivo ? "ligada" : "desligada");
+    printf("  blocos com impressão: %ld   iguais encontrados: %ld   cópias na escrita: %ld\n", dedupHashes,
+           dedupAcertos, dedupCopias);
+    printf("  tempo de hash: %.3f ms (%.0f ns por bloco)\n", nsHash / 1e6, dedupHashes ? (double)nsHash / dedupHashes : 0.0);
+    printf("  uso lógico: %ld bloco(s)   físico: %ld bloco(s)   economizados: %ld (%.1f%%)\n",
+           fisicos + blocosEconomizados, fisicos, blocosEconomizados,
+           fisicos + blocosEconomizados ? 100.0 * blocosEconomizados / (fisicos + blocosEconomizados) : 0.0);
+}
+
+/* preenche <caminho> [texto]: grava o arquivo inteiro com 'texto' repetido, ou com zeros. */
+void preenche() {
+    if (argList[1] == NULL) {
+        printf("Erro: uso: preenche <caminho/nome_do_arquivo> [texto]\n");
+        return;
+    }
+    Bloco *pai;
+    Bloco* alvo = resolver_arquivo(argList[1], 1, &pai);
+    if (alvo == NULL)
+        return;
+    if (alvo->arq->compartilhado > 0 && arquivo_copiar(alvo) != 0) {
+        dir_destravar(pai);
+        return;
+    }
+    Arquivo *arq = alvo->arq;
+    const char *texto = argList[2];
+    size_t len = texto != NULL ? strlen(texto) : 0;
+    unsigned char bloco[TAM_BLOCO_MAX];
+    long blocosAntes = arquivo_blocos(arq);
+    int falhou = 0;
+    for (long offset = 0; offset < arq->tamanho && !falhou; offset += tamBloco) {
+        long parte = arq->tamanho - offset < tamBloco ? arq->tamanho - offset : tamBloco;
+        for (long i = 0; i < parte; i++)
+            bloco[i] = len > 0 ? (unsigned char)texto[(offset + i) % len] : 0;
+        if (arquivo_transferir(arq, offset, bloco, parte, 1) != 0)
+            falhou = 1;
+        else if (offset + parte > arq->escritoAte)
+            arq->escritoAte = offset + parte;
+    }
+    if (arquivo_blocos(arq) != blocosAntes)
+        agregados_somar(pai, (Uso){0, 0, 0, arquivo_blocos(arq) - blocosAntes}, 1);
+    if (falhou) {
+        dir_destravar(pai);
+        return;
+    }
+    if (mapaVolume != NULL && arq->attr.ino >= 0) {
+        inodes[arq->attr.ino].escritoAte = arq->escritoAte;
+        diario_sujar(&inodes[arq->attr.ino], sizeof(InodeDisco));
+    }
+    printf("%ld byte(s) escrito(s) em '%s'.\n", arq->tamanho, alvo->nome);
+    dir_destravar(pai);
+}
+
+/*
+ * Índice de nomes do 'busca' (ver IndiceBusca). As funções sem trava
+ * própria supõem indice.trava, ou o volume exclusivo, que é como 'busca'
+ * roda.
+ */
+unsigned hash_ponteiro(const void *p) {
+    uintptr_t x = (uintptr_t)p;
+    return (unsigned)((x ^ (x >> 17)) >> 4) * 2654435761u;
+}
+
+/* Posição da entrada com esta chave, ou -1. */
+int32_t busca_entrada(void *chave) {
+    if (indice.capPorChave == 0)
+        return -1;
+    int32_t e = indice.porChave[hash_ponteiro(chave) & (indice.capPorChave - 1)];
+    while (e >= 0 && indice.entradas[e].chave != chave)
+        e = indice.entradas[e].proxChave;
+    return e;
+}
+
+/* Trigrama 'chave' na tabela; com 'criar', uma posição nova se ainda não existe (NULL se faltar memória). */
+Trigrama* trigrama_buscar(uint32_t chave, int criar) {
+    if (criar && (indice.numTrigramas + 1) * 2 > indice.capTrigramas) {
+        unsigned cap = indice.capTrigramas ? indice.capTrigramas * 2 : 4096;
+        Trigrama *t = (Trigrama*)calloc(cap, sizeof(Trigrama));
+        if (t == NULL)
+            return NULL;
+        for (unsigned i = 0; i < indice.capTrigramas; i++) {
+            if (indice.trigramas[i].chave == 0)
+                continue;
+            unsigned k = (indice.trigramas[i].chave * 2654435761u) & (cap - 1);
+            while (t[k].chave != 0)
+                k = (k + 1) & (cap - 1);
+            t[k] = indice.trigramas[i];
+        }
+        free(indice.trigramas);
+        indice.trigramas = t;
+        indice.capTrigramas = cap;
+    }
+    if (indice.capTrigramas == 0)
+        return NULL;
+    unsigned k = (chave * 2654435761u) & (indice.capTrigramas - 1);
+    while (indice.trigramas[k].chave != 0) {
+        if (indice.trigramas[k].chave == chave)
+            return &indice.trigramas[k];
+        k = (k + 1) & (indice.capTrigramas - 1);
+    }
+    if (!criar)
+        return NULL;
+    indice.trigramas[k].chave = chave;
+    indice.numTrigramas++;
+    return &indice.trigramas[k];
+}
+
+/*
+ * Registro do nome 'texto', ou -1. Com 'criar', um nome que ainda não está
+ * no índice ganha registro e entra nas listas dos seus trigramas; -1 aí
+ * quer dizer falta de memória, e o índice deixa de ser confiável.
+ */
+int32_t busca_nome(const char *texto, int criar) {
+    unsigned h = hash_nome(texto, 0);
+    if (indice.capPorNome > 0) {
+        for (int32_t n = indice.porNome[h & (indice.capPorNome - 1)]; n >= 0; n = indice.nomes[n].proxHash)
+            if (indice.nomes[n].hash == h && strcmp(indice.nomes[n].texto, texto) == 0)
+                return n;
+    }
+    if (!criar)
+        return -1;
+
+    if (indice.numNomes == indice.capNomes) {
+        int32_t cap = indice.capNomes ? indice.capNomes * 2 : 1024;
+        NomeBusca *v = (NomeBusca*)realloc(indice.nomes, cap * sizeof(NomeBusca));
+        if (v == NULL)
+            return -1;
+        indice.nomes = v;
+        indice.capNomes = cap;
+    }
+    if ((unsigned)indice.numNomes >= indice.capPorNome) {
+        unsigned cap = indice.capPorNome ? indice.capPorNome * 2 : 1024;
+        int32_t *t = (int32_t*)malloc(cap * sizeof(int32_t));
+        if (t == NULL)
+            return -1;
+        memset(t, 0xff, cap * sizeof(int32_t));
+        for (int32_t n = 0; n < indice.numNomes; n++) {
+            indice.nomes[n].proxHash = t[indice.nomes[n].hash & (cap - 1)];
+            t[indice.nomes[n].hash & (cap - 1)] = n;
+        }
+        free(indice.porNome);
+        indice.porNome = t;
+        indice.capPorNome = cap;
+    }
+    char *copia = strdup(texto);
+    if (copia == NULL)
+        return -1;
+    int32_t id = indice.numNomes++;
+    NomeBusca *nb = &indice.nomes[id];
+    nb->texto = copia;
+    nb->hash = h;
+    nb->primeira = -1;
+    nb->numEntradas = 0;
+    nb->proxHash = indice.porNome[h & (indice.capPorNome - 1)];
+    indice.porNome[h & (indice.capPorNome - 1)] = id;
+
+    /* Os trigramas incluem as marcas de começo e fim, então "ab" ainda tem dois. */
+    unsigned char pad[MAX_NOME + 2];
+    size_t len = strlen(texto);
+    pad[0] = TRIGRAMA_INICIO;
+    memcpy(pad + 1, texto, len);
+    pad[len + 1] = TRIGRAMA_FIM;
+    for (size_t i = 0; i + 3 <= len + 2; i++) {
+        Trigrama *t = trigrama_buscar((uint32_t)pad[i] << 16 | (uint32_t)pad[i + 1] << 8 | pad[i + 2], 1);
+        if (t == NULL)
+            return -1;
+        if (t->num > 0 && t->nomes[t->num - 1] == id)
+            continue;
+        if (t->num == t->cap) {
+            uint32_t cap = t->cap ? t->cap * 2 : 4;
+            int32_t *v = (int32_t*)realloc(t->nomes, cap * sizeof(int32_t));
+            if (v == NULL)
+                return -1;
+            t->nomes = v;
+            t->cap = cap;
+        }
+        t->nomes[t->num++] = id;
+    }
+    return id;
+}
+
+/* Põe no índice a entrada de conteúdo 'chave' e nome 'nome' no diretório 'pai'. Devolve -1 se faltar memória. */
+int busca_ligar(void *chave, Diretorio *pai, const char *nome, int ehDir) {
+    int32_t n = busca_nome(nome, 1);
+    if (n < 0)
+        return -1;
+    if (indice.vagas < 0 && indice.numEntradas == indice.capEntradas) {
+        int32_t cap = indice.capEntradas ? indice.capEntradas * 2 : 1024;
+        EntradaBusca *v = (EntradaBusca*)realloc(indice.entradas, cap * sizeof(EntradaBusca));
+        if (v == NULL)
+            return -1;
+        indice.entradas = v;
+        indice.capEntradas = cap;
+    }
+    if ((unsigned)indice.emUso >= indice.capPorChave) {
+        unsigned cap = indice.capPorChave ? indice.capPorChave * 2 : 1024;
+        int32_t *t = (int32_t*)malloc(cap * sizeof(int32_t));
+        if (t == NULL)
+            return -1;
+        memset(t, 0xff, cap * sizeof(int32_t));
+        for (int32_t e = 0; e < indice.numEntradas; e++) {
+            EntradaBusca *x = &indice.entradas[e];
+            if (x->chave == NULL)
+                continue;
+            x->proxChave = t[hash_ponteiro(x->chave) & (cap - 1)];
+            t[hash_ponteiro(x->chave) & (cap - 1)] = e;
+        }
+        free(indice.porChave);
+        indice.porChave = t;
+        indice.capPorChave = cap;
+    }
+
+    int32_t e;
+    if (indice.vagas >= 0) {
+        e = indice.vagas;
+        indice.vagas = indice.entradas[e].prox;
+    } else {
+        e = indice.numEntradas++;
+    }
+    EntradaBusca *x = &indice.entradas[e];
+    NomeBusca *nb = &indice.nomes[n];
+    x->chave = chave;
+    x->pai = pai;
+    x->nome = n;
+    x->ehDir = ehDir;
+    x->ant = -1;
+    x->prox = nb->primeira;
+    if (nb->primeira >= 0)
+        indice.entradas[nb->primeira].ant = e;
+    nb->primeira = e;
+    if (nb->numEntradas++ == 0)
+        indice.nomesVivos++;
+    unsigned h = hash_ponteiro(chave) & (indice.capPorChave - 1);
+    x->proxChave = indice.porChave[h];
+    indice.porChave[h] = e;
+    indice.emUso++;
+    return 0;
+}
+
+/* Tira a entrada 'e' do índice; a posição vai para a lista de vagas. */
+void busca_desligar(int32_t e) {
+    EntradaBusca *x = &indice.entradas[e];
+    int32_t *pp = &indice.porChave[hash_ponteiro(x->chave) & (indice.capPorChave - 1)];
+    while (*pp != e)
+        pp = &indice.entradas[*pp].proxChave;
+    *pp = x->proxChave;
+
+    NomeBusca *nb = &indice.nomes[x->nome];
+    if (x->ant >= 0)
+        indice.entradas[x->ant].prox = x->prox;
+    else
+        nb->primeira = x->prox;
+    if (x->prox >= 0)
+        indice.entradas[x->prox].ant = x->ant;
+    if (--nb->numEntradas == 0)
+        indice.nomesVivos--;
+
+    x->chave = NULL;
+    x->prox = indice.vagas;
+    indice.vagas = e;
+    indice.emUso--;
+}
+
+/* Monta o índice do zero com um percurso da árvore atual (que traz do volume o que ainda não foi carregado). */
+int busca_montar() {
+    busca_descartar();
+    Percurso p;
+    Diretorio **ultimos = NULL;
+    int cap = 0, erro = 0;
+    if (percurso_iniciar(&p, raiz, -1) != 0)
+        return -1;
+    Bloco *b;
+    int nivel;
+    while (!erro && (b = percurso_proximo(&p, &nivel)) != NULL) {
+        Diretorio *pai = nivel == 0 ? raiz->dir : ultimos[nivel - 1];
+        erro = busca_ligar(b->arq != NULL ? (void*)b->arq : (void*)b->dir, pai, b->nome, b->arq == NULL) != 0;
+        if (b->arq != NULL || erro)
+            continue;
+        if (nivel >= cap) {
+            int novo = cap ? cap * 2 : PILHA_PERCURSO;
+            Diretorio **maior = (Diretorio**)realloc(ultimos, novo * sizeof(Diretorio*));
+            if (maior == NULL) {
+                erro = 1;
+                break;
+            }
+            ultimos = maior;
+            cap = novo;
+        }
+        ultimos[nivel] = b->dir;
+    }
+    erro |= p.erro;
+    percurso_encerrar(&p);
+    free(ultimos);
+    if (erro) {
+        busca_descartar();
+        return -1;
+    }
+    __atomic_store_n(&indice.montado, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void busca_descartar() {
+    for (int32_t n = 0; n < indice.numNomes; n++)
+        free(indice.nomes[n].texto);
+    for (unsigned i = 0; i < indice.capTrigramas; i++)
+        free(indice.trigramas[i].nomes);
+    free(indice.entradas);
+    free(indice.porChave);
+    free(indice.nomes);
+    free(indice.porNome);
+    free(indice.trigramas);
+    __atomic_store_n(&indice.montado, 0, __ATOMIC_RELEASE);
+    indice.entradas = NULL;
+    indice.numEntradas = indice.capEntradas = indice.emUso = 0;
+    indice.vagas = -1;
+    indice.porChave = NULL;
+    indice.capPorChave = 0;
+    indice.nomes = NULL;
+    indice.numNomes = indice.capNomes = indice.nomesVivos = 0;
+    indice.porNome = NULL;
+    indice.capPorNome = 0;
+    indice.trigramas = NULL;
+    indice.capTrigramas = indice.numTrigramas = 0;
+}
+
+/*
+ * Ganchos dos comandos que mudam a árvore, chamados com o diretório pai
+ * travado para escrita. Sem índice montado não fazem nada; se faltar
+ * memória no meio, o índice é descartado e o próximo 'busca' o remonta.
+ */
+void busca_inserir(Bloco *pai, Bloco *b) {
+    if (!__atomic_load_n(&indice.montado, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&indice.trava);
+    if (indice.montado
+        && busca_ligar(b->arq != NULL ? (void*)b->arq : (void*)b->dir, pai->dir, b->nome, b->arq == NULL) != 0) {
+        printf("Erro: falha na alocação de memória; o índice de nomes será remontado.\n");
+        busca_descartar();
+    }
+    pthread_mutex_unlock(&indice.trava);
+}
+
+void busca_remover(Bloco *b) {
+    if (!__atomic_load_n(&indice.montado, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&indice.trava);
+    int32_t e = indice.montado ? busca_entrada(b->arq != NULL ? (void*)b->arq : (void*)b->dir) : -1;
+    if (e >= 0)
+        busca_desligar(e);
+    pthread_mutex_unlock(&indice.trava);
+}
+
+/* O conteúdo de uma entrada foi copiado (ver arquivo_copiar): a entrada passa para a chave nova. */
+void busca_trocar(void *velha, void *nova) {
+    if (!__atomic_load_n(&indice.montado, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&indice.trava);
+    int32_t e = indice.montado ? busca_entrada(velha) : -1;
+    if (e >= 0) {
+        int32_t *pp = &indice.porChave[hash_ponteiro(velha) & (indice.capPorChave - 1)];
+        while (*pp != e)
+            pp = &indice.entradas[*pp].proxChave;
+        *pp = indice.entradas[e].proxChave;
+        unsigned h = hash_ponteiro(nova) & (indice.capPorChave - 1);
+        indice.entradas[e].chave = nova;
+        indice.entradas[e].proxChave = indice.porChave[h];
+        indice.porChave[h] = e;
+    }
+    pthread_mutex_unlock(&indice.trava);
+}
+
+/* dir_copiar trocou o Diretorio de 'b': a entrada dele muda de chave e as dos filhos, de pai. */
+void busca_copiou_dir(Diretorio *velho, Bloco *b) {
+    busca_trocar(velho, b->dir);
+    if (!__atomic_load_n(&indice.montado, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&indice.trava);
+    for (Bloco *c = b->filho; c != NULL && indice.montado; c = c->prox) {
+        int32_t e = busca_entrada(c->arq != NULL ? (void*)c->arq : (void*)c->dir);
+        if (e >= 0)
+            indice.entradas[e].pai = b->dir;
+    }
+    pthread_mutex_unlock(&indice.trava);
+}
+
+/* A entrada está abaixo do diretório 'escopo'? Sobe pelos pais guardados no índice. */
+int busca_dentro(EntradaBusca *e, Diretorio *escopo) {
+    for (Diretorio *d = e->pai; d != raiz->dir;) {
+        if (d == escopo)
+            return 1;
+        int32_t x = busca_entrada(d);
+        if (x < 0)
+            return 0;
+        d = indice.entradas[x].pai;
+    }
+    return escopo == raiz->dir;
+}
+
+/*
+ * Escreve o caminho absoluto da entrada no fim de 'destino' (diretórios
+ * terminam em '/') e devolve onde ele começa, ou -1 se não couber.
+ */
+int busca_caminho(EntradaBusca *e, char *destino, size_t tam) {
+    size_t pos = tam - 1;
+    destino[pos] = '\0';
+    if (e->ehDir)
+        destino[--pos] = '/';
+    for (;;) {
+        const char *nome = indice.nomes[e->nome].texto;
+        size_t len = strlen(nome);
+        if (len + 1 > pos)
+            return -1;
+        pos -= len;
+        memcpy(destino + pos, nome, len);
+        destino[--pos] = '/';
+        if (e->pai == raiz->dir)
+            return (int)pos;
+        int32_t x = busca_entrada(e->pai);
+        if (x < 0)
+            return -1;
+        e = &indice.entradas[x];
+    }
+}
+
+/*
+ * Nomes que podem casar com o curinga 'padrao': os que têm todos os
+ * trigramas dos trechos literais dele, com as marcas de começo e fim
+ * quando o padrão começa ou termina num literal. As listas são crescentes,
+ * então a menor é filtrada por busca binária nas outras. Devolve quantos
+ * nomes ficaram em *saida (alocada aqui), ou -1 se o padrão não tem trecho
+ * com três caracteres e todos os nomes são candidatos.
+ */
+long busca_candidatos(const char *padrao, int32_t **saida) {
+    Trigrama *usados[64];
+    int numUsados = 0;
+    unsigned char trecho[MAX_CAMINHO + 2];
+    size_t len = 0;
+    trecho[len++] = TRIGRAMA_INICIO;
+    *saida = NULL;
+    for (const char *p = padrao;; p++) {
+        if (*p != '\0' && *p != '*' && *p != '?' && *p != '[' && *p != '\\') {
+            if (len < MAX_CAMINHO)
+                trecho[len++] = (unsigned char)*p;
+            continue;
+        }
+        if (*p == '\0')
+            trecho[len++] = TRIGRAMA_FIM;
+        for (size_t i = 0; i + 3 <= len && numUsados < 64; i++) {
+            Trigrama *t = trigrama_buscar((uint32_t)trecho[i] << 16 | (uint32_t)trecho[i + 1] << 8 | trecho[i + 2], 0);
+            if (t == NULL)
+                return 0;
+            usados[numUsados++] = t;
+        }
+        len = 0;
+        if (*p == '\0')
+            break;
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '[') {
+            const char *q = p + 1;
+            if (*q == '!' || *q == '^')
+                q++;
+            if (*q == ']')
+                q++;
+            while (*q != '\0' && *q != ']')
+                q++;
+            p = *q != '\0' ? q : q - 1;
+        }
+    }
+    if (numUsados == 0)
+        return -1;
+
+    int menor = 0;
+    for (int i = 1; i < numUsados; i++)
+        if (usados[i]->num < usados[menor]->num)
+            menor = i;
+    int32_t *v = (int32_t*)malloc((usados[menor]->num ? usados[menor]->num : 1) * sizeof(int32_t));
+    if (v == NULL)
+        return -1;
+    long n = 0;
+    for (uint32_t k = 0; k < usados[menor]->num; k++) {
+        int32_t id = usados[menor]->nomes[k];
+        int todos = 1;
+        for (int i = 0; i < numUsados && todos; i++) {
+            if (i == menor)
+                continue;
+            long lo = 0, hi = (long)usados[i]->num - 1;
+            todos = 0;
+            while (lo <= hi) {
+                long meio = (lo + hi) / 2;
+                if (usados[i]->nomes[meio] == id) {
+                    todos = 1;
+                    break;
+                }
+                if (usados[i]->nomes[meio] < id)
+                    lo = meio + 1;
+                else
+                    hi = meio - 1;
+            }
+        }
+        if (todos)
+            v[n++] = id;
+    }
+    *saida = v;
+    return n;
+}
+
+/*
+ * busca <padrao> [caminho]: entradas cujo nome é 'padrao' (sem curingas),
+ * ou casa com ele como no shell ('*', '?', '[...]'; "abc*" é busca por
+ * prefixo), opcionalmente só abaixo de 'caminho'. Sai um caminho completo
+ * por linha. Nomes exatos custam uma busca no índice; curingas, a
+ * interseção das listas de trigramas e a conferência dos candidatos.
+ */
+void busca() {
+    if (argList[1] == NULL) {
+        printf("Erro: uso: busca <padrao> [caminho]\n");
+        return;
+    }
+    Diretorio *escopo = raiz->dir;
+    if (argList[2] != NULL) {
+        Bloco *d = resolver_dir(argList[2], 0);
+        if (d == NULL)
+            return;
+        escopo = d->dir;
+        dir_destravar(d);
+    }
+
+    struct timespec t0, t1;
+    if (!indice.montado || (indice.numNomes > 1024 && indice.nomesVivos * 2 < indice.numNomes)) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (busca_montar() != 0) {
+            printf("Erro: falha na alocação de memória.\n");
+            return;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("Índice de nomes montado: %d entrada(s), %d nome(s), %u trigrama(s) em %.3f ms.\n", indice.emUso,
+               indice.numNomes, indice.numTrigramas,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    }
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    const char *padrao = argList[1];
+    int exato = strpbrk(padrao, "*?[\\") == NULL;
+    int32_t um = -1, *lista = &um;
+    long n;
+    if (exato) {
+        um = busca_nome(padrao, 0);
+        n = um >= 0;
+    } else {
+        n = busca_candidatos(padrao, &lista);
+    }
+    Escritor *e = (Escritor*)malloc(sizeof(Escritor));
+    if (e == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        if (lista != &um)
+            free(lista);
+        return;
+    }
+    e->usado = 0;
+    long achados = 0, longos = 0, total = n < 0 ? indice.numNomes : n;
+    char caminho[MAX_CAMINHO * 4];
+    for (long i = 0; i < total; i++) {
+        NomeBusca *nb = &indice.nomes[n < 0 ? i : lista[i]];
+        if (nb->numEntradas == 0 || (!exato && fnmatch(padrao, nb->texto, 0) != 0))
+            continue;
+        for (int32_t x = nb->primeira; x >= 0; x = indice.entradas[x].prox) {
+            EntradaBusca *en = &indice.entradas[x];
+            if (escopo != raiz->dir && !busca_dentro(en, escopo))
+                continue;
+            int ini = busca_caminho(en, caminho, sizeof(caminho) - 1);
+            if (ini < 0) {
+                /* O caminho não cabe no buffer: a entrada casou, então aparece só com o nome. */
+                int len = snprintf(caminho, sizeof(caminho), ".../%s%s (caminho longo demais)\n", nb->texto,
+                                   en->ehDir ? "/" : "");
+                escritor_por(e, caminho, len < (int)sizeof(caminho) ? (size_t)len : sizeof(caminho) - 1);
+                achados++;
+                longos++;
+                continue;
+            }
+            size_t len = strlen(caminho + ini);
+            caminho[ini + len] = '\n';
+            escritor_por(e, caminho + ini, len + 1);
+            achados++;
+        }
+    }
+    escritor_descarregar(e);
+    free(e);
+    if (lista != &um)
+        free(lista);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%ld entrada(s) encontrada(s) em %.3f ms", achados,
+           (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    if (longos > 0)
+        printf(", %ld com caminho longo demais para mostrar inteiro", longos);
+    printf(".\n");
+}
+
+Atributos* atributos(Bloco *b) {
+    return b->arq != NULL ? &b->arq->attr : &b->dir->attr;
+}
+
+/*
+ * Devolve a cópia única de 'nome' na arena de nomes, criando-a se preciso.
+ * Cada Bloco guarda só o ponteiro; nomes repetidos (f1, f2, ... em vários
+ * diretórios) ocupam memória uma vez.
+ */
+const char* nome_internar(const char *nome) {
+    unsigned h = hash_nome(nome, 0);
+    pthread_mutex_lock(&travaNomes);
+    if (capNomes > 0) {
+        for (NomeInterno *n = tabelaNomes[h & (capNomes - 1)]; n != NULL; n = n->prox) {
+            if (n->hash == h && strcmp(n->texto, nome) == 0) {
+                n->refs++;
+                pthread_mutex_unlock(&travaNomes);
+                return n->texto;
+            }
+        }
+    }
+
+    if (numNomes >= capNomes) {
+        unsigned cap = capNomes ? capNomes * 2 : 1024;
+        NomeInterno **tabela = (NomeInterno**)arena_alocar(cap * sizeof(NomeInterno*));
+        if (tabela == NULL) {
+            pthread_mutex_unlock(&travaNomes);
+            return NULL;
+        }
+        for (unsigned k = 0; k < capNomes; k++) {
+            NomeInterno *n = tabelaNomes[k];
+            while (n != NULL) {
+                NomeInterno *prox = n->prox;
+                n->prox = tabela[n->hash & (cap - 1)];
+                tabela[n->hash & (cap - 1)] = n;
+                n = prox;
+            }
+        }
+        arena_liberar(tabelaNomes, capNomes * sizeof(NomeInterno*));
+        tabelaNomes = tabela;
+        capNomes = cap;
+    }
+
+    size_t len = strlen(nome);
+    NomeInterno *n = (NomeInterno*)arena_alocar(sizeof(NomeInterno) + len + 1);
+    if (n == NULL) {
+        pthread_mutex_unlock(&travaNomes);
+        return NULL;
+    }
+    n->hash = h;
+    n->refs = 1;
+    n->tamanho = (uint16_t)len;
+    memcpy(n->texto, nome, len + 1);
+    n->prox = tabelaNomes[h & (capNomes - 1)];
+    tabelaNomes[h & (capNomes - 1)] = n;
+    numNomes++;
+    pthread_mutex_unlock(&travaNomes);
+    return n->texto;
+}
+
+void nome_soltar(const char *nome) {
+    if (nome == NULL)
+        return;
+    NomeInterno *n = (NomeInterno*)(nome - offsetof(NomeInterno, texto));
+    pthread_mutex_lock(&travaNomes);
+    if (--n->refs > 0) {
+        pthread_mutex_unlock(&travaNomes);
+        return;
+    }
+    NomeInterno **pp = &tabelaNomes[n->hash & (capNomes - 1)];
+    while (*pp != n)
+        pp = &(*pp)->prox;
+    *pp = n->prox;
+    numNomes--;
+    pthread_mutex_unlock(&travaNomes);
+    arena_liberar(n, sizeof(NomeInterno) + n->tamanho + 1);
+}
+
+char* substituir_string(const char *string, const char *search, const char *replacement) {
+    const char *pos = strstr(string, search);
+    if (!pos) return strdup(string);
+
+    size_t new_length = strlen(string) - strlen(search) + strlen(replacement) + 1;
+    char *newstr = (char *)malloc(new_length);
+    if (!newstr) return NULL;
+
+    size_t prefix_length = pos - string;
+    strncpy(newstr, string, prefix_length);
     newstr[prefix_length] = '\0';
     strcat(newstr, replacement);
     strcat(newstr, pos + strlen(search));
 
-    return newstr;
+    return newstr;
+}
+
+void criad() {
+    if (argList[1] == NULL) {
+        printf("Erro: nome do diretório não fornecido.\n");
+        return;
+    }
+
+    char *nome;
+    Bloco* atual = resolver_pai(argList[1], &nome, 1);
+    if (atual == NULL)
+        return;
+    criad_em(atual, nome);
+    dir_destravar(atual);
+}
+
+/* Corpo de criad, com 'atual' já travado para escrita. */
+void criad_em(Bloco *atual, char *nome) {
+    if (dir_buscar(atual, nome, 1) != NULL) {
+        printf("Erro: diretório '%s' já existe.\n", nome);
+        return;
+    }
+
+    long pos = alocar_bloco();
+    if (pos == -1) {
+        return;
+    }
+    if (criad_ligar(atual, nome, pos) == NULL)
+        return;
+    agregados_somar(atual, (Uso){0, 1, 0, 1}, 1);
+
+    printf("Diretório '%s' criado com sucesso.\n", nome);
+}
+
+/*
+ * Cria o diretório 'nome' em 'atual' com o bloco 'pos', já alocado (no
+ * volume e no índice de nomes também). Os agregados ficam com quem chama.
+ * Se falha, 'pos' é liberado e devolve NULL.
+ */
+Bloco* criad_ligar(Bloco *atual, const char *nome, long pos) {
+    Bloco* novoBloco = (Bloco*)pool_alocar(&poolBlocos);
+    if (novoBloco == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        liberar_bloco(pos);
+        return NULL;
+    }
+
+    novoBloco->nome = nome_internar(nome);
+    novoBloco->arq = NULL;
+    novoBloco->dir = dir_criar();
+    novoBloco->filho = NULL;
+    if (novoBloco->nome == NULL || novoBloco->dir == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        nome_soltar(novoBloco->nome);
+        dir_destruir(novoBloco->dir);
+        pool_liberar(&poolBlocos, novoBloco);
+        liberar_bloco(pos);
+        return NULL;
+    }
+    novoBloco->dir->attr.criado = time(NULL);
+    novoBloco->dir->attr.posicao = pos;
+    novoBloco->dir->attr.ino = -1;
+    if (volume_registrar(atual, novoBloco) != 0) {
+        nome_soltar(novoBloco->nome);
+        dir_destruir(novoBloco->dir);
+        pool_liberar(&poolBlocos, novoBloco);
+        liberar_bloco(pos);
+        return NULL;
+    }
+    if (dir_inserir(atual, novoBloco) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        volume_desregistrar(atual, novoBloco);
+        nome_soltar(novoBloco->nome);
+        dir_destruir(novoBloco->dir);
+        pool_liberar(&poolBlocos, novoBloco);
+        liberar_bloco(pos);
+        return NULL;
+    }
+    busca_inserir(atual, novoBloco);
+    return novoBloco;
+}
+
+void criaa() {
+    if (argList[1] == NULL || argList[2] == NULL) {
+        printf("Erro: nome e/ou tamanho do arquivo não fornecido.\n");
+        return;
+    }
+    int prealocar = argList[3] != NULL && strcmp(argList[3], "--prealloc") == 0;
+    if (argList[3] != NULL && !prealocar) {
+        printf("Erro: uso: criaa <caminho/nome_do_arquivo> <tamanho> [--prealloc]\n");
+        return;
+    }
+
+    char *nome;
+    Bloco* atual = resolver_pai(argList[1], &nome, 1);
+    if (atual == NULL)
+        return;
+    criaa_em(atual, nome, atol(argList[2]), prealocar);
+    dir_destravar(atual);
+}
+
+/*
+ * Corpo de criaa, com 'atual' já travado para escrita. Sem 'prealocar' o
+ * arquivo nasce esparso: os blocos inteiros são um buraco só, e ganham
+ * blocos na primeira escrita (ver arquivo_preencher). A cauda é alocada já.
+ */
+void criaa_em(Bloco *atual, char *nome, long file_size, int prealocar) {
+    if (dir_buscar(atual, nome, 0) != NULL) {
+        printf("Erro: arquivo '%s' já existe.\n", nome);
+        return;
+    }
+
+    long num_blocks = criaa_blocos(file_size, NULL);
+    if (file_size < 0 || (prealocar && num_blocks > __atomic_load_n(&espacosLivres, __ATOMIC_RELAXED))) {
+        printf("Erro: espaço insuficiente para criar o arquivo.\n");
+        return;
+    }
+
+    Arquivo* arq = criaa_arquivo(file_size, prealocar, NULL);
+    if (arq == NULL || criaa_ligar(atual, nome, arq) == NULL)
+        return;
+    agregados_somar(atual, (Uso){1, 0, file_size, arquivo_blocos(arq)}, 1);
+
+    printf("Arquivo '%s' criado com sucesso.\n", nome);
+}
+
+/* Blocos inteiros de um arquivo de 'tamanho' bytes; *fatias (se pedido) recebe as fatias de cauda do resto, ou 0. */
+long criaa_blocos(long tamanho, int *fatias) {
+    long n = (tamanho + tamBloco - 1) / tamBloco;
+    if (n == 0)
+        n = 1;
+    /* Com caudas, o resto que não enche um bloco vai para fatias de um bloco compartilhado. */
+    int f = 0;
+    if (caudasAtivas && tamanho >= 0 && cauda_fatias(tamanho % tamBloco) < FATIAS_CAUDA
+        && (tamanho % tamBloco != 0 || tamanho == 0)) {
+        f = cauda_fatias(tamanho % tamBloco);
+        n = tamanho / tamBloco;
+    }
+    if (fatias != NULL)
+        *fatias = f;
+    return n;
+}
+
+/*
+ * Arquivo novo de 'tamanho' bytes: com 'prealocar', os blocos inteiros vêm
+ * de 'r' (ou do alocador, se 'r' é NULL); sem, são um buraco só. A cauda,
+ * se houver, é alocada já. Devolve NULL se faltou espaço ou memória.
+ */
+Arquivo* criaa_arquivo(long tamanho, int prealocar, Reserva *r) {
+    int fatias;
+    long n = criaa_blocos(tamanho, &fatias);
+    Arquivo* arq = (Arquivo*)pool_alocar(&poolArquivos);
+    if (arq == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        return NULL;
+    }
+
+    if (!prealocar && n > 0 && arquivo_adicionar_extensao(arq, BURACO, n) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        arquivo_liberar(arq);
+        return NULL;
+    }
+    long restantes = prealocar ? n : 0;
+    while (restantes > 0) {
+        long inicio;
+        long obtido = reserva_tirar(r, restantes, &inicio);
+        if (obtido == 0) {
+            printf("Erro: não há mais blocos livres.\n");
+            arquivo_liberar(arq);
+            return NULL;
+        }
+        if (arquivo_adicionar_extensao(arq, inicio, obtido) != 0) {
+            printf("Erro: falha na alocação de memória.\n");
+            liberar_extensao(inicio, obtido);
+            arquivo_liberar(arq);
+            return NULL;
+        }
+        restantes -= obtido;
+    }
+    if (fatias > 0 && cauda_alocar(arq, fatias) != 0) {
+        printf("Erro: não há mais blocos livres.\n");
+        arquivo_liberar(arq);
+        return NULL;
+    }
+    arq->tamanho = tamanho;
+    return arq;
+}
+
+/*
+ * Põe o arquivo 'arq', já com extensões e tamanho, numa entrada nova de
+ * 'atual' (no volume e no índice de nomes também). Os agregados ficam com
+ * quem chama. Se falha, 'arq' é liberado e devolve NULL.
+ */
+Bloco* criaa_ligar(Bloco *atual, const char *nome, Arquivo *arq) {
+    Bloco* novoBloco = (Bloco*)pool_alocar(&poolBlocos);
+    if (novoBloco == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        arquivo_liberar(arq);
+        return NULL;
+    }
+
+    novoBloco->nome = nome_internar(nome);
+    novoBloco->arq = arq;
+    novoBloco->dir = NULL;
+    novoBloco->filho = NULL;
+    arq->attr.criado = time(NULL);
+    arq->attr.posicao = arquivo_posicao(arq);
+    arq->attr.ino = -1;
+    if (novoBloco->nome == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        arquivo_liberar(arq);
+        pool_liberar(&poolBlocos, novoBloco);
+        return NULL;
+    }
+    if (volume_registrar(atual, novoBloco) != 0) {
+        nome_soltar(novoBloco->nome);
+        arquivo_liberar(arq);
+        pool_liberar(&poolBlocos, novoBloco);
+        return NULL;
+    }
+    if (dir_inserir(atual, novoBloco) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        volume_desregistrar(atual, novoBloco);
+        nome_soltar(novoBloco->nome);
+        arquivo_liberar(arq);
+        pool_liberar(&poolBlocos, novoBloco);
+        return NULL;
+    }
+    busca_inserir(atual, novoBloco);
+    return novoBloco;
+}
+
+void removed() {
+    if (argList[1] == NULL) {
+        printf("Erro: nome do diretório não fornecido.\n");
+        return;
+    }
+
+    char *nome;
+    Bloco* atual = resolver_pai(argList[1], &nome, 1);
+    if (atual == NULL)
+        return;
+    removed_em(atual, nome);
+    dir_destravar(atual);
+}
+
+/*
+ * Corpo de removed, com 'atual' já travado para escrita. O alvo também é
+ * travado para escrita: espera quem ainda o atravessa e, com o pai travado,
+ * ninguém mais chega até ele depois que sai do cache.
+ */
+void removed_em(Bloco *atual, char *nome) {
+    Bloco* alvo = dir_buscar(atual, nome, 1);
+    if (alvo == NULL) {
+        printf("Erro: diretório '%s' não encontrado.\n", nome);
+        return;
+    }
+
+    dir_travar(alvo, 1);
+    dir_carregar(alvo);
+    if (alvo->filho != NULL) {
+        dir_destravar(alvo);
+        printf("Erro: diretório '%s' não está vazio.\n", nome);
+        return;
+    }
+
+    /* Se um instantâneo ainda vê o diretório, o bloco e o índice continuam dele. */
+    int compartilhado = alvo->dir->compartilhado > 0;
+    if (!compartilhado)
+        liberar_bloco(alvo->dir->attr.posicao);
+
+    cache_invalidar(argList[1]);
+    dir_destravar(alvo);
+    volume_desregistrar(atual, alvo);
+    dir_remover(atual, alvo);
+    agregados_somar(atual, (Uso){0, 1, 0, 1}, -1);
+    busca_remover(alvo);
+    nome_soltar(alvo->nome);
+    if (compartilhado)
+        alvo->dir->compartilhado--;
+    else
+        dir_destruir(alvo->dir);
+    pool_liberar(&poolBlocos, alvo);
+
+    printf("Diretório '%s' removido com sucesso.\n", nome);
+}
+
+void removea() {
+    if (argList[1] == NULL) {
+        printf("Erro: nome do arquivo não fornecido.\n");
+        return;
+    }
+
+    Bloco *atual;
+    Bloco* alvo = resolver_arquivo(argList[1], 1, &atual);
+    if (alvo == NULL)
+        return;
+
+    volume_desregistrar(atual, alvo);
+    dir_remover(atual, alvo);
+    agregados_somar(atual, (Uso){1, 0, alvo->arq->tamanho, arquivo_blocos(alvo->arq)}, -1);
+    busca_remover(alvo);
+    dir_destravar(atual);
+    arquivo_soltar(alvo->arq);
+    printf("Arquivo '%s' removido com sucesso.\n", alvo->nome);
+    nome_soltar(alvo->nome);
+    pool_liberar(&poolBlocos, alvo);
+}
+
+/*
+ * move <origem> <destino>: religa a entrada (arquivo ou diretório) num
+ * outro diretório e/ou com outro nome, sem tocar nos blocos de dados nem
+ * na subárvore. Como no mv, se 'destino' é um diretório que existe a
+ * entrada vai para dentro dele com o mesmo nome. Roda com o volume
+ * exclusivo, então as travas de diretório só são pegas pelos resolvedores
+ * e soltas em seguida; os dois caminhos são resolvidos para escrita e,
+ * com instantâneos, já saem copiados.
+ */
+void mover() {
+    if (argList[1] == NULL || argList[2] == NULL) {
+        printf("Erro: origem e/ou destino não fornecido.\n");
+        return;
+    }
+
+    char *nome;
+    Bloco *pai = resolver_pai(argList[1], &nome, 1);
+    if (pai == NULL)
+        return;
+    Bloco *alvo = dir_buscar(pai, nome, 1);
+    Bloco *arquivo = dir_buscar(pai, nome, 0);
+    dir_destravar(pai);
+    if (alvo != NULL && arquivo != NULL) {
+        printf("Erro: '%s' é tanto um diretório quanto um arquivo.\n", nome);
+        return;
+    }
+    if (alvo == NULL && (alvo = arquivo) == NULL) {
+        printf("Erro: '%s' não encontrado.\n", nome);
+        return;
+    }
+    int ehDir = alvo->arq == NULL;
+
+    /* Destino vazio é a raiz; um diretório existente recebe a entrada com o nome dela. */
+    char *novoNome = (char*)alvo->nome;
+    Bloco *destino;
+    normalizar_caminho(argList[2]);
+    if (argList[2][0] == '\0') {
+        destino = resolver_dir(argList[2], 1);
+        if (destino == NULL)
+            return;
+        dir_destravar(destino);
+    } else {
+        char *ultimo;
+        destino = resolver_pai(argList[2], &ultimo, 1);
+        if (destino == NULL)
+            return;
+        Bloco *dentro = dir_buscar(destino, ultimo, 1);
+        dir_destravar(destino);
+        if (dentro == NULL) {
+            novoNome = ultimo;
+        } else {
+            if (dentro->dir->compartilhado > 0 && dir_copiar(dentro) != 0)
+                return;
+            dentro->dir->pai = destino;
+            destino = dentro;
+        }
+    }
+    dir_carregar(destino);
+
+    /* Um diretório não pode ir para dentro de si mesmo: sobe de 'destino' até a raiz procurando 'alvo'. */
+    if (ehDir) {
+        for (Bloco *b = destino; b != NULL; b = b->dir->pai) {
+            if (b == alvo) {
+                printf("Erro: não é possível mover o diretório '%s' para dentro dele mesmo.\n", alvo->nome);
+                return;
+            }
+        }
+    }
+    Bloco *existente = dir_buscar(destino, novoNome, ehDir);
+    if (existente == alvo) {
+        printf("Erro: origem e destino são a mesma entrada.\n");
+        return;
+    }
+    if (existente != NULL) {
+        printf(ehDir ? "Erro: diretório '%s' já existe.\n" : "Erro: arquivo '%s' já existe.\n", novoNome);
+        return;
+    }
+
+    /* Tudo o que pode falhar vem antes de a entrada sair do lugar: o nome novo e o espaço no índice do destino. */
+    const char *nomeAntigo = alvo->nome;
+    const char *internado = novoNome == nomeAntigo ? nomeAntigo : nome_internar(novoNome);
+    Diretorio *d = destino->dir;
+    if (internado == NULL || (d->numFilhos >= d->capTabela && dir_crescer(d) != 0)) {
+        printf("Erro: falha na alocação de memória.\n");
+        if (internado != NULL && internado != nomeAntigo)
+            nome_soltar(internado);
+        return;
+    }
+
+    Uso entrada = ehDir ? (Uso){0, 1, 0, 1} : (Uso){1, 0, alvo->arq->tamanho, arquivo_blocos(alvo->arq)};
+    Uso sub = ehDir ? alvo->dir->agregados->total : (Uso){0, 0, 0, 0};
+    agregados_somar(pai, entrada, -1);
+    agregados_subir(pai, sub, -1);
+    dir_remover(pai, alvo);
+    busca_remover(alvo);
+    alvo->nome = internado;
+    dir_ligar(destino, alvo);
+    busca_inserir(destino, alvo);
+    volume_mover(pai, destino, alvo);
+    agregados_somar(destino, entrada, 1);
+    agregados_subir(destino, sub, 1);
+    /* O cache só guarda diretórios: os caminhos abaixo de um diretório movido deixaram de valer. */
+    if (ehDir) {
+        pthread_mutex_lock(&travaCache);
+        cache_limpar();
+        pthread_mutex_unlock(&travaCache);
+    }
+
+    printf(ehDir ? "Diretório '%s' movido com sucesso.\n" : "Arquivo '%s' movido com sucesso.\n", nomeAntigo);
+    if (internado != nomeAntigo)
+        nome_soltar(nomeAntigo);
+}
+
+void verd() {
+    long free_space = __atomic_load_n(&espacosLivres, __ATOMIC_RELAXED) * tamBloco;
+    Bloco* dir = raiz;
+
+    if (argList[1] != NULL) {
+        dir = resolver_dir(argList[1], 0);
+        if (dir == NULL)
+            return;
+    } else {
+        dir_travar(dir, 0);
+    }
+
+    dir_carregar(dir);
+    Bloco* atual = dir->filho;
+    if (atual == NULL) {
+        printf("Nenhum arquivo ou diretório encontrado.\n");
+    } else {
+        char data[20];
+        long logicos = 0, folga = 0, comCauda = 0, esparsos = 0, bytesLogicos = 0, bytesAlocados = 0;
+        double fisicos = 0;
+        if (refsBlocos != NULL)
+            pthread_mutex_lock(&travaDedup);
+        while (atual != NULL) {
+            formatar_data(atributos(atual)->criado, data);
+            if (atual->arq == NULL)
+                printf("%s    <DIR>    %s\n", data, atual->nome);
+            else
+                printf("%s    %ld    %s\n", data, atual->arq->tamanho, atual->nome);
+            if (refsBlocos != NULL && atual->arq != NULL) {
+                logicos += arquivo_blocos(atual->arq);
+                fisicos += arquivo_fisicos(atual->arq);
+            }
+            if (atual->arq != NULL && atual->arq->caudaFatias > 0) {
+                folga += cauda_folga(atual->arq);
+                comCauda++;
+            }
+            if (atual->arq != NULL) {
+                bytesLogicos += atual->arq->tamanho;
+                bytesAlocados += arquivo_bytes_alocados(atual->arq);
+                if (arquivo_blocos(atual->arq) < arquivo_blocos_logicos(atual->arq))
+                    esparsos++;
+            }
+            atual = atual->prox;
+        }
+        if (refsBlocos != NULL)
+            pthread_mutex_unlock(&travaDedup);
+        Uso *u = &dir->dir->agregados->direto;
+        printf("\n%ld arquivo(s)     %ld bytes ocupados\n", (long)__atomic_load_n(&u->arquivos, __ATOMIC_RELAXED),
+               (long)__atomic_load_n(&u->bytes, __ATOMIC_RELAXED));
+        printf("%ld diretório(s)   %ld bytes disponíveis\n", (long)__atomic_load_n(&u->diretorios, __ATOMIC_RELAXED),
+               free_space);
+        if (refsBlocos != NULL)
+            printf("Blocos dos arquivos: %ld lógico(s), %.1f físico(s)\n", logicos, fisicos);
+        if (comCauda > 0)
+            printf("Caudas: %ld arquivo(s), %ld bytes de folga economizados\n", comCauda, folga);
+        if (esparsos > 0)
+            printf("Tamanho dos arquivos: %ld bytes lógicos, %ld bytes alocados (%ld esparso(s))\n", bytesLogicos,
+                   bytesAlocados, esparsos);
+    }
+    dir_destravar(dir);
+}
+
+/* Uso do diretório e da subárvore, lido dos agregados: não percorre nada além do caminho. */
+void du() {
+    Bloco *dir = raiz;
+    if (argList[1] != NULL) {
+        dir = resolver_dir(argList[1], 0);
+        if (dir == NULL)
+            return;
+    } else {
+        dir_travar(dir, 0);
+    }
+    Agregados *a = dir->dir->agregados;
+    Uso *usos[2] = {&a->direto, &a->total};
+    const char *rotulos[2] = {"Direto", "Total"};
+    for (int i = 0; i < 2; i++) {
+        Uso *u = usos[i];
+        printf("%-7s %ld arquivo(s), %ld diretório(s), %ld bytes, %ld bloco(s)\n", rotulos[i],
+               (long)__atomic_load_n(&u->arquivos, __ATOMIC_RELAXED),
+               (long)__atomic_load_n(&u->diretorios, __ATOMIC_RELAXED),
+               (long)__atomic_load_n(&u->bytes, __ATOMIC_RELAXED),
+               (long)__atomic_load_n(&u->blocos, __ATOMIC_RELAXED));
+    }
+    dir_destravar(dir);
+}
+
+void verset() {
+    if (argList[1] == NULL) {
+        printf("Erro: nome do arquivo não fornecido.\n");
+        return;
+    }
+
+    Bloco *atual;
+    Bloco* alvo = resolver_arquivo(argList[1], 0, &atual);
+    if (alvo == NULL)
+        return;
+
+    printf("Setores ocupados pelo arquivo '%s': ", alvo->nome);
+    Arquivo* arq = alvo->arq;
+    for (int j = 0; j < arq->numExt; j++) {
+        Extensao* e = &arq->ext[j];
+        if (e->inicio == BURACO)
+            printf("(buraco de %ld) ", e->tamanho);
+        else if (e->tamanho == 1)
+            printf("%ld ", e->inicio);
+        else
+            printf("%ld-%ld ", e->inicio, e->inicio + e->tamanho - 1);
+    }
+    if (arq->caudaFatias > 0)
+        printf("%ld(fatias %d-%d) ", arq->cauda, arq->caudaFatia, arq->caudaFatia + arq->caudaFatias - 1);
+    printf("\n");
+    printf("Tamanho lógico: %ld bytes, alocado: %ld bytes\n", arq->tamanho, arquivo_bytes_alocados(arq));
+    dir_destravar(atual);
+}
+
+/*
+ * Fragmentação. 'frag' percorre a árvore e o bitmap e mostra quantas
+ * extensões os arquivos têm e como o espaço livre está picado. 'defrag'
+ * move arquivos fragmentados, um de cada vez e inteiros, para a primeira
+ * sequência livre que os comporte, e pára quando o orçamento de blocos da
+ * chamada acaba; um arquivo maior que o que resta do orçamento volta para
+ * o fim da fila sem ser movido. Pode ser intercalado com os outros comandos
+ * e retomado, porque a lista de arquivos fragmentados é mantida a cada
+ * alocação.
+ */
+void frag() {
+    long arquivos = 0, extensoes = 0, fragmentados = 0;
+    Percurso p;
+    if (percurso_iniciar(&p, raiz, -1) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        return;
+    }
+    for (Bloco *b; (b = percurso_proximo(&p, NULL)) != NULL;) {
+        if (b->arq == NULL)
+            continue;
+        arquivos++;
+        for (int j = 0; j < b->arq->numExt; j++)
+            extensoes += b->arq->ext[j].inicio != BURACO;
+        fragmentados += b->arq->fragmentado;
+    }
+    percurso_encerrar(&p);
+
+    long histograma[64] = {0};
+    long livres = 0, corridas = 0, maior = 0, maxHist = 0;
+    int ultimaClasse = 0;
+    long inicio, n;
+    for (long de = 0; (n = corrida_livre(de, totalBlocos, &inicio)) > 0; de = inicio + n) {
+        int c = 63 - __builtin_clzll((uint64_t)n);
+        histograma[c]++;
+        livres += n;
+        corridas++;
+        if (n > maior)
+            maior = n;
+        if (histograma[c] > maxHist)
+            maxHist = histograma[c];
+        if (c > ultimaClasse)
+            ultimaClasse = c;
+    }
+
+    printf("Arquivos: %ld, extensões: %ld (%.2f por arquivo), fragmentados: %ld\n", arquivos, extensoes,
+           arquivos ? (double)extensoes / arquivos : 0.0, fragmentados);
+    printf("Espaço livre: %ld bloco(s) em %ld extensão(ões); maior extensão livre: %ld bloco(s)\n",
+           livres, corridas, maior);
+    printf("Fragmentação do espaço livre: %.1f%%\n", livres ? 100.0 * (1.0 - (double)maior / livres) : 0.0);
+    if (corridas == 0)
+        return;
+    printf("Extensões livres por tamanho (blocos):\n");
+    for (int c = 0; c <= ultimaClasse; c++) {
+        long de = 1L << c, ate = (2L << c) - 1;
+        int barra = (int)((histograma[c] * 40 + maxHist - 1) / maxHist);
+        printf("  %7ld-%-7ld %8ld ", de, ate, histograma[c]);
+        for (int i = 0; i < barra; i++)
+            printf("#");
+        printf("\n");
+    }
+}
+
+/*
+ * Copia os blocos com dados de 'arq' para a sequência livre que começa em
+ * 'inicio' e tem arquivo_blocos(arq) blocos, troca as extensões pela nova
+ * (no inode também) e libera as antigas. Os buracos
+ * ficam onde estão: os trechos com blocos vão em sequência para a nova
+ * extensão, e o arquivo deixa de contar como fragmentado.
+ */
+int defrag_mover(Arquivo *arq, long inicio) {
+    Extensao *velhas = (Extensao*)malloc(arq->numExt * sizeof(Extensao));
+    if (velhas == NULL)
+        return -1;
+    int numVelhas = arq->numExt;
+    memcpy(velhas, arq->ext, numVelhas * sizeof(Extensao));
+
+    /* Só os blocos até escritoAte têm dados; os outros são lidos como zero de qualquer forma. */
+    long usados = (arq->escritoAte + tamBloco - 1) / tamBloco;
+    unsigned char dados[TAM_BLOCO_MAX];
+    long k = 0, destino = inicio;
+    pthread_mutex_lock(&travaBuffers);
+    for (int j = 0; j < numVelhas && k < usados; j++) {
+        if (velhas[j].inicio == BURACO) {
+            k += velhas[j].tamanho;
+            continue;
+        }
+        for (long i = 0; i < velhas[j].tamanho && k < usados; i++, k++) {
+            memcpy(dados, buf_obter(velhas[j].inicio + i, 1)->dados, tamBloco);
+            Buffer *b = buf_obter(destino + i, 0);
+            memcpy(b->dados, dados, tamBloco);
+            b->sujo = 1;
+        }
+        destino += velhas[j].tamanho;
+    }
+    pthread_mutex_unlock(&travaBuffers);
+
+    arq->numExt = 0;
+    destino = inicio;
+    for (int j = 0; j < numVelhas; j++) {
+        arquivo_adicionar_extensao(arq, velhas[j].inicio == BURACO ? BURACO : destino, velhas[j].tamanho);
+        if (velhas[j].inicio != BURACO)
+            destino += velhas[j].tamanho;
+    }
+    arq->attr.posicao = inicio;
+    if (mapaVolume != NULL && arq->attr.ino >= 0) {
+        InodeDisco *nd = &inodes[arq->attr.ino];
+        inode_liberar_indiretos(nd);
+        inode_gravar_extensoes(nd, arq);
+        nd->posicao = inicio;
+        diario_sujar(nd, sizeof(InodeDisco));
+    }
+    for (int j = 0; j < numVelhas; j++)
+        if (velhas[j].inicio != BURACO)
+            liberar_extensao(velhas[j].inicio, velhas[j].tamanho);
+    free(velhas);
+    return 0;
+}
+
+void defrag() {
+    long orcamento = ORCAMENTO_DEFRAG;
+    if (argList[1] != NULL && (orcamento = atol(argList[1])) <= 0) {
+        printf("Erro: uso: defrag [orcamento_em_blocos]\n");
+        return;
+    }
+    /* Arquivos de diretórios ainda não carregados não estão na lista; o percurso carrega todos. */
+    Percurso p;
+    if (percurso_iniciar(&p, raiz, -1) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        return;
+    }
+    while (percurso_proximo(&p, NULL) != NULL)
+        ;
+    percurso_encerrar(&p);
+
+    int verbosoOriginal = verboso;
+    verboso = 0;
+    long movidos = 0, arquivos = 0, semEspaco = 0, deduplicados = 0, grandes = 0;
+    long pendentes = numFragmentados;
+    for (long visitados = 0; visitados < pendentes && movidos < orcamento; visitados++) {
+        Arquivo *arq = fragInicio;
+        frag_desligar(arq);
+        /* Mover um arquivo com blocos compartilhados (dedup ou instantâneos) desfaria o compartilhamento. */
+        if (refsBlocos != NULL && arquivo_compartilha_blocos(arq)) {
+            frag_ligar(arq);
+            deduplicados++;
+            continue;
+        }
+        long n = arquivo_blocos(arq);
+        /* O arquivo é movido inteiro; se não cabe no que resta do orçamento, fica para outra chamada. */
+        if (n > orcamento - movidos) {
+            frag_ligar(arq);
+            grandes++;
+            continue;
+        }
+        long inicio = alocar_contiguo(n);
+        if (inicio < 0 || defrag_mover(arq, inicio) != 0) {
+            if (inicio >= 0)
+                liberar_extensao(inicio, n);
+            /* Volta para o fim da fila; outra chamada tenta de novo quando houver espaço. */
+            frag_ligar(arq);
+            semEspaco++;
+            continue;
+        }
+        movidos += n;
+        arquivos++;
+    }
+    verboso = verbosoOriginal;
+    /* Com diário, os dados copiados têm de estar na imagem antes de a transação que os aponta ser confirmada. */
+    if (diarioAtivo && movidos > 0) {
+        buf_sincronizar();
+        fdatasync(fdVolume);
+    }
+    printf("%ld arquivo(s) desfragmentado(s), %ld bloco(s) movido(s); %ld arquivo(s) ainda fragmentado(s)",
+           arquivos, movidos, numFragmentados);
+    if (semEspaco > 0)
+        printf(", %ld sem espaço contíguo", semEspaco);
+    if (deduplicados > 0)
+        printf(", %ld com blocos compartilhados", deduplicados);
+    if (grandes > 0)
+        printf(", %ld maior(es) que o orçamento restante", grandes);
+    printf(".\n");
+}
+
+/* Soma [inicio, inicio + n) ao total e guarda a faixa, emendada na anterior se for contígua, enquanto houver espaço. */
+void faixas_somar(Faixas *f, long inicio, long n) {
+    f->total += n;
+    if (f->num > 0 && f->faixa[f->num - 1].inicio + f->faixa[f->num - 1].tamanho == inicio)
+        f->faixa[f->num - 1].tamanho += n;
+    else if (f->num < MAX_FAIXAS_VERIFICA)
+        f->faixa[f->num++] = (Extensao){inicio, n};
+}
+
+/* faixas_somar para cada sequência de bits ligados em 'm', a palavra 'w' de um bitmap de blocos. */
+void faixas_mascara(Faixas *f, long w, uint64_t m) {
+    while (m != 0) {
+        int b = __builtin_ctzll(m);
+        uint64_t resto = m >> b;
+        int n = ~resto == 0 ? 64 : __builtin_ctzll(~resto);
+        faixas_somar(f, w * 64 + b, n);
+        m &= ~mascara_bits(b, n);
+    }
+}
+
+void faixas_imprimir(const char *rotulo, Faixas *f) {
+    if (f->total == 0)
+        return;
+    long mostrados = 0;
+    printf("%s: %ld bloco(s):", rotulo, f->total);
+    for (int i = 0; i < f->num; i++) {
+        Extensao *e = &f->faixa[i];
+        if (e->tamanho == 1)
+            printf(" %ld", e->inicio);
+        else
+            printf(" %ld-%ld", e->inicio, e->inicio + e->tamanho - 1);
+        mostrados += e->tamanho;
+    }
+    printf(mostrados < f->total ? " ...\n" : "\n");
+}
+
+/* Um objeto compartilhado por instantâneos é alcançado por mais de uma entrada: devolve 1 só na primeira vez. */
+int verifica_primeira_vez(Verificacao *v, void *obj) {
+    pthread_mutex_lock(&v->trava);
+    if ((v->numCompartilhados + 1) * 2 > v->capCompartilhados) {
+        long cap = v->capCompartilhados ? v->capCompartilhados * 2 : 1024;
+        void **t = (void**)calloc(cap, sizeof(void*));
+        if (t == NULL) {
+            v->erro = 1;
+            pthread_mutex_unlock(&v->trava);
+            return 0;
+        }
+        for (long i = 0; i < v->capCompartilhados; i++) {
+            if (v->compartilhados[i] == NULL)
+                continue;
+            long k = hash_ponteiro(v->compartilhados[i]) & (cap - 1);
+            while (t[k] != NULL)
+                k = (k + 1) & (cap - 1);
+            t[k] = v->compartilhados[i];
+        }
+        free(v->compartilhados);
+        v->compartilhados = t;
+        v->capCompartilhados = cap;
+    }
+    long k = hash_ponteiro(obj) & (v->capCompartilhados - 1);
+    while (v->compartilhados[k] != NULL && v->compartilhados[k] != obj)
+        k = (k + 1) & (v->capCompartilhados - 1);
+    int primeira = v->compartilhados[k] == NULL;
+    if (primeira) {
+        v->compartilhados[k] = obj;
+        v->numCompartilhados++;
+    }
+    pthread_mutex_unlock(&v->trava);
+    return primeira;
+}
+
+/*
+ * Marca [inicio, inicio + n) como usados por 'dono'. Um bloco que já
+ * estava marcado vai para 'repetidos'; uma extensão fora da área de dados
+ * só é anotada.
+ */
+void verifica_marcar(Verificacao *v, long inicio, long n, const char *dono) {
+    if (n <= 0 || inicio < blocosReservados || inicio + n > totalBlocos) {
+        pthread_mutex_lock(&v->trava);
+        if (v->foraDoDisco.total == 0)
+            snprintf(v->exemploFora, sizeof(v->exemploFora), "%s", dono);
+        faixas_somar(&v->foraDoDisco, inicio, n > 0 ? n : 1);
+        pthread_mutex_unlock(&v->trava);
+        return;
+    }
+    for (long i = inicio, fim = inicio + n; i < fim;) {
+        long w = i >> 6;
+        int b = i & 63;
+        int k = (fim - i < 64 - b) ? (int)(fim - i) : 64 - b;
+        uint64_t m = mascara_bits(b, k);
+        uint64_t antes = __atomic_fetch_or(&v->vistos[w], m, __ATOMIC_RELAXED);
+        if (antes & m)
+            __atomic_fetch_or(&v->repetidos[w], antes & m, __ATOMIC_RELAXED);
+        i += k;
+    }
+    if (v->donos != NULL)
+        for (long i = inicio; i < inicio + n; i++)
+            __atomic_fetch_add(&v->donos[i], 1, __ATOMIC_RELAXED);
+}
+
+/* Marca as fatias da cauda; o bloco de caudas entra no bitmap esperado uma vez, pela primeira delas. */
+void verifica_marcar_cauda(Verificacao *v, Arquivo *arq, const char *dono) {
+    long p = arq->cauda;
+    if (p < blocosReservados || p >= totalBlocos) {
+        verifica_marcar(v, p, 1, dono);
+        return;
+    }
+    uint64_t m = mascara_bits(arq->caudaFatia, arq->caudaFatias);
+    uint64_t antes = __atomic_fetch_or(&v->fatias[p], m, __ATOMIC_RELAXED);
+    if (antes & m)
+        __atomic_fetch_add(&v->sobrepostas, 1, __ATOMIC_RELAXED);
+    if (antes == 0) {
+        __atomic_fetch_add(&v->blocosCauda, 1, __ATOMIC_RELAXED);
+        verifica_marcar(v, p, 1, dono);
+    }
+}
+
+/* Marca as extensões e a cauda do arquivo e, no volume, os blocos da cadeia de extensões do inode. */
+void verifica_arquivo(Verificacao *v, Bloco *b) {
+    Arquivo *arq = b->arq;
+    for (int j = 0; j < arq->numExt; j++)
+        if (arq->ext[j].inicio != BURACO)
+            verifica_marcar(v, arq->ext[j].inicio, arq->ext[j].tamanho, b->nome);
+    if (arq->caudaFatias > 0)
+        verifica_marcar_cauda(v, arq, b->nome);
+    if (mapaVolume == NULL || arq->attr.ino < 0)
+        return;
+    int64_t ind = inodes[arq->attr.ino].extIndireto;
+    for (int passos = 0; ind >= 0 && passos <= arq->numExt / EXT_POR_BLOCO + 1; passos++) {
+        verifica_marcar(v, ind, 1, b->nome);
+        if (ind < blocosReservados || ind >= totalBlocos)
+            break;
+        ind = ((BlocoExtensoes*)(mapaVolume + ind * tamBloco))->prox;
+    }
+}
+
+/*
+ * No reparo, 'vistos' guarda os blocos já reclamados por alguma entrada.
+ * Devolve 1 se 'p' não pode ser de quem pede: fora da área de dados, livre
+ * no bitmap (só sobra assim a parte boa de uma extensão que saía do
+ * disco), bloco de caudas, ou já reclamado (com dedup um bloco de dados
+ * pode ser dividido, e as contagens de referência são refeitas a partir
+ * de 'donos').
+ */
+int verifica_reclamar(Verificacao *v, long p, int podeDividir) {
+    if (p < blocosReservados || p >= totalBlocos || bloco_livre(p) || v->fatias[p] != 0)
+        return 1;
+    uint64_t bit = (uint64_t)1 << (p & 63);
+    if ((v->vistos[p >> 6] & bit) && !(podeDividir && v->donos != NULL))
+        return 1;
+    v->vistos[p >> 6] |= bit;
+    if (v->donos != NULL)
+        v->donos[p]++;
+    return 0;
+}
+
+/* verifica_reclamar para as fatias da cauda de 'arq': o bloco pode ter outras caudas, mas não outro tipo de dono. */
+int verifica_reclamar_cauda(Verificacao *v, Arquivo *arq) {
+    long p = arq->cauda;
+    uint64_t m = mascara_bits(arq->caudaFatia, arq->caudaFatias);
+    if (p < blocosReservados || p >= totalBlocos || bloco_livre(p) || (v->fatias[p] & m))
+        return 1;
+    if (v->fatias[p] == 0) {
+        uint64_t bit = (uint64_t)1 << (p & 63);
+        if (v->vistos[p >> 6] & bit)
+            return 1;
+        v->vistos[p >> 6] |= bit;
+        if (v->donos != NULL)
+            v->donos[p]++;
+        v->blocosCauda++;
+    }
+    v->fatias[p] |= m;
+    return 0;
+}
+
+/*
+ * Cada bloco do arquivo que não pode ser dele ganha um substituto, com os
+ * dados do original se ele está no disco ou zeros se não; a cauda, do
+ * mesmo jeito, ganha fatias novas. No volume, a cadeia de extensões do
+ * inode é regravada se algo mudou ou ela tem um elo ruim; a velha fica sem
+ * dono e sai com os vazados.
+ */
+void verifica_reparar_arquivo(Verificacao *v, Bloco *b) {
+    Arquivo *arq = b->arq;
+    long *refazer = NULL;
+    long numRefazer = 0, cap = 0, k = 0;
+    for (int j = 0; j < arq->numExt; j++) {
+        if (arq->ext[j].inicio == BURACO) {
+            k += arq->ext[j].tamanho;
+            continue;
+        }
+        for (long i = 0; i < arq->ext[j].tamanho; i++, k++) {
+            if (!verifica_reclamar(v, arq->ext[j].inicio + i, 1))
+                continue;
+            if (numRefazer == cap) {
+                cap = cap ? cap * 2 : 16;
+                long *maior = (long*)realloc(refazer, cap * sizeof(long));
+                if (maior == NULL) {
+                    free(refazer);
+                    v->erro = 1;
+                    return;
+                }
+                refazer = maior;
+            }
+            refazer[numRefazer++] = k;
+        }
+    }
+    unsigned char dados[TAM_BLOCO_MAX];
+    for (long r = 0; r < numRefazer; r++) {
+        long velho = arquivo_bloco_fisico(arq, refazer[r]);
+        long novo = alocar_bloco();
+        if (novo < 0) {
+            v->erro = 1;
+            break;
+        }
+        pthread_mutex_lock(&travaBuffers);
+        if (velho >= blocosReservados && velho < totalBlocos)
+            memcpy(dados, buf_obter(velho, 1)->dados, tamBloco);
+        else
+            memset(dados, 0, tamBloco);
+        Buffer *destino = buf_obter(novo, 0);
+        memcpy(destino->dados, dados, tamBloco);
+        destino->sujo = 1;
+        pthread_mutex_unlock(&travaBuffers);
+        if (arquivo_remapear(arq, refazer[r], novo) != 0) {
+            liberar_bloco(novo);
+            v->erro = 1;
+            break;
+        }
+        verifica_reclamar(v, novo, 0);
+        v->realocados++;
+    }
+    free(refazer);
+    int novaCauda = 0;
+    if (arq->caudaFatias > 0 && !v->erro && verifica_reclamar_cauda(v, arq)) {
+        int fatias = arq->caudaFatias;
+        long bytes = fatias * (tamBloco / FATIAS_CAUDA);
+        cauda_transferir(arq, 0, dados, bytes, 0);
+        arq->caudaFatias = 0;
+        if (cauda_alocar(arq, fatias) != 0) {
+            v->erro = 1;
+            return;
+        }
+        cauda_transferir(arq, 0, dados, bytes, 1);
+        verifica_reclamar_cauda(v, arq);
+        arq->attr.posicao = arquivo_posicao(arq);
+        v->realocados++;
+        novaCauda = 1;
+    }
+    if (mapaVolume == NULL || arq->attr.ino < 0)
+        return;
+
+    InodeDisco *nd = &inodes[arq->attr.ino];
+    int regravar = numRefazer > 0 || novaCauda;
+    int64_t ind = nd->extIndireto;
+    for (int passos = 0; ind >= 0 && !regravar; passos++) {
+        if (ind < blocosReservados || ind >= totalBlocos || (v->vistos[ind >> 6] >> (ind & 63) & 1)
+            || passos > arq->numExt / EXT_POR_BLOCO + 1)
+            regravar = 1;
+        else
+            ind = ((BlocoExtensoes*)(mapaVolume + ind * tamBloco))->prox;
+    }
+    if (regravar) {
+        nd->extIndireto = -1;
+        if (inode_gravar_extensoes(nd, arq) != 0)
+            v->erro = 1;
+        nd->posicao = arq->attr.posicao;
+        diario_sujar(nd, sizeof(InodeDisco));
+    }
+    for (ind = nd->extIndireto; ind >= 0; ind = ((BlocoExtensoes*)(mapaVolume + ind * tamBloco))->prox)
+        verifica_reclamar(v, ind, 0);
+}
+
+/* O bloco de um diretório não pode ser dividido: se já tem dono ou está fora do disco, o diretório ganha outro. */
+void verifica_reparar_dir(Verificacao *v, Bloco *b) {
+    if (!verifica_reclamar(v, b->dir->attr.posicao, 0))
+        return;
+    long novo = alocar_bloco();
+    if (novo < 0) {
+        v->erro = 1;
+        return;
+    }
+    verifica_reclamar(v, novo, 0);
+    b->dir->attr.posicao = novo;
+    if (mapaVolume != NULL && b->dir->attr.ino >= 0) {
+        inodes[b->dir->attr.ino].posicao = novo;
+        diario_sujar(&inodes[b->dir->attr.ino], sizeof(InodeDisco));
+    }
+    v->realocados++;
+}
+
+/*
+ * Trabalhador da verificação: tira um diretório da pilha, trata os filhos
+ * e devolve os subdiretórios à pilha de uma vez. Termina quando a pilha
+ * está vazia e nenhum outro trabalhador tem um diretório em mãos (que
+ * ainda poderia empilhar mais).
+ */
+void* verifica_trabalhar(void *arg) {
+    Verificacao *v = (Verificacao*)arg;
+    Bloco **novos = NULL;
+    long numNovos, capNovos = 0, dirs = 0, arqs = 0, exts = 0;
+    pthread_mutex_lock(&v->trava);
+    for (;;) {
+        while (v->topo == 0 && v->ativos > 0)
+            pthread_cond_wait(&v->temTrabalho, &v->trava);
+        if (v->topo == 0)
+            break;
+        Bloco *d = v->pilha[--v->topo];
+        v->ativos++;
+        pthread_mutex_unlock(&v->trava);
+
+        dir_carregar(d);
+        numNovos = 0;
+        for (Bloco *c = d->filho; c != NULL; c = c->prox) {
+            int compartilhado = c->arq != NULL ? c->arq->compartilhado : c->dir->compartilhado;
+            if (compartilhado > 0 && !verifica_primeira_vez(v, c->arq != NULL ? (void*)c->arq : (void*)c->dir))
+                continue;
+            if (c->arq != NULL) {
+                arqs++;
+                exts += c->arq->numExt;
+                if (v->reparando)
+                    verifica_reparar_arquivo(v, c);
+                else
+                    verifica_arquivo(v, c);
+                continue;
+            }
+            dirs++;
+            if (v->reparando)
+                verifica_reparar_dir(v, c);
+            else
+                verifica_marcar(v, c->dir->attr.posicao, 1, c->nome);
+            if (numNovos == capNovos) {
+                long cap = capNovos ? capNovos * 2 : 64;
+                Bloco **maior = (Bloco**)realloc(novos, cap * sizeof(Bloco*));
+                if (maior == NULL) {
+                    v->erro = 1;
+                    break;
+                }
+                novos = maior;
+                capNovos = cap;
+            }
+            novos[numNovos++] = c;
+        }
+
+        pthread_mutex_lock(&v->trava);
+        if (v->topo + numNovos > v->capPilha) {
+            long cap = v->capPilha * 2 > v->topo + numNovos ? v->capPilha * 2 : v->topo + numNovos;
+            Bloco **maior = (Bloco**)realloc(v->pilha, cap * sizeof(Bloco*));
+            if (maior == NULL) {
+                v->erro = 1;
+                numNovos = 0;
+            } else {
+                v->pilha = maior;
+                v->capPilha = cap;
+            }
+        }
+        if (numNovos > 0)
+            memcpy(v->pilha + v->topo, novos, numNovos * sizeof(Bloco*));
+        v->topo += numNovos;
+        v->ativos--;
+        if (numNovos > 0 || v->ativos == 0)
+            pthread_cond_broadcast(&v->temTrabalho);
+    }
+    v->diretorios += dirs;
+    v->arquivos += arqs;
+    v->extensoes += exts;
+    pthread_mutex_unlock(&v->trava);
+    free(novos);
+    return NULL;
+}
+
+/* Percorre a árvore atual e a de cada instantâneo com 'threads' trabalhadores. As raízes não têm bloco de dados. */
+int verifica_percorrer(Verificacao *v, int threads) {
+    v->topo = 0;
+    v->ativos = 0;
+    v->capPilha = 64;
+    v->pilha = (Bloco**)malloc(v->capPilha * sizeof(Bloco*));
+    if (v->pilha == NULL)
+        return -1;
+    v->pilha[v->topo++] = raiz;
+    if (raiz->dir->compartilhado > 0)
+        verifica_primeira_vez(v, raiz->dir);
+    for (Instantaneo *i = instantaneos; i != NULL && v->topo < v->capPilha; i = i->prox)
+        if (i->raiz->dir->compartilhado == 0 || verifica_primeira_vez(v, i->raiz->dir))
+            v->pilha[v->topo++] = i->raiz;
+
+    pthread_t *ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    int criadas = 0;
+    if (ids != NULL)
+        while (criadas < threads - 1 && pthread_create(&ids[criadas], NULL, verifica_trabalhar, v) == 0)
+            criadas++;
+    verifica_trabalhar(v);
+    for (int i = 0; i < criadas; i++)
+        pthread_join(ids[i], NULL);
+    free(ids);
+    free(v->pilha);
+    v->pilha = NULL;
+    return v->erro ? -1 : 0;
+}
+
+/*
+ * Compara o bitmap esperado com blocosLivres palavra a palavra e, com
+ * 'mostrar', imprime cada tipo de problema. Devolve quantos problemas há;
+ * os blocos ocupados sem dono e os em uso marcados como livres ficam em
+ * *vazados e *perdidos.
+ */
+long verifica_comparar(Verificacao *v, int mostrar, Faixas *vazados, Faixas *perdidos) {
+    Faixas repetidos, invalidos;
+    memset(vazados, 0, sizeof(Faixas));
+    memset(perdidos, 0, sizeof(Faixas));
+    memset(&repetidos, 0, sizeof(Faixas));
+    memset(&invalidos, 0, sizeof(Faixas));
+    long livres = 0, foraResumo = 0, refsErradas = 0;
+    for (long w = 0; w < numPalavras; w++) {
+        long base = w * 64;
+        uint64_t valido = base + 64 > totalBlocos ? mascara_bits(0, (int)(totalBlocos - base)) : ~(uint64_t)0;
+        if (blocosReservados - base >= 64)
+            valido = 0;
+        else if (blocosReservados > base)
+            valido &= ~mascara_bits(0, (int)(blocosReservados - base));
+        uint64_t livre = blocosLivres[w];
+        livres += __builtin_popcountll(livre);
+        if (livre != 0 && !((resumoLivres[w >> 6] >> (w & 63)) & 1))
+            foraResumo++;
+        faixas_mascara(&invalidos, w, livre & ~valido);
+        faixas_mascara(vazados, w, ~livre & valido & ~v->vistos[w]);
+        faixas_mascara(perdidos, w, livre & v->vistos[w]);
+        if (v->donos == NULL)
+            faixas_mascara(&repetidos, w, v->repetidos[w]);
+    }
+    /* Com dedup, dividir blocos é permitido; o que tem de bater é a contagem de referências. */
+    if (v->donos != NULL)
+        for (long i = blocosReservados; i < totalBlocos; i++)
+            if (refsBlocos[i] != (v->donos[i] ? v->donos[i] - 1 : 0))
+                refsErradas++;
+    /* A máscara na fatia 0 de cada bloco de caudas tem de ser exatamente as fatias usadas. */
+    long mascarasErradas = 0;
+    pthread_mutex_lock(&travaBuffers);
+    for (long i = blocosReservados, vistas = 0; i < totalBlocos && vistas < v->blocosCauda; i++) {
+        if (v->fatias[i] == 0)
+            continue;
+        uint64_t ocupadas;
+        memcpy(&ocupadas, buf_obter(i, 1)->dados, sizeof(ocupadas));
+        mascarasErradas += ocupadas != (v->fatias[i] | 1);
+        vistas++;
+    }
+    pthread_mutex_unlock(&travaBuffers);
+
+    long problemas = vazados->total + perdidos->total + repetidos.total + invalidos.total + v->foraDoDisco.total
+                     + foraResumo + refsErradas + (livres != espacosLivres) + v->sobrepostas + mascarasErradas;
+    if (!mostrar)
+        return problemas;
+    faixas_imprimir("Blocos ocupados sem dono", vazados);
+    faixas_imprimir("Blocos em uso marcados como livres", perdidos);
+    faixas_imprimir("Blocos com mais de um dono", &repetidos);
+    faixas_imprimir("Blocos reservados ou além do disco marcados como livres", &invalidos);
+    if (v->foraDoDisco.total > 0) {
+        faixas_imprimir("Extensões fora da área de dados", &v->foraDoDisco);
+        printf("  (a primeira em '%s')\n", v->exemploFora);
+    }
+    if (refsErradas > 0)
+        printf("Contagem de referências do dedup errada em %ld bloco(s)\n", refsErradas);
+    if (v->sobrepostas > 0)
+        printf("Caudas que dividem fatias com outra: %ld\n", v->sobrepostas);
+    if (mascarasErradas > 0)
+        printf("Blocos de caudas com a máscara de fatias errada: %ld\n", mascarasErradas);
+    if (foraResumo > 0)
+        printf("Palavras do bitmap com blocos livres fora do resumo: %ld\n", foraResumo);
+    if (livres != espacosLivres)
+        printf("Contador de livres: %ld, bitmap: %ld\n", espacosLivres, livres);
+    return problemas;
+}
+
+/* Refaz espacosLivres e o resumo a partir do bitmap. */
+void verifica_recontar() {
+    long livres = 0;
+    memset(resumoLivres, 0, numResumo * sizeof(uint64_t));
+    for (long w = 0; w < numPalavras; w++) {
+        livres += __builtin_popcountll(blocosLivres[w]);
+        if (blocosLivres[w] != 0)
+            resumoLivres[w >> 6] |= (uint64_t)1 << (w & 63);
+    }
+    diario_sujar(resumoLivres, numResumo * sizeof(uint64_t));
+    espacosLivres = livres;
+    dicaResumo = 0;
+}
+
+/*
+ * Reparo, com o volume exclusivo e numa thread só:
+ *   1. blocos com dono e reservados marcados como livres são ocupados, e a
+ *      política refaz o estado dela a partir do bitmap;
+ *   2. um novo percurso reclama os blocos de cada entrada, e quem chega a
+ *      um bloco já reclamado ou fora do disco ganha um novo;
+ *   3. os ocupados que ninguém reclamou voltam ao bitmap;
+ *   4. com dedup, as contagens de referência passam a ser as reclamações.
+ */
+void verifica_reparar(Verificacao *v) {
+    for (long w = 0; w < numPalavras; w++) {
+        long base = w * 64;
+        uint64_t valido = base + 64 > totalBlocos ? mascara_bits(0, (int)(totalBlocos - base)) : ~(uint64_t)0;
+        if (blocosReservados - base >= 64)
+            valido = 0;
+        else if (blocosReservados > base)
+            valido &= ~mascara_bits(0, (int)(blocosReservados - base));
+        uint64_t ocupar = blocosLivres[w] & (v->vistos[w] | ~valido);
+        if (ocupar != 0) {
+            blocosLivres[w] &= ~ocupar;
+            diario_sujar(&blocosLivres[w], sizeof(uint64_t));
+        }
+    }
+    verifica_recontar();
+    politica_trocar(politica);
+
+    memset(v->vistos, 0, numPalavras * sizeof(uint64_t));
+    if (v->donos != NULL)
+        memset(v->donos, 0, totalBlocos * sizeof(uint32_t));
+    memset(v->fatias, 0, totalBlocos * sizeof(uint64_t));
+    v->blocosCauda = v->sobrepostas = 0;
+    free(v->compartilhados);
+    v->compartilhados = NULL;
+    v->capCompartilhados = v->numCompartilhados = 0;
+    /* Caudas refeitas vão para blocos novos, não para os abertos, que podem estar entre os estragados. */
+    pthread_mutex_lock(&travaCaudas);
+    numCaudasAbertas = 0;
+    pthread_mutex_unlock(&travaCaudas);
+    v->reparando = 1;
+    verifica_percorrer(v, 1);
+    v->reparando = 0;
+
+    pthread_mutex_lock(&travaBuffers);
+    for (long i = blocosReservados; i < totalBlocos; i++) {
+        if (v->fatias[i] == 0)
+            continue;
+        uint64_t ocupadas = v->fatias[i] | 1;
+        Buffer *buf = buf_obter(i, 1);
+        memcpy(buf->dados, &ocupadas, sizeof(ocupadas));
+        buf->sujo = 1;
+    }
+    pthread_mutex_unlock(&travaBuffers);
+    pthread_mutex_lock(&travaCaudas);
+    numCaudasAbertas = 0;
+    pthread_mutex_unlock(&travaCaudas);
+
+    if (refsBlocos != NULL)
+        pthread_mutex_lock(&travaDedup);
+    for (long w = 0; w < numPalavras; w++) {
+        uint64_t m = ~blocosLivres[w] & ~v->vistos[w];
+        long base = w * 64;
+        if (base + 64 > totalBlocos)
+            m &= mascara_bits(0, (int)(totalBlocos - base));
+        if (blocosReservados - base >= 64)
+            m = 0;
+        else if (blocosReservados > base)
+            m &= ~mascara_bits(0, (int)(blocosReservados - base));
+        while (m != 0) {
+            int b = __builtin_ctzll(m);
+            uint64_t resto = m >> b;
+            int n = ~resto == 0 ? 64 : __builtin_ctzll(~resto);
+            for (long i = base + b; refsBlocos != NULL && i < base + b + n; i++) {
+                refsBlocos[i] = 0;
+                dedup_desindexar(i);
+            }
+            extensao_devolver(base + b, n);
+            m &= ~mascara_bits(b, n);
+        }
+    }
+    if (refsBlocos != NULL) {
+        blocosEconomizados = 0;
+        for (long i = blocosReservados; i < totalBlocos; i++) {
+            refsBlocos[i] = v->donos[i] ? v->donos[i] - 1 : 0;
+            blocosEconomizados += refsBlocos[i];
+        }
+        pthread_mutex_unlock(&travaDedup);
+    }
+    verifica_recontar();
+}
+
+/*
+ * verifica [--reparar] [threads=N]: refaz o bitmap esperado a partir da
+ * árvore atual e dos instantâneos, com N trabalhadores (padrão: um por
+ * processador), e o compara com o real: blocos ocupados sem dono, em uso
+ * mas livres, com mais de um dono, extensões fora da área de dados, o
+ * contador de livres e o resumo. Com --reparar corrige o que achou e
+ * confere tudo de novo.
+ */
+void verifica() {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN), reparar = 0;
+    for (int i = 1; argList[i] != NULL; i++) {
+        if (strcmp(argList[i], "--reparar") == 0) {
+            reparar = 1;
+        } else if (strncmp(argList[i], "threads=", 8) == 0 && atoi(argList[i] + 8) > 0) {
+            threads = atoi(argList[i] + 8);
+        } else {
+            printf("Erro: uso: verifica [--reparar] [threads=N]\n");
+            return;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > 64)
+        threads = 64;
+
+    Verificacao v;
+    memset(&v, 0, sizeof(v));
+    pthread_mutex_init(&v.trava, NULL);
+    pthread_cond_init(&v.temTrabalho, NULL);
+    v.vistos = (uint64_t*)calloc(numPalavras, sizeof(uint64_t));
+    v.repetidos = (uint64_t*)calloc(numPalavras, sizeof(uint64_t));
+    v.donos = refsBlocos != NULL ? (uint32_t*)calloc(totalBlocos, sizeof(uint32_t)) : NULL;
+    v.fatias = (uint64_t*)calloc(totalBlocos, sizeof(uint64_t));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (v.vistos == NULL || v.repetidos == NULL || v.fatias == NULL || (refsBlocos != NULL && v.donos == NULL)
+        || verifica_percorrer(&v, threads) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+    } else {
+        Faixas vazados, perdidos;
+        long problemas = verifica_comparar(&v, 1, &vazados, &perdidos);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        printf("%ld diretório(s), %ld arquivo(s) e %ld extensão(ões) verificados com %d thread(s) em %.3f ms.\n",
+               v.diretorios, v.arquivos, v.extensoes, threads,
+               (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+        if (liberacoesInvalidas > 0)
+            printf("Liberações de blocos que não estavam ocupados (desde o início): %ld\n", liberacoesInvalidas);
+        if (problemas == 0) {
+            printf("Nenhum problema encontrado.\n");
+        } else if (!reparar) {
+            printf("%ld problema(s) encontrado(s); 'verifica --reparar' os corrige.\n", problemas);
+        } else {
+            verifica_reparar(&v);
+            printf("Reparo: %ld bloco(s) de entradas substituído(s).\n", v.realocados);
+            memset(v.vistos, 0, numPalavras * sizeof(uint64_t));
+            memset(v.repetidos, 0, numPalavras * sizeof(uint64_t));
+            if (v.donos != NULL)
+                memset(v.donos, 0, totalBlocos * sizeof(uint32_t));
+            memset(v.fatias, 0, totalBlocos * sizeof(uint64_t));
+            v.blocosCauda = v.sobrepostas = 0;
+            free(v.compartilhados);
+            v.compartilhados = NULL;
+            v.capCompartilhados = v.numCompartilhados = 0;
+            memset(&v.foraDoDisco, 0, sizeof(Faixas));
+            if (v.erro || verifica_percorrer(&v, threads) != 0)
+                printf("Erro: o reparo não terminou (falta de memória ou de blocos livres).\n");
+            else if ((problemas = verifica_comparar(&v, 1, &vazados, &perdidos)) == 0)
+                printf("Nenhum problema depois do reparo.\n");
+            else
+                printf("Erro: %ld problema(s) depois do reparo.\n", problemas);
+        }
+    }
+    free(v.vistos);
+    free(v.repetidos);
+    free(v.donos);
+    free(v.fatias);
+    free(v.compartilhados);
+    pthread_mutex_destroy(&v.trava);
+    pthread_cond_destroy(&v.temTrabalho);
+}
+
+/* Acrescenta uma entrada ao lote; -1 se faltou memória. */
+int lote_acrescentar(LoteImporta *l, const char *nome, int32_t dir, long tamanho) {
+    size_t len = strlen(nome) + 1;
+    if (l->num == l->cap) {
+        long cap = l->cap ? l->cap * 2 : 64;
+        ItemImporta *maior = (ItemImporta*)realloc(l->itens, cap * sizeof(ItemImporta));
+        if (maior == NULL)
+            return -1;
+        l->itens = maior;
+        l->cap = cap;
+    }
+    if (l->tamNomes + len > l->capNomes) {
+        size_t cap = l->capNomes ? l->capNomes * 2 : 1024;
+        while (cap < l->tamNomes + len)
+            cap *= 2;
+        char *maior = (char*)realloc(l->nomes, cap);
+        if (maior == NULL)
+            return -1;
+        l->nomes = maior;
+        l->capNomes = cap;
+    }
+    memcpy(l->nomes + l->tamNomes, nome, len);
+    l->itens[l->num].nome = l->tamNomes;
+    l->itens[l->num].dir = dir;
+    l->itens[l->num].tamanho = tamanho;
+    l->num++;
+    l->tamNomes += len;
+    return 0;
+}
+
+void lote_liberar(LoteImporta *l) {
+    free(l->itens);
+    free(l->nomes);
+    free(l);
+}
+
+/*
+ * Lê o diretório 'p' do hospedeiro para o lote 'l'. Cada subdiretório ganha
+ * um id e vai para *novos, que só entram na pilha depois de o lote entrar
+ * na fila. Links simbólicos e arquivos especiais são ignorados, e os links
+ * não são seguidos. Devolve -1 se faltou memória.
+ */
+int importa_ler(Importacao *im, PendenteImporta *p, LoteImporta *l, PendenteImporta **novos, long *numNovos,
+                long *capNovos) {
+    uint64_t buf[TAM_LEITURA_IMPORTA / sizeof(uint64_t)];
+    int fd = openat(im->raiz, p->caminho[0] ? p->caminho : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        __atomic_fetch_add(&im->ilegiveis, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    size_t base = strlen(p->caminho);
+    long lidos;
+    while ((lidos = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        for (long pos = 0; pos < lidos;) {
+            EntradaHospedeiro *e = (EntradaHospedeiro*)((char*)buf + pos);
+            pos += e->tamanho;
+            if (strcmp(e->nome, ".") == 0 || strcmp(e->nome, "..") == 0)
+                continue;
+            if (strlen(e->nome) >= MAX_NOME) {
+                __atomic_fetch_add(&im->ignorados, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            /* O tipo vem na entrada; só os sistemas de arquivos que não o guardam pedem um fstatat a mais. */
+            int tipo = e->tipo;
+            struct stat st;
+            if (tipo == DT_REG || tipo == DT_UNKNOWN) {
+                if (fstatat(fd, e->nome, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    __atomic_fetch_add(&im->ilegiveis, 1, __ATOMIC_RELAXED);
+                    continue;
+                }
+                tipo = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+            }
+            if (tipo == DT_REG) {
+                if (lote_acrescentar(l, e->nome, -1, (long)st.st_size) != 0)
+                    goto sem_memoria;
+                continue;
+            }
+            if (tipo != DT_DIR) {
+                __atomic_fetch_add(&im->ignorados, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (*numNovos == *capNovos) {
+                long cap = *capNovos ? *capNovos * 2 : 64;
+                PendenteImporta *maior = (PendenteImporta*)realloc(*novos, cap * sizeof(PendenteImporta));
+                if (maior == NULL)
+                    goto sem_memoria;
+                *novos = maior;
+                *capNovos = cap;
+            }
+            size_t len = strlen(e->nome);
+            char *caminho = (char*)malloc(base + len + 2);
+            if (caminho == NULL)
+                goto sem_memoria;
+            if (base > 0) {
+                memcpy(caminho, p->caminho, base);
+                caminho[base] = '/';
+                memcpy(caminho + base + 1, e->nome, len + 1);
+            } else {
+                memcpy(caminho, e->nome, len + 1);
+            }
+            int32_t id = __atomic_fetch_add(&im->proximoId, 1, __ATOMIC_RELAXED);
+            if (lote_acrescentar(l, e->nome, id, 0) != 0) {
+                free(caminho);
+                goto sem_memoria;
+            }
+            (*novos)[*numNovos].caminho = caminho;
+            (*novos)[*numNovos].id = id;
+            (*numNovos)++;
+        }
+    }
+    if (lidos < 0)
+        __atomic_fetch_add(&im->ilegiveis, 1, __ATOMIC_RELAXED);
+    close(fd);
+    return 0;
+
+sem_memoria:
+    close(fd);
+    return -1;
+}
+
+/*
+ * Trabalhador da importação: tira um diretório da pilha, lê o lote dele,
+ * põe o lote na fila e os subdiretórios na pilha. Termina como os da
+ * verificação (pilha vazia e ninguém com um diretório em mãos), ou logo
+ * que a importação pára.
+ */
+void* importa_trabalhar(void *arg) {
+    Importacao *im = (Importacao*)arg;
+    PendenteImporta *novos = NULL;
+    long numNovos, capNovos = 0;
+    pthread_mutex_lock(&im->trava);
+    for (;;) {
+        while (im->topo == 0 && im->ativos > 0 && !im->parar)
+            pthread_cond_wait(&im->temTrabalho, &im->trava);
+        if (im->topo == 0 || im->parar)
+            break;
+        PendenteImporta p = im->pilha[--im->topo];
+        im->ativos++;
+        pthread_mutex_unlock(&im->trava);
+
+        numNovos = 0;
+        LoteImporta *l = (LoteImporta*)calloc(1, sizeof(LoteImporta));
+        int erro = l == NULL;
+        if (l != NULL) {
+            l->dir = p.id;
+            erro = importa_ler(im, &p, l, &novos, &numNovos, &capNovos) != 0;
+        }
+        free(p.caminho);
+
+        pthread_mutex_lock(&im->trava);
+        if (!erro && im->topo + numNovos > im->capPilha) {
+            long cap = im->capPilha * 2 > im->topo + numNovos ? im->capPilha * 2 : im->topo + numNovos;
+            PendenteImporta *maior = (PendenteImporta*)realloc(im->pilha, cap * sizeof(PendenteImporta));
+            if (maior == NULL) {
+                erro = 1;
+            } else {
+                im->pilha = maior;
+                im->capPilha = cap;
+            }
+        }
+        if (erro) {
+            for (long i = 0; i < numNovos; i++)
+                free(novos[i].caminho);
+            numNovos = 0;
+            if (l != NULL)
+                lote_liberar(l);
+            im->parar = 1;
+        } else {
+            if (im->filaFim != NULL)
+                im->filaFim->prox = l;
+            else
+                im->fila = l;
+            im->filaFim = l;
+            pthread_cond_signal(&im->temLote);
+            if (numNovos > 0)
+                memcpy(im->pilha + im->topo, novos, numNovos * sizeof(PendenteImporta));
+            im->topo += numNovos;
+        }
+        im->ativos--;
+        if (numNovos > 0 || im->ativos == 0 || im->parar)
+            pthread_cond_broadcast(&im->temTrabalho);
+    }
+    im->trabalhadores--;
+    pthread_cond_signal(&im->temLote);
+    pthread_mutex_unlock(&im->trava);
+    free(novos);
+    return NULL;
+}
+
+/* Guarda em destinos[id] o diretório da árvore que corresponde ao id; -1 se faltou memória. */
+int importa_destino(Importacao *im, int32_t id, Bloco *d) {
+    if (id >= im->capDestinos) {
+        long cap = im->capDestinos ? im->capDestinos * 2 : 1024;
+        while (cap <= id)
+            cap *= 2;
+        Bloco **maior = (Bloco**)realloc(im->destinos, cap * sizeof(Bloco*));
+        if (maior == NULL)
+            return -1;
+        memset(maior + im->capDestinos, 0, (cap - im->capDestinos) * sizeof(Bloco*));
+        im->destinos = maior;
+        im->capDestinos = cap;
+    }
+    im->destinos[id] = d;
+    return 0;
+}
+
+/*
+ * Diretório 'nome' de 'pai' para receber a importação: o que já existe
+ * (com cópia própria, se é de um instantâneo) ou um novo, com o bloco
+ * tirado de 'r'. Um novo soma em *uso. NULL se falhou.
+ */
+Bloco* importa_dir(Bloco *pai, const char *nome, Reserva *r, Uso *uso) {
+    Bloco *d = dir_buscar(pai, nome, 1);
+    if (d != NULL) {
+        if (d->dir->compartilhado > 0 && dir_copiar(d) != 0)
+            return NULL;
+        d->dir->pai = pai;
+        dir_carregar(d);
+        return d;
+    }
+    long pos;
+    if (reserva_tirar(r, 1, &pos) == 0) {
+        printf("Erro: não há mais blocos livres.\n");
+        return NULL;
+    }
+    d = criad_ligar(pai, nome, pos);
+    if (d != NULL) {
+        uso->diretorios++;
+        uso->blocos++;
+    }
+    return d;
+}
+
+/*
+ * Insere o lote 'l' no diretório que o id dele recebeu. Os blocos de todo o
+ * lote (um por diretório novo e, com 'prealocar', os inteiros de cada
+ * arquivo) são pedidos antes, de uma vez, e os agregados sobem uma vez só.
+ * Entradas que já existem são mantidas. Devolve -1 se uma criação falhou.
+ */
+int importa_inserir(Importacao *im, LoteImporta *l) {
+    Bloco *d = l->dir < im->capDestinos ? im->destinos[l->dir] : NULL;
+    if (d == NULL)
+        return 0;
+    long precisa = 0;
+    for (long i = 0; i < l->num; i++)
+        precisa += l->itens[i].dir >= 0 ? 1 : im->prealocar ? criaa_blocos(l->itens[i].tamanho, NULL) : 0;
+    reserva_pedir(&im->reserva, precisa);
+
+    Uso uso = {0, 0, 0, 0};
+    int erro = 0;
+    for (long i = 0; i < l->num && !erro; i++) {
+        ItemImporta *it = &l->itens[i];
+        const char *nome = l->nomes + it->nome;
+        if (it->dir >= 0) {
+            Bloco *c = importa_dir(d, nome, &im->reserva, &uso);
+            erro = c == NULL || importa_destino(im, it->dir, c) != 0;
+            continue;
+        }
+        if (dir_buscar(d, nome, 0) != NULL) {
+            im->existentes++;
+            continue;
+        }
+        Arquivo *arq = criaa_arquivo(it->tamanho, im->prealocar, &im->reserva);
+        if (arq == NULL || criaa_ligar(d, nome, arq) == NULL) {
+            erro = 1;
+            continue;
+        }
+        uso.arquivos++;
+        uso.bytes += it->tamanho;
+        uso.blocos += arquivo_blocos(arq);
+    }
+    reserva_devolver(&im->reserva);
+    if (uso.arquivos > 0 || uso.diretorios > 0)
+        agregados_somar(d, uso, 1);
+    im->dirs += uso.diretorios;
+    im->arquivos += uso.arquivos;
+    im->bytes += uso.bytes;
+    im->blocos += uso.blocos;
+    return erro ? -1 : 0;
+}
+
+/*
+ * Com diário, o comando inteiro seria uma transação só. Passado o limite do
+ * modo lote (ou com 'sempre'), confirma o que os lotes já inseriram e abre
+ * outra operação; cada lote deixa o volume consistente. Devolve 1 se
+ * confirmou.
+ */
+int importa_confirmar(int sempre) {
+    if (!diarioAtivo)
+        return 0;
+    pthread_mutex_lock(&diario.trava);
+    int grande = diario.numSujos > LIMITE_SUJOS_LOTE;
+    long tid = diario.atual;
+    pthread_mutex_unlock(&diario.trava);
+    if (!grande && !sempre)
+        return 0;
+    diario_terminar();
+    diario_esperar(tid);
+    diario_iniciar();
+    return 1;
+}
+
+/* Diretório da árvore que recebe a importação: 'caminho' se já existe, senão criado no pai. */
+Bloco* importa_raiz(char *caminho, Uso *uso, Bloco **paiCriado) {
+    normalizar_caminho(caminho);
+    *paiCriado = NULL;
+    if (*caminho == '\0') {
+        Bloco *r = resolver_dir(caminho, 1);
+        if (r != NULL)
+            dir_destravar(r);
+        return r;
+    }
+    char *nome;
+    Bloco *pai = resolver_pai(caminho, &nome, 1);
+    if (pai == NULL)
+        return NULL;
+    dir_destravar(pai);
+    dir_carregar(pai);
+    Bloco *d = importa_dir(pai, nome, NULL, uso);
+    if (uso->diretorios > 0)
+        *paiCriado = pai;
+    return d;
+}
+
+/*
+ * importa <diretório_do_hospedeiro> <caminho> [--esparso] [threads=N]:
+ * copia a árvore de nomes e tamanhos de um diretório real para 'caminho'
+ * (criado se não existe). Os arquivos ganham os blocos inteiros já, como
+ * 'criaa --prealloc', a não ser com --esparso; o conteúdo não é copiado.
+ */
+void importa() {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN), prealocar = 1;
+    if (argList[1] == NULL || argList[2] == NULL) {
+        printf("Erro: uso: importa <diretorio_do_hospedeiro> <caminho> [--esparso] [threads=N]\n");
+        return;
+    }
+    for (int i = 3; argList[i] != NULL; i++) {
+        if (strcmp(argList[i], "--esparso") == 0) {
+            prealocar = 0;
+        } else if (strncmp(argList[i], "threads=", 8) == 0 && atoi(argList[i] + 8) > 0) {
+            threads = atoi(argList[i] + 8);
+        } else {
+            printf("Erro: uso: importa <diretorio_do_hospedeiro> <caminho> [--esparso] [threads=N]\n");
+            return;
+        }
+    }
+    if (threads < 1)
+        threads = 1;
+    if (threads > 64)
+        threads = 64;
+
+    Importacao im;
+    memset(&im, 0, sizeof(im));
+    im.raiz = open(argList[1], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (im.raiz < 0) {
+        printf("Erro: não foi possível abrir o diretório '%s' do hospedeiro.\n", argList[1]);
+        return;
+    }
+    int verbosoOriginal = verboso;
+    verboso = 0;
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    Uso uso = {0, 0, 0, 0};
+    Bloco *paiCriado;
+    Bloco *destino = importa_raiz(argList[2], &uso, &paiCriado);
+    if (paiCriado != NULL)
+        agregados_somar(paiCriado, uso, 1);
+    im.dirs = uso.diretorios;
+    im.blocos = uso.blocos;
+    im.prealocar = prealocar;
+    im.capPilha = 64;
+    im.pilha = (PendenteImporta*)malloc(im.capPilha * sizeof(PendenteImporta));
+    char *inicial = strdup("");
+    if (destino == NULL || im.pilha == NULL || inicial == NULL || importa_destino(&im, 0, destino) != 0) {
+        if (destino != NULL)
+            printf("Erro: falha na alocação de memória.\n");
+        free(inicial);
+        free(im.pilha);
+        free(im.destinos);
+        close(im.raiz);
+        verboso = verbosoOriginal;
+        return;
+    }
+    im.pilha[im.topo].caminho = inicial;
+    im.pilha[im.topo].id = 0;
+    im.topo++;
+    im.proximoId = 1;
+    pthread_mutex_init(&im.trava, NULL);
+    pthread_cond_init(&im.temTrabalho, NULL);
+    pthread_cond_init(&im.temLote, NULL);
+
+    /* Os trabalhadores leem o hospedeiro enquanto esta thread insere os lotes. */
+    pthread_t *ids = (pthread_t*)malloc(threads * sizeof(pthread_t));
+    int criadas = 0;
+    im.trabalhadores = threads;
+    if (ids != NULL)
+        while (criadas < threads && pthread_create(&ids[criadas], NULL, importa_trabalhar, &im) == 0)
+            criadas++;
+    pthread_mutex_lock(&im.trava);
+    im.trabalhadores -= threads - (criadas > 0 ? criadas : 1);
+    pthread_mutex_unlock(&im.trava);
+    if (criadas == 0)
+        importa_trabalhar(&im);
+
+    long confirmacoes = 0;
+    pthread_mutex_lock(&im.trava);
+    for (;;) {
+        while (im.fila == NULL && im.trabalhadores > 0)
+            pthread_cond_wait(&im.temLote, &im.trava);
+        LoteImporta *l = im.fila;
+        if (l == NULL)
+            break;
+        im.fila = l->prox;
+        if (im.fila == NULL)
+            im.filaFim = NULL;
+        int parar = im.parar;
+        pthread_mutex_unlock(&im.trava);
+
+        int erro = 0;
+        if (!parar) {
+            erro = importa_inserir(&im, l) != 0;
+            confirmacoes += importa_confirmar(0);
+        }
+        lote_liberar(l);
+        pthread_mutex_lock(&im.trava);
+        if (erro) {
+            im.parar = 1;
+            pthread_cond_broadcast(&im.temTrabalho);
+        }
+    }
+    pthread_mutex_unlock(&im.trava);
+    for (int i = 0; i < criadas; i++)
+        pthread_join(ids[i], NULL);
+    free(ids);
+    if (confirmacoes > 0)
+        importa_confirmar(1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    verboso = verbosoOriginal;
+
+    double seg = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    long entradas = im.dirs + im.arquivos;
+    if (im.parar)
+        printf("Importação interrompida; o que já foi inserido fica.\n");
+    printf("%ld diretório(s) e %ld arquivo(s) importados de '%s' (%ld bytes, %ld bloco(s)) com %d thread(s) em %.3f s"
+           " (%.0f entradas/s).\n", im.dirs, im.arquivos, argList[1], im.bytes, im.blocos, criadas > 0 ? criadas : 1,
+           seg, seg > 0 ? entradas / seg : 0.0);
+    if (im.existentes > 0 || im.ignorados > 0 || im.ilegiveis > 0)
+        printf("Já existiam: %ld; ignorados (links, especiais, nomes longos): %ld; ilegíveis no hospedeiro: %ld.\n",
+               im.existentes, im.ignorados, im.ilegiveis);
+
+    for (long i = 0; i < im.topo; i++)
+        free(im.pilha[i].caminho);
+    free(im.pilha);
+    free(im.destinos);
+    free(im.reserva.seq);
+    close(im.raiz);
+    pthread_mutex_destroy(&im.trava);
+    pthread_cond_destroy(&im.temTrabalho);
+    pthread_cond_destroy(&im.temLote);
+}
+
+/*
+ * Instantâneos por cópia na escrita. 'snapshot' só cria uma entrada de raiz
+ * para o diretório raiz atual e marca esse diretório como compartilhado:
+ * custa O(1), qualquer que seja o tamanho da árvore. Depois disso, quem vai
+ * alterar um diretório compartilhado copia antes o diretório (o índice e as
+ * entradas, não os filhos) e cada ancestral dele, de cima para baixo, e quem
+ * vai escrever num arquivo compartilhado copia os blocos dele. O resto da
+ * árvore continua compartilhado. Os blocos de um arquivo ou diretório só
+ * voltam ao bitmap quando a última entrada que o aponta é solta.
+ */
+int dir_copiar(Bloco *b) {
+    Diretorio *velho = b->dir;
+    Diretorio *d = dir_criar();
+    if (d == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        return -1;
+    }
+    /* A raiz não tem bloco de dados; as cópias dela também não. */
+    long pos = velho->attr.posicao;
+    if (b != raiz && (pos = alocar_bloco()) == -1) {
+        dir_destruir(d);
+        return -1;
+    }
+    if (velho->capTabela > d->capTabela) {
+        Bloco **tabela = (Bloco**)arena_alocar(velho->capTabela * sizeof(Bloco*));
+        if (tabela == NULL) {
+            printf("Erro: falha na alocação de memória.\n");
+            if (b != raiz)
+                liberar_bloco(pos);
+            dir_destruir(d);
+            return -1;
+        }
+        arena_liberar(d->tabela, d->capTabela * sizeof(Bloco*));
+        d->tabela = tabela;
+        d->capTabela = velho->capTabela;
+    }
+
+    /* As entradas são ligadas do fim para o começo: dir_ligar insere no início e a ordem de listagem se mantém. */
+    Bloco copia;
+    memset(&copia, 0, sizeof(copia));
+    copia.dir = d;
+    Bloco *ultimo = b->filho;
+    while (ultimo != NULL && ultimo->prox != NULL)
+        ultimo = ultimo->prox;
+    for (Bloco *c = ultimo; c != NULL; c = c->ant) {
+        Bloco *nc = (Bloco*)pool_alocar(&poolBlocos);
+        if (nc != NULL && (nc->nome = nome_internar(c->nome)) == NULL) {
+            pool_liberar(&poolBlocos, nc);
+            nc = NULL;
+        }
+        if (nc == NULL) {
+            printf("Erro: falha na alocação de memória.\n");
+            while (copia.filho != NULL) {
+                Bloco *x = copia.filho;
+                copia.filho = x->prox;
+                if (x->arq != NULL)
+                    x->arq->compartilhado--;
+                else
+                    x->dir->compartilhado--;
+                nome_soltar(x->nome);
+                pool_liberar(&poolBlocos, x);
+            }
+            if (b != raiz)
+                liberar_bloco(pos);
+            dir_destruir(d);
+            return -1;
+        }
+        nc->arq = c->arq;
+        nc->dir = c->dir;
+        nc->filho = c->filho;
+        dir_ligar(&copia, nc);
+        if (c->arq != NULL)
+            c->arq->compartilhado++;
+        else
+            c->dir->compartilhado++;
+    }
+
+    d->attr = velho->attr;
+    d->attr.posicao = pos;
+    d->proprios = *velho->agregados;
+    d->pai = velho->pai;
+    for (Bloco *c = copia.filho; c != NULL; c = c->prox)
+        if (c->dir != NULL)
+            c->dir->pai = b;
+    velho->compartilhado--;
+    b->dir = d;
+    b->filho = copia.filho;
+    busca_copiou_dir(velho, b);
+    dirsCopiados++;
+    cache_invalidar_filhos(b);
+    return 0;
+}
+
+/*
+ * Dá a 'b' uma cópia própria do arquivo compartilhado que ela aponta. A
+ * cópia tem as mesmas extensões e os blocos de dados passam a ser contados
+ * em refsBlocos, como os do dedup: a escrita seguinte copia só o bloco que
+ * altera (ver dedup_gravar). Só a cauda, que não tem contagem, é copiada.
+ */
+int arquivo_copiar(Bloco *b) {
+    Arquivo *velho = b->arq;
+    if (dedup_ligar() != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        return -1;
+    }
+    Arquivo *arq = (Arquivo*)pool_alocar(&poolArquivos);
+    Extensao *ext = (Extensao*)arena_alocar(velho->numExt * sizeof(Extensao));
+    if (arq == NULL || ext == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        if (arq != NULL)
+            pool_liberar(&poolArquivos, arq);
+        if (ext != NULL)
+            arena_liberar(ext, velho->numExt * sizeof(Extensao));
+        return -1;
+    }
+    memcpy(ext, velho->ext, velho->numExt * sizeof(Extensao));
+    arq->ext = ext;
+    arq->numExt = arq->capExt = velho->numExt;
+    pthread_mutex_lock(&travaDedup);
+    for (int j = 0; j < arq->numExt; j++) {
+        if (ext[j].inicio == BURACO)
+            continue;
+        for (long i = 0; i < ext[j].tamanho; i++)
+            refsBlocos[ext[j].inicio + i]++;
+        blocosEconomizados += ext[j].tamanho;
+    }
+    pthread_mutex_unlock(&travaDedup);
+    if (velho->fragmentado)
+        frag_ligar(arq);
+    if (velho->caudaFatias > 0 && cauda_alocar(arq, velho->caudaFatias) != 0) {
+        printf("Erro: não há mais blocos livres.\n");
+        arquivo_liberar(arq);
+        return -1;
+    }
+    arq->attr = velho->attr;
+    arq->attr.posicao = arquivo_posicao(arq);
+    arq->tamanho = velho->tamanho;
+    arq->escritoAte = velho->escritoAte;
+    if (velho->caudaFatias > 0) {
+        unsigned char dados[TAM_BLOCO_MAX];
+        long bytes = velho->caudaFatias * (tamBloco / FATIAS_CAUDA);
+        cauda_transferir(velho, 0, dados, bytes, 0);
+        cauda_transferir(arq, 0, dados, bytes, 1);
+    }
+
+    velho->compartilhado--;
+    b->arq = arq;
+    busca_trocar(velho, arq);
+    arquivosCopiados++;
+    return 0;
+}
+
+/*
+ * Solta a entrada 'b' (fora de qualquer lista) e, se ela era a última a
+ * apontar o diretório ou arquivo, libera-o com toda a subárvore que só ele
+ * alcançava. Sem recursão: a pilha é encadeada por proxHash, que entradas
+ * já soltas não usam mais.
+ */
+void arvore_soltar(Bloco *b) {
+    b->proxHash = NULL;
+    Bloco *pilha = b;
+    while (pilha != NULL) {
+        Bloco *x = pilha;
+        pilha = x->proxHash;
+        if (x->arq != NULL) {
+            arquivo_soltar(x->arq);
+        } else if (x->dir->compartilhado > 0) {
+            x->dir->compartilhado--;
+        } else {
+            for (Bloco *c = x->filho; c != NULL; c = c->prox) {
+                c->proxHash = pilha;
+                pilha = c;
+            }
+            if (x->dir->pai != NULL)
+                liberar_bloco(x->dir->attr.posicao);
+            dir_destruir(x->dir);
+        }
+        nome_soltar(x->nome);
+        pool_liberar(&poolBlocos, x);
+    }
+}
+
+/*
+ * Sem instantâneos, Diretorio.pai volta a ser usado fora do caminho de
+ * resolver_copiando; um diretório que era compartilhado pode ter ficado com
+ * o pai numa entrada já solta. Refaz os pais da árvore atual em O(n).
+ */
+void religar_pais() {
+    Percurso p;
+    Bloco **ultimos = NULL;
+    int cap = 0;
+    if (percurso_iniciar(&p, raiz, -1) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
+        return;
+    }
+    Bloco *b;
+    int nivel;
+    while ((b = percurso_proximo(&p, &nivel)) != NULL) {
+        if (b->arq != NULL)
+            continue;
+        b->dir->pai = nivel == 0 ? raiz : ultimos[nivel - 1];
+        if (nivel >= cap) {
+            int novo = cap ? cap * 2 : PILHA_PERCURSO;
+            Bloco **maior = (Bloco**)realloc(ultimos, novo * sizeof(Bloco*));
+            if (maior == NULL) {
+                printf("Erro: falha na alocação de memória.\n");
+                break;
+            }
+            ultimos = maior;
+            cap = novo;
+        }
+        ultimos[nivel] = b;
+    }
+    percurso_encerrar(&p);
+    free(ultimos);
+}
+
+Instantaneo* instantaneo_buscar(const char *nome) {
+    for (Instantaneo *i = instantaneos; i != NULL; i = i->prox)
+        if (strcmp(i->nome, nome) == 0)
+            return i;
+    return NULL;
 }
 
-void criad() {
-    if (argList[1] == NULL) {
-        printf("Erro: nome do diretório não fornecido.\n");
+/*
+ * Memória e blocos do instantâneo, separados entre o que ainda é
+ * compartilhado (com a árvore atual ou outro instantâneo) e o que só ele
+ * mantém vivo. Tudo abaixo de um diretório compartilhado é compartilhado.
+ */
+void instantaneo_medir(Instantaneo *inst) {
+    long memoria[2] = {0, 0}, blocos[2] = {0, 0}, entradas = 0;
+    Diretorio *r = inst->raiz->dir;
+    int raizCompartilhada = r->compartilhado > 0;
+    memoria[raizCompartilhada] += sizeof(Diretorio) + r->capTabela * sizeof(Bloco*) + r->numFilhos * sizeof(Bloco);
+
+    Percurso p;
+    if (percurso_iniciar(&p, inst->raiz, -1) != 0) {
+        printf("Erro: falha na alocação de memória.\n");
         return;
     }
-
-    dirList = (char**)malloc(256 * sizeof(char*));
-    int count = 0;
-    char *token = strtok(argList[1], "/");
-    while (token) {
-        dirList[count++] = token;
-        token = strtok(NULL, "/");
+    Bloco *b;
+    int nivel, desde = -1;     /* nível do diretório compartilhado de onde a subárvore atual vem, ou -1 */
+    while ((b = percurso_proximo(&p, &nivel)) != NULL) {
+        entradas++;
+        if (desde >= nivel)
+            desde = -1;
+        int proprio = b->arq != NULL ? b->arq->compartilhado > 0 : b->dir->compartilhado > 0;
+        if (proprio && desde < 0)
+            desde = nivel;
+        int c = raizCompartilhada || desde >= 0;
+        if (b->arq != NULL) {
+            memoria[c] += sizeof(Arquivo) + b->arq->capExt * sizeof(Extensao);
+            /* Um arquivo próprio ainda divide os blocos que a cópia na escrita não trocou. */
+            long comuns = c || refsBlocos == NULL ? 0 : arquivo_blocos_compartilhados(b->arq);
+            blocos[1] += comuns;
+            blocos[c] += arquivo_blocos(b->arq) - comuns;
+        } else {
+            Diretorio *d = b->dir;
+            memoria[c] += sizeof(Diretorio) + d->capTabela * sizeof(Bloco*) + d->numFilhos * sizeof(Bloco);
+            blocos[c]++;
+        }
     }
-    dirList[count] = NULL;
+    percurso_encerrar(&p);
 
-    Bloco* atual = raiz;
-    int i = 0;
+    char data[20];
+    formatar_data(inst->criado, data);
+    printf("%-16s %s %9ld %12ld %10ld %12ld %10ld\n", inst->nome, data, entradas, memoria[1], blocos[1],
+           memoria[0], blocos[0]);
+}
 
-    while (dirList[i + 1] != NULL) {
-        Bloco* current = atual->filho;
-        while (current != NULL) {
-            if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-                atual = current;
-                break;
-            }
-            current = current->prox;
-        }
-        if (current == NULL) {
-            printf("Erro: diretório '%s' não encontrado.\n", dirList[i]);
-            free(dirList);
+/* snapshot [nome | --apagar nome]: cria, apaga ou lista instantâneos da árvore. */
+void snapshot() {
+    if (mapaVolume != NULL) {
+        printf("Erro: instantâneos só existem em volumes em memória.\n");
+        return;
+    }
+    if (argList[1] == NULL) {
+        if (instantaneos == NULL) {
+            printf("Nenhum instantâneo.\n");
             return;
         }
-        i++;
+        printf("%-16s %-19s %9s %12s %10s %12s %10s\n", "instantâneo", "criado", "entradas", "compart. (B)",
+               "blocos", "próprio (B)", "blocos");
+        for (Instantaneo *i = instantaneos; i != NULL; i = i->prox)
+            instantaneo_medir(i);
+        printf("%ld diretório(s) e %ld arquivo(s) copiados na escrita.\n", dirsCopiados, arquivosCopiados);
+        return;
     }
 
-    Bloco* current = atual->filho;
-    while (current != NULL) {
-        if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-            printf("Erro: diretório '%s' já existe.\n", dirList[i]);
-            free(dirList);
+    if (strcmp(argList[1], "--apagar") == 0) {
+        if (argList[2] == NULL) {
+            printf("Erro: uso: snapshot --apagar <nome>\n");
             return;
         }
-        current = current->prox;
+        Instantaneo **pp = &instantaneos;
+        while (*pp != NULL && strcmp((*pp)->nome, argList[2]) != 0)
+            pp = &(*pp)->prox;
+        if (*pp == NULL) {
+            printf("Erro: instantâneo '%s' não encontrado.\n", argList[2]);
+            return;
+        }
+        Instantaneo *inst = *pp;
+        *pp = inst->prox;
+        int verbosoOriginal = verboso;
+        verboso = 0;
+        arvore_soltar(inst->raiz);
+        verboso = verbosoOriginal;
+        __atomic_store_n(&numInstantaneos, numInstantaneos - 1, __ATOMIC_RELEASE);
+        if (numInstantaneos == 0)
+            religar_pais();
+        printf("Instantâneo '%s' apagado.\n", inst->nome);
+        free(inst);
+        return;
     }
 
-    int pos = alocar_bloco();
-    if (pos == -1) {
-        free(dirList);
+    if (strlen(argList[1]) >= MAX_NOME) {
+        printf("Erro: nome '%s' muito longo.\n", argList[1]);
         return;
     }
-
-    Bloco* novoBloco = (Bloco*)malloc(sizeof(Bloco));
-    if (novoBloco == NULL) {
+    if (instantaneo_buscar(argList[1]) != NULL) {
+        printf("Erro: instantâneo '%s' já existe.\n", argList[1]);
+        return;
+    }
+    Instantaneo *inst = (Instantaneo*)malloc(sizeof(Instantaneo));
+    Bloco *r = (Bloco*)pool_alocar(&poolBlocos);
+    if (inst == NULL || r == NULL || (r->nome = nome_internar(raiz->nome)) == NULL) {
         printf("Erro: falha na alocação de memória.\n");
-        free(dirList);
+        free(inst);
+        if (r != NULL)
+            pool_liberar(&poolBlocos, r);
         return;
     }
-
-    strcpy(novoBloco->nome, dirList[i]);
-    strcpy(novoBloco->data, obter_data_atual());
-    novoBloco->arq = NULL;
-    novoBloco->filho = NULL;
-    novoBloco->prox = atual->filho;
-    novoBloco->posicao = pos;
-    atual->filho = novoBloco;
-
-    printf("Diretório '%s' criado com sucesso.\n", dirList[i]);
-    free(dirList);
+    r->dir = raiz->dir;
+    r->filho = raiz->filho;
+    raiz->dir->compartilhado++;
+    strcpy(inst->nome, argList[1]);
+    inst->raiz = r;
+    inst->criado = time(NULL);
+    inst->prox = NULL;
+    Instantaneo **fim = &instantaneos;
+    while (*fim != NULL)
+        fim = &(*fim)->prox;
+    *fim = inst;
+    __atomic_store_n(&numInstantaneos, numInstantaneos + 1, __ATOMIC_RELEASE);
+    printf("Instantâneo '%s' criado.\n", inst->nome);
 }
 
-void criaa() {
-    if (argList[1] == NULL || argList[2] == NULL) {
-        printf("Erro: nome e/ou tamanho do arquivo não fornecido.\n");
+/* Troca a árvore atual pela do instantâneo, que continua existindo; o que só a árvore atual usava é liberado. */
+void rollback() {
+    if (argList[1] == NULL) {
+        printf("Erro: uso: rollback <nome>\n");
         return;
     }
-
-    dirList = (char**)malloc(256 * sizeof(char*));
-    if (dirList == NULL) {
+    Instantaneo *inst = instantaneo_buscar(argList[1]);
+    if (inst == NULL) {
+        printf("Erro: instantâneo '%s' não encontrado.\n", argList[1]);
+        return;
+    }
+    Bloco *r = (Bloco*)pool_alocar(&poolBlocos);
+    if (r == NULL || (r->nome = nome_internar(raiz->nome)) == NULL) {
         printf("Erro: falha na alocação de memória.\n");
+        if (r != NULL)
+            pool_liberar(&poolBlocos, r);
         return;
     }
+    r->dir = inst->raiz->dir;
+    r->filho = inst->raiz->filho;
+    r->dir->compartilhado++;
+    Bloco *velha = raiz;
+    raiz = r;
+    int verbosoOriginal = verboso;
+    verboso = 0;
+    arvore_soltar(velha);
+    verboso = verbosoOriginal;
+    cache_limpar();
+    /* Outra árvore inteira: o índice de nomes é remontado pelo próximo 'busca'. */
+    busca_descartar();
+    printf("Árvore de volta ao instantâneo '%s'.\n", inst->nome);
+}
 
-    int count = 0;
-    char *token = strtok(argList[1], "/");
-    while (token) {
-        dirList[count++] = token;
-        token = strtok(NULL, "/");
-    }
-    dirList[count] = NULL;
+/*
+ * Benchmark: gera uma árvore sintética e uma mistura de operações e as
+ * executa pelos próprios comandos (criad, criaa, removea, removed, verd,
+ * verset), medindo a latência de cada chamada. A saída dos comandos vai
+ * para /dev/null durante a medição; no fim são impressos vazão e
+ * p50/p99/p999 por tipo de operação e o pico de RSS do processo.
+ *
+ * Parâmetros (chave=valor): prof, ramos, arquivos, tam=MIN-MAX,
+ * dist=log|uniforme, criacao=prealocada|esparsa, ops, criaa, removea,
+ * verd, verset, criad, removed (pesos da mistura), semente, raiz.
+ *
+ * Por padrão os arquivos são criados com --prealloc, para que as criações
+ * passem pelo alocador; com criacao=esparsa só a entrada é medida. A árvore
+ * é removida no fim (fora da medição), então outro bench pode rodar depois.
+ */
+enum { OP_CRIAD, OP_CRIAA, OP_REMOVEA, OP_REMOVED, OP_VERD, OP_VERSET, NUM_OPS };
 
-    Bloco* atual = raiz;
-    int i = 0;
+const char *nomesOps[NUM_OPS] = {"criad", "criaa", "removea", "removed", "verd", "verset"};
+void (*funcoesOps[NUM_OPS])() = {criad, criaa, removea, removed, verd, verset};
 
-    while (dirList[i + 1] != NULL) {
-        Bloco* current = atual->filho;
-        while (current != NULL) {
-            if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-                atual = current;
-                break;
-            }
-            current = current->prox;
-        }
-        if (current == NULL) {
-            printf("Erro: diretório '%s' não encontrado.\n", dirList[i]);
-            free(dirList);
-            return;
-        }
-        i++;
-    }
+typedef struct amostras {
+    double *ns;
+    long n, cap;
+    double total;
+    long falhas;        /* chamadas que não tiveram efeito (o comando imprimiu um erro) */
+} Amostras;
 
-    Bloco* current = atual->filho;
-    while (current != NULL) {
-        if (current->arq != NULL && strcmp(current->nome, dirList[i]) == 0) {
-            printf("Erro: arquivo '%s' já existe.\n", dirList[i]);
-            free(dirList);
-            return;
-        }
-        current = current->prox;
-    }
+typedef struct listaCaminhos {
+    char **itens;
+    long n, cap;
+} ListaCaminhos;
 
-    int file_size = atoi(argList[2]);
-    int num_blocks = (file_size + 512 - 1) / 512;
-    if (num_blocks > espacosLivres) {
-        printf("Erro: espaço insuficiente para criar o arquivo.\n");
-        free(dirList);
-        return;
+_Thread_local uint64_t estadoBench;
+
+uint64_t bench_aleatorio() {
+    uint64_t x = estadoBench;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    estadoBench = x;
+    return x;
+}
+
+void lista_adicionar(ListaCaminhos *l, const char *caminho) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 1024;
+        l->itens = (char**)realloc(l->itens, l->cap * sizeof(char*));
     }
+    l->itens[l->n++] = strdup(caminho);
+}
 
-    Arquivo* arq = (Arquivo*)malloc(sizeof(Arquivo));
-    if (arq == NULL) {
-        printf("Erro: falha na alocação de memória.\n");
-        free(dirList);
-        return;
+void lista_remover(ListaCaminhos *l, long i) {
+    free(l->itens[i]);
+    l->itens[i] = l->itens[--l->n];
+}
+
+void lista_liberar(ListaCaminhos *l) {
+    for (long i = 0; i < l->n; i++)
+        free(l->itens[i]);
+    free(l->itens);
+}
+
+/*
+ * Executa um comando com cópias modificáveis dos argumentos e guarda a
+ * latência. Devolve 1 se o comando teve efeito: as criações e remoções
+ * conferem a contagem da árvore inteira na raiz (o bench tem o volume
+ * exclusivo), e as listagens sempre contam. Falhas não entram nas amostras.
+ */
+int bench_executar(int op, Amostras *a, const char *arg1, const char *arg2, const char *arg3) {
+    char buf1[MAX_CAMINHO], buf2[32], buf3[32];
+    char *args[5] = {(char*)nomesOps[op], NULL, NULL, NULL, NULL};
+    if (arg1 != NULL) {
+        snprintf(buf1, sizeof(buf1), "%s", arg1);
+        args[1] = buf1;
+    }
+    if (arg2 != NULL) {
+        snprintf(buf2, sizeof(buf2), "%s", arg2);
+        args[2] = buf2;
+    }
+    if (arg3 != NULL) {
+        snprintf(buf3, sizeof(buf3), "%s", arg3);
+        args[3] = buf3;
     }
-    arq->posicao = alocar_bloco();
-    arq->prox = NULL;
 
-    Arquivo* temp = arq;
-    for (int j = 1; j < num_blocks; j++) {
-        Arquivo* novoArq = (Arquivo*)malloc(sizeof(Arquivo));
-        if (novoArq == NULL) {
-            printf("Erro: falha na alocação de memória.\n");
-            while (arq != NULL) {
-                Arquivo* next = arq->prox;
-                free(arq);
-                arq = next;
-            }
-            free(dirList);
-            return;
-        }
-        novoArq->posicao = alocar_bloco();
-        novoArq->prox = NULL;
-        temp->prox = novoArq;
-        temp = novoArq;
+    struct timespec t0, t1;
+    Uso antes = raiz->dir->agregados->total;
+    argList = args;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    long tid = op != OP_VERD && op != OP_VERSET ? diario_iniciar() : 0;
+    funcoesOps[op]();
+    if (tid) {
+        diario_terminar();
+        diario_concluir(tid);
     }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    argList = NULL;
 
-    Bloco* novoBloco = (Bloco*)malloc(sizeof(Bloco));
-    if (novoBloco == NULL) {
-        printf("Erro: falha na alocação de memória.\n");
-        while (arq != NULL) {
-            Arquivo* next = arq->prox;
-            free(arq);
-            arq = next;
-        }
-        free(dirList);
-        return;
+    Uso depois = raiz->dir->agregados->total;
+    int ok = op == OP_CRIAD ? depois.diretorios == antes.diretorios + 1
+             : op == OP_CRIAA ? depois.arquivos == antes.arquivos + 1
+             : op == OP_REMOVEA ? depois.arquivos == antes.arquivos - 1
+             : op == OP_REMOVED ? depois.diretorios == antes.diretorios - 1 : 1;
+    if (!ok) {
+        a->falhas++;
+        return 0;
+    }
+    double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    if (a->n == a->cap) {
+        a->cap = a->cap ? a->cap * 2 : 1024;
+        a->ns = (double*)realloc(a->ns, a->cap * sizeof(double));
     }
+    a->ns[a->n++] = ns;
+    a->total += ns;
+    return 1;
+}
 
-    strcpy(novoBloco->nome, dirList[i]);
-    strcpy(novoBloco->data, obter_data_atual());
-    novoBloco->arq = arq;
-    novoBloco->tamanho = file_size;
-    novoBloco->filho = NULL;
-    novoBloco->prox = atual->filho;
-    novoBloco->posicao = arq->posicao;
-    atual->filho = novoBloco;
+int comparar_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
 
-    printf("Arquivo '%s' criado com sucesso.\n", dirList[i]);
-    free(dirList);
+double percentil(Amostras *a, double p) {
+    long i = (long)(p * (a->n - 1) + 0.5);
+    return a->ns[i];
 }
 
-void removed() {
-    if (argList[1] == NULL) {
-        printf("Erro: nome do diretório não fornecido.\n");
-        return;
+long bench_tamanho(long minimo, long maximo, int logaritmica) {
+    if (maximo <= minimo)
+        return minimo;
+    if (!logaritmica)
+        return minimo + (long)(bench_aleatorio() % (uint64_t)(maximo - minimo + 1));
+    /* Log-uniforme aproximada: sorteia a potência de dois e depois um valor dentro dela. */
+    int lo = 63 - __builtin_clzll((uint64_t)(minimo > 0 ? minimo : 1));
+    int hi = 63 - __builtin_clzll((uint64_t)maximo);
+    int e = lo + (int)(bench_aleatorio() % (uint64_t)(hi - lo + 1));
+    long t = (1L << e) + (long)(bench_aleatorio() % (uint64_t)(1L << e));
+    return t < minimo ? minimo : (t > maximo ? maximo : t);
+}
+
+/* Separa o parâmetro 'arg' (chave=valor) no lugar: 'arg' fica só com a chave e o valor é devolvido; NULL se falta '='. */
+char* parametro_valor(char *arg) {
+    char *igual = strchr(arg, '=');
+    if (igual == NULL) {
+        printf("Erro: parâmetro '%s' deve ser chave=valor.\n", arg);
+        return NULL;
     }
+    *igual = '\0';
+    return igual + 1;
+}
 
-    dirList = (char**)malloc(256 * sizeof(char*));
-    if (dirList == NULL) {
-        printf("Erro: falha na alocação de memória.\n");
+void bench() {
+    int prof = 3, ramos = 8, arquivos = 20, logaritmica = 1, prealocar = 1;
+    long tamMin = 1, tamMax = 65536, ops = 100000;
+    int pesos[NUM_OPS] = {5, 40, 30, 5, 10, 10};
+    const char *raizBench = "bench";
+    estadoBench = 1;
+
+    for (int i = 1; argList[i] != NULL; i++) {
+        char *chave = argList[i], *valor = parametro_valor(chave);
+        if (valor == NULL)
+            return;
+        int op;
+        for (op = 0; op < NUM_OPS && strcmp(chave, nomesOps[op]); op++)
+            ;
+        if (op < NUM_OPS)
+            pesos[op] = atoi(valor);
+        else if (!strcmp(chave, "prof"))
+            prof = atoi(valor);
+        else if (!strcmp(chave, "ramos"))
+            ramos = atoi(valor);
+        else if (!strcmp(chave, "arquivos"))
+            arquivos = atoi(valor);
+        else if (!strcmp(chave, "tam"))
+            sscanf(valor, "%ld-%ld", &tamMin, &tamMax);
+        else if (!strcmp(chave, "dist"))
+            logaritmica = strcmp(valor, "uniforme") != 0;
+        else if (!strcmp(chave, "criacao"))
+            prealocar = strcmp(valor, "esparsa") != 0;
+        else if (!strcmp(chave, "ops"))
+            ops = atol(valor);
+        else if (!strcmp(chave, "semente"))
+            estadoBench = strtoull(valor, NULL, 10) | 1;
+        else if (!strcmp(chave, "raiz"))
+            raizBench = valor;
+        else {
+            printf("Erro: parâmetro desconhecido '%s'.\n", chave);
+            return;
+        }
+    }
+    int somaPesos = 0;
+    for (int op = 0; op < NUM_OPS; op++)
+        somaPesos += pesos[op] > 0 ? pesos[op] : 0;
+    if (prof < 1 || ramos < 1 || arquivos < 0 || ops < 0 || somaPesos == 0 || tamMin < 0) {
+        printf("Erro: parâmetros de benchmark inválidos.\n");
         return;
     }
 
-    int count = 0;
-    char *token = strtok(argList[1], "/");
-    while (token) {
-        dirList[count++] = token;
-        token = strtok(NULL, "/");
-    }
-    dirList[count] = NULL;
+    Amostras amostras[NUM_OPS];
+    memset(amostras, 0, sizeof(amostras));
+    ListaCaminhos dirs = {0}, arqs = {0}, novosDirs = {0};
+    char caminho[MAX_CAMINHO], tam[32];
+    long contador = 0;
+    const char *opcaoCriacao = prealocar ? "--prealloc" : NULL;
 
-    Bloco* atual = raiz;
-    int i = 0;
+    fflush(stdout);
+    int saidaOriginal = dup(STDOUT_FILENO);
+    int nulo = open("/dev/null", O_WRONLY);
+    dup2(nulo, STDOUT_FILENO);
+    close(nulo);
+    int verbosoOriginal = verboso;
+    verboso = 0;
+    long operacoesAntes = diario.operacoes, confirmacoesAntes = diario.confirmacoes;
 
-    while (dirList[i + 1] != NULL) {
-        Bloco* current = atual->filho;
-        while (current != NULL) {
-            if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-                atual = current;
-                break;
+    struct timespec t0, t1, t2;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* Construção: diretórios em largura até 'prof' níveis, 'arquivos' arquivos em cada um. */
+    if (bench_executar(OP_CRIAD, &amostras[OP_CRIAD], raizBench, NULL, NULL))
+        lista_adicionar(&dirs, raizBench);
+    long nivelInicio = 0, nivelFim = dirs.n;
+    for (int nivel = 0; nivel < prof; nivel++) {
+        for (long d = nivelInicio; d < nivelFim; d++) {
+            for (int r = 0; r < ramos; r++) {
+                snprintf(caminho, sizeof(caminho), "%s/d%d", dirs.itens[d], r);
+                if (bench_executar(OP_CRIAD, &amostras[OP_CRIAD], caminho, NULL, NULL))
+                    lista_adicionar(&dirs, caminho);
             }
-            current = current->prox;
         }
-        if (current == NULL) {
-            printf("Erro: diretório '%s' não encontrado.\n", dirList[i]);
-            free(dirList);
-            return;
+        nivelInicio = nivelFim;
+        nivelFim = dirs.n;
+    }
+    for (long d = 0; d < nivelFim; d++) {
+        for (int f = 0; f < arquivos; f++) {
+            snprintf(caminho, sizeof(caminho), "%s/f%ld", dirs.itens[d], contador++);
+            snprintf(tam, sizeof(tam), "%ld", bench_tamanho(tamMin, tamMax, logaritmica));
+            if (bench_executar(OP_CRIAA, &amostras[OP_CRIAA], caminho, tam, opcaoCriacao))
+                lista_adicionar(&arqs, caminho);
         }
-        i++;
     }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    long arquivosIniciais = arqs.n, falhasConstrucao = amostras[OP_CRIAD].falhas + amostras[OP_CRIAA].falhas;
 
-    Bloco* alvo = NULL;
-    Bloco* current = atual->filho;
-    while (current != NULL) {
-        if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-            alvo = current;
+    /* Mistura: cada operação é sorteada pelos pesos. */
+    for (long i = 0; i < ops && dirs.n > 0; i++) {
+        int sorteio = (int)(bench_aleatorio() % (uint64_t)somaPesos), op = 0;
+        while (sorteio >= (pesos[op] > 0 ? pesos[op] : 0)) {
+            sorteio -= pesos[op] > 0 ? pesos[op] : 0;
+            op++;
+        }
+        const char *dir = dirs.itens[bench_aleatorio() % (uint64_t)dirs.n];
+        switch (op) {
+        case OP_CRIAD:
+            snprintf(caminho, sizeof(caminho), "%s/n%ld", dir, contador++);
+            if (bench_executar(op, &amostras[op], caminho, NULL, NULL))
+                lista_adicionar(&novosDirs, caminho);
+            break;
+        case OP_CRIAA:
+            snprintf(caminho, sizeof(caminho), "%s/f%ld", dir, contador++);
+            snprintf(tam, sizeof(tam), "%ld", bench_tamanho(tamMin, tamMax, logaritmica));
+            if (bench_executar(op, &amostras[op], caminho, tam, opcaoCriacao))
+                lista_adicionar(&arqs, caminho);
+            break;
+        case OP_REMOVEA:
+            if (arqs.n > 0) {
+                long k = (long)(bench_aleatorio() % (uint64_t)arqs.n);
+                bench_executar(op, &amostras[op], arqs.itens[k], NULL, NULL);
+                lista_remover(&arqs, k);
+            }
+            break;
+        case OP_REMOVED:
+            if (novosDirs.n > 0) {
+                long k = (long)(bench_aleatorio() % (uint64_t)novosDirs.n);
+                bench_executar(op, &amostras[op], novosDirs.itens[k], NULL, NULL);
+                lista_remover(&novosDirs, k);
+            }
+            break;
+        case OP_VERD:
+            bench_executar(op, &amostras[op], dir, NULL, NULL);
+            break;
+        case OP_VERSET:
+            if (arqs.n > 0)
+                bench_executar(op, &amostras[op], arqs.itens[bench_aleatorio() % (uint64_t)arqs.n], NULL, NULL);
             break;
         }
-        current = current->prox;
-    }
-    if (alvo == NULL) {
-        printf("Erro: diretório '%s' não encontrado.\n", dirList[i]);
-        free(dirList);
-        return;
     }
+    diario_forcar();
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    long operacoesMedidas = diario.operacoes - operacoesAntes, confirmacoesMedidas = diario.confirmacoes - confirmacoesAntes;
 
-    if (alvo->filho != NULL) {
-        printf("Erro: diretório '%s' não está vazio.\n", dirList[i]);
-        free(dirList);
+    /* Remoção da árvore, sem medir: arquivos, diretórios da mistura (sempre vazios) e a árvore do mais fundo à raiz. */
+    Amostras descarte = {0};
+    for (long k = 0; k < arqs.n; k++)
+        bench_executar(OP_REMOVEA, &descarte, arqs.itens[k], NULL, NULL);
+    for (long k = 0; k < novosDirs.n; k++)
+        bench_executar(OP_REMOVED, &descarte, novosDirs.itens[k], NULL, NULL);
+    for (long k = dirs.n - 1; k >= 0; k--)
+        bench_executar(OP_REMOVED, &descarte, dirs.itens[k], NULL, NULL);
+    free(descarte.ns);
+    diario_forcar();
+
+    fflush(stdout);
+    dup2(saidaOriginal, STDOUT_FILENO);
+    close(saidaOriginal);
+    verboso = verbosoOriginal;
+    if (dirs.n == 0) {
+        printf("Erro: não foi possível criar o diretório '%s'.\n", raizBench);
+        lista_liberar(&dirs);
         return;
     }
 
-    liberar_bloco(alvo->posicao);
-
-    if (atual->filho == alvo) {
-        atual->filho = alvo->prox;
-    } else {
-        Bloco* prev = atual->filho;
-        while (prev->prox != alvo) {
-            prev = prev->prox;
+    double construcao = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    double mistura = (t2.tv_sec - t1.tv_sec) + (t2.tv_nsec - t1.tv_nsec) / 1e9;
+    long totalOps = 0, totalFalhas = 0;
+    printf("Construção: %ld diretórios, %ld arquivos (%s) em %.3f s\n", dirs.n, arquivosIniciais,
+           prealocar ? "pré-alocados" : "esparsos", construcao);
+    if (falhasConstrucao > 0)
+        printf("Erro: %ld criação(ões) da construção falharam; a árvore ficou menor que a pedida.\n", falhasConstrucao);
+    long falhasMistura = -falhasConstrucao;
+    for (int op = 0; op < NUM_OPS; op++)
+        falhasMistura += amostras[op].falhas;
+    if (falhasMistura > 0)
+        printf("Mistura: %ld operações, %ld com falha, em %.3f s (%.0f ops/s sem as falhas)\n\n", ops, falhasMistura,
+               mistura, mistura > 0 ? (ops - falhasMistura) / mistura : 0.0);
+    else
+        printf("Mistura: %ld operações em %.3f s (%.0f ops/s)\n\n", ops, mistura, mistura > 0 ? ops / mistura : 0.0);
+    printf("%-8s %10s %8s %12s %10s %10s %10s\n", "operação", "qtd", "falhas", "ops/s", "p50(us)", "p99(us)",
+           "p999(us)");
+    for (int op = 0; op < NUM_OPS; op++) {
+        Amostras *a = &amostras[op];
+        totalOps += a->n;
+        totalFalhas += a->falhas;
+        if (a->n == 0) {
+            if (a->falhas > 0)
+                printf("%-8s %10ld %8ld\n", nomesOps[op], a->n, a->falhas);
+            continue;
         }
-        prev->prox = alvo->prox;
+        qsort(a->ns, a->n, sizeof(double), comparar_double);
+        printf("%-8s %10ld %8ld %12.0f %10.2f %10.2f %10.2f\n", nomesOps[op], a->n, a->falhas, a->n / (a->total / 1e9),
+               percentil(a, 0.50) / 1e3, percentil(a, 0.99) / 1e3, percentil(a, 0.999) / 1e3);
+        free(a->ns);
     }
-    free(alvo);
+    struct rusage uso;
+    getrusage(RUSAGE_SELF, &uso);
+    printf("\n%ld operações medidas, %ld falha(s); pico de RSS: %ld KiB\n", totalOps, totalFalhas, uso.ru_maxrss);
+    if (diarioAtivo)
+        printf("Diário: %ld operações em %ld fsync(s)\n", operacoesMedidas, confirmacoesMedidas);
 
-    printf("Diretório '%s' removido com sucesso.\n", dirList[i]);
-    free(dirList);
+    lista_liberar(&dirs);
+    lista_liberar(&arqs);
+    lista_liberar(&novosDirs);
 }
 
-void removea() {
-    if (argList[1] == NULL) {
-        printf("Erro: nome do arquivo não fornecido.\n");
-        return;
-    }
-
-    int count = 0;
-    dirList = (char**)malloc(256 * sizeof(char*));
-    char *token = strtok(argList[1], "/");
-    while (token) {
-        dirList[count++] = token;
-        token = strtok(NULL, "/");
-    }
-    dirList[count] = NULL;
-
-    Bloco* atual = raiz;
-    int i = 0;
+/*
+ * Comparação das políticas de alocação. Um traço de criações e remoções de
+ * arquivos (tamanhos em blocos sorteados como no bench) enche o disco até
+ * 'ocupacao'% do espaço livre e depois o mantém nesse nível, removendo um
+ * arquivo ao acaso sempre que uma criação passaria do alvo. O mesmo traço é
+ * repetido com cada política num bitmap à parte, do tamanho do disco atual,
+ * de duas formas: fracionada (como criaa, o arquivo pode ocupar várias
+ * sequências) e contígua (uma sequência por arquivo, ou falha). Só a parte
+ * do traço depois de o alvo ser atingido é medida.
+ *
+ * Parâmetros (chave=valor): ops, tam=MIN-MAX (blocos), dist=log|uniforme,
+ * ocupacao (%), semente. Sem tam=, o máximo padrão (256) é limitado ao alvo.
+ */
+typedef struct repeticao {
+    long alocacoes;
+    long falhas;
+    long extensoes;
+    double somaOcupacao;
+    long medidas;
+    Amostras latencias;
+} Repeticao;
 
-    while (dirList[i + 1] != NULL) {
-        Bloco* current = atual->filho;
-        while (current != NULL) {
-            if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-                atual = current;
+void alocacao_repetir(PoliticaAlocacao *p, int exato, long *traco, long numOps, long inicioMedicao, Repeticao *r) {
+    Extensao **exts = (Extensao**)calloc(numOps, sizeof(Extensao*));
+    int *numExts = (int*)calloc(numOps, sizeof(int));
+    long util = totalBlocos - blocosReservados;
+    politica_trocar(p);
+    for (long i = 0; i < numOps; i++) {
+        int medir = i >= inicioMedicao;
+        if (traco[i] < 0) {
+            long alvo = -traco[i] - 1;
+            for (int j = 0; j < numExts[alvo]; j++)
+                bitmap_devolver(exts[alvo][j].inicio, exts[alvo][j].tamanho);
+            free(exts[alvo]);
+            exts[alvo] = NULL;
+            numExts[alvo] = 0;
+            continue;
+        }
+        struct timespec t0, t1;
+        long restantes = traco[i], cap = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        while (restantes > 0) {
+            long inicio, obtido = p->alocar(restantes, exato, &inicio);
+            if (obtido == 0)
                 break;
+            if (numExts[i] == cap) {
+                cap = cap ? cap * 2 : 4;
+                exts[i] = (Extensao*)realloc(exts[i], cap * sizeof(Extensao));
             }
-            current = current->prox;
+            exts[i][numExts[i]].inicio = inicio;
+            exts[i][numExts[i]++].tamanho = obtido;
+            restantes -= obtido;
         }
-        if (current == NULL) {
-            printf("Erro: diretório '%s' não encontrado.\n", dirList[i]);
-            return;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (restantes > 0) {
+            for (int j = 0; j < numExts[i]; j++)
+                bitmap_devolver(exts[i][j].inicio, exts[i][j].tamanho);
+            numExts[i] = 0;
         }
-        i++;
+        if (!medir)
+            continue;
+        Amostras *a = &r->latencias;
+        double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+        if (a->n == a->cap) {
+            a->cap = a->cap ? a->cap * 2 : 1024;
+            a->ns = (double*)realloc(a->ns, a->cap * sizeof(double));
+        }
+        a->ns[a->n++] = ns;
+        a->total += ns;
+        r->alocacoes++;
+        if (restantes > 0)
+            r->falhas++;
+        r->extensoes += numExts[i];
+        r->somaOcupacao += 1.0 - (double)espacosLivres / util;
+        r->medidas++;
     }
+    for (long i = 0; i < numOps; i++)
+        free(exts[i]);
+    free(exts);
+    free(numExts);
+}
 
-    Bloco* alvo = NULL;
-    Bloco* current = atual->filho;
-    while (current != NULL) {
-        if (current->arq != NULL && strcmp(current->nome, dirList[i]) == 0) {
-            alvo = current;
-            break;
+void alocacao() {
+    long ops = 200000, tamMin = 1, tamMax = 256;
+    int ocupacao = 90, logaritmica = 1, tamInformado = 0;
+    estadoBench = 1;
+    for (int i = 1; argList[i] != NULL; i++) {
+        char *chave = argList[i], *valor = parametro_valor(chave);
+        if (valor == NULL)
+            return;
+        if (!strcmp(chave, "ops"))
+            ops = atol(valor);
+        else if (!strcmp(chave, "tam"))
+            tamInformado = sscanf(valor, "%ld-%ld", &tamMin, &tamMax) > 0;
+        else if (!strcmp(chave, "dist"))
+            logaritmica = strcmp(valor, "uniforme") != 0;
+        else if (!strcmp(chave, "ocupacao"))
+            ocupacao = atoi(valor);
+        else if (!strcmp(chave, "semente"))
+            estadoBench = strtoull(valor, NULL, 10) | 1;
+        else {
+            printf("Erro: parâmetro desconhecido '%s'.\n", chave);
+            return;
         }
-        current = current->prox;
     }
-    if (alvo == NULL) {
-        printf("Erro: arquivo '%s' não encontrado.\n", dirList[i]);
+    long util = totalBlocos - blocosReservados;
+    long alvo = util * ocupacao / 100;
+    if (!tamInformado && tamMax > alvo)
+        tamMax = alvo;
+    if (ops <= 0 || tamMin < 1 || tamMax < tamMin || ocupacao < 1 || ocupacao > 100 || tamMax > alvo) {
+        printf("Erro: parâmetros inválidos.\n");
         return;
     }
 
-    Arquivo* arq = alvo->arq;
-    while (arq != NULL) {
-        Arquivo* prox_arq = arq->prox;
-        liberar_bloco(arq->posicao);
-        free(arq);
-        arq = prox_arq;
+    /* Traço: tamanho > 0 cria um arquivo; -(k + 1) remove o arquivo criado na operação k. */
+    long *traco = (long*)malloc(ops * sizeof(long));
+    long *vivos = (long*)malloc(ops * sizeof(long));
+    if (traco == NULL || vivos == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
+        free(traco);
+        free(vivos);
+        return;
+    }
+    long numVivos = 0, ocupado = 0, inicioMedicao = ops, criacoes = 0;
+    for (long i = 0; i < ops; i++) {
+        long tam = bench_tamanho(tamMin, tamMax, logaritmica);
+        if (ocupado + tam > alvo && numVivos > 0) {
+            if (inicioMedicao == ops)
+                inicioMedicao = i;
+            long k = (long)(bench_aleatorio() % (uint64_t)numVivos);
+            traco[i] = -vivos[k] - 1;
+            ocupado -= traco[vivos[k]];
+            vivos[k] = vivos[--numVivos];
+            continue;
+        }
+        traco[i] = tam;
+        vivos[numVivos++] = i;
+        ocupado += tam;
+        criacoes++;
     }
+    free(vivos);
+    if (inicioMedicao == ops)
+        inicioMedicao = 0;
 
-    Bloco* prev = atual->filho;
-    if (prev == alvo) {
-        atual->filho = alvo->prox;
-    } else {
-        while (prev->prox != alvo) {
-            prev = prev->prox;
+    /* O traço roda num bitmap à parte, sem diário, mensagens nem buffers; o do volume volta no fim. */
+    uint64_t *livresVolume = blocosLivres, *resumoVolume = resumoLivres;
+    long espacosVolume = espacosLivres, dicaVolume = dicaResumo, localVolume = palavraLocal;
+    int diarioVolume = diarioAtivo, verbosoVolume = verboso;
+    PoliticaAlocacao *politicaVolume = politica;
+    if (politica->encerrar != NULL)
+        politica->encerrar();
+    politica = &politicas[0];
+    blocosLivres = (uint64_t*)calloc(numPalavras, sizeof(uint64_t));
+    resumoLivres = (uint64_t*)calloc(numResumo, sizeof(uint64_t));
+    diarioAtivo = 0;
+    verboso = 0;
+    palavraLocal = -1;
+
+    printf("Traço: %ld operações (%ld criações de %ld a %ld blocos), alvo de %d%% de %ld blocos; medição a partir da operação %ld\n",
+           ops, criacoes, tamMin, tamMax, ocupacao, util, inicioMedicao);
+    for (int exato = 0; exato < 2 && blocosLivres != NULL && resumoLivres != NULL; exato++) {
+        printf("\nAlocação %s:\n", exato ? "contígua (uma sequência por arquivo)" : "fracionada (como criaa)");
+        printf("%-10s %10s %10s %10s %8s %8s %8s %10s %10s\n", "política", "aloc/s", "p50(ns)", "p99(ns)",
+               "falhas", "ext/arq", "ocupação", "frag.livre", "maior");
+        for (PoliticaAlocacao *p = politicas; p->nome != NULL; p++) {
+            Repeticao r;
+            memset(&r, 0, sizeof(r));
+            formatar_bitmap();
+            cursorProximo = 0;
+            alocacao_repetir(p, exato, traco, ops, inicioMedicao, &r);
+
+            long livres = 0, maior = 0, ini, n;
+            for (long de = 0; (n = corrida_livre(de, totalBlocos, &ini)) > 0; de = ini + n) {
+                livres += n;
+                if (n > maior)
+                    maior = n;
+            }
+            Amostras *a = &r.latencias;
+            if (a->n > 0)
+                qsort(a->ns, a->n, sizeof(double), comparar_double);
+            long ok = r.alocacoes - r.falhas;
+            printf("%-10s %10.0f %10.0f %10.0f %7.2f%% %8.2f %7.1f%% %9.1f%% %10ld\n", p->nome,
+                   a->total > 0 ? a->n / (a->total / 1e9) : 0.0, a->n ? percentil(a, 0.50) : 0.0,
+                   a->n ? percentil(a, 0.99) : 0.0, r.alocacoes ? 100.0 * r.falhas / r.alocacoes : 0.0,
+                   ok ? (double)r.extensoes / ok : 0.0, r.medidas ? 100.0 * r.somaOcupacao / r.medidas : 0.0,
+                   livres ? 100.0 * (1.0 - (double)maior / livres) : 0.0, maior);
+            free(a->ns);
         }
-        prev->prox = alvo->prox;
     }
-    free(alvo);
 
-    printf("Arquivo '%s' removido com sucesso.\n", dirList[i]);
+    politica_trocar(&politicas[0]);
+    free(blocosLivres);
+    free(resumoLivres);
+    free(traco);
+    blocosLivres = livresVolume;
+    resumoLivres = resumoVolume;
+    espacosLivres = espacosVolume;
+    dicaResumo = dicaVolume;
+    palavraLocal = localVolume;
+    diarioAtivo = diarioVolume;
+    verboso = verbosoVolume;
+    politica_trocar(politicaVolume);
 }
 
-void verd() {
-    int not_found = 0;
-    int total_files = 0;
-    int total_dirs = 0;
-    int file_size = 0;
-    int free_space = espacosLivres * 512;
-    Bloco* atual = raiz;
+/*
+ * Teste de estresse: 'threads' trabalhadores executam ao mesmo tempo uma
+ * mistura de comandos por executar_comando, como a linha de comando faria,
+ * cada um na sua subárvore (raiz/t<i>) e num diretório comum a todos
+ * (raiz/comum). Cada trabalhador registra o que criou; no fim a árvore é
+ * conferida contra esses registros, contra o bitmap e contra os pools.
+ * Depois tudo é removido e a conferência se repete: o volume tem de voltar
+ * exatamente ao estado de antes do teste.
+ *
+ * Parâmetros (chave=valor): threads, ops (por thread), tam=MIN-MAX,
+ * semente, raiz.
+ */
+typedef struct trabalhador {
+    pthread_t thread;
+    int id;
+    long ops;
+    long tamMin, tamMax;
+    uint64_t semente;
+    long primeiraPalavra;
+    const char *raiz;
+    ListaCaminhos arquivos;
+    ListaCaminhos dirs;
+    long contador;
+} Trabalhador;
 
-    if (argList[1] != NULL) {
-        dirList = (char**)malloc(256 * sizeof(char*));
-        if (dirList == NULL) {
-            printf("Erro: falha na alocação de memória.\n");
-            return;
-        }
+typedef struct contagem {
+    long dirs;
+    long arquivos;
+    long blocos;
+    long erros;
+} Contagem;
 
-        int count = 0;
-        char *token = strtok(argList[1], "/");
-        while (token) {
-            dirList[count++] = token;
-            token = strtok(NULL, "/");
-        }
-        dirList[count] = NULL;
+#define MAX_ERROS_ESTRESSE 10
 
-        int i = 0;
+/* Com dedup, quantas vezes cada bloco apareceu além da primeira; tem de bater com refsBlocos. */
+uint32_t *repetidosEstresse;
 
-        while (dirList[i] != NULL) {
-            Bloco* current = atual->filho;
-            while (current != NULL) {
-                if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-                    atual = current;
-                    break;
-                }
-                current = current->prox;
+/* Executa um comando pela tabela, com cópias modificáveis dos argumentos (os que não forem NULL). */
+void estresse_executar(const char *cmd, const char *a1, const char *a2, const char *a3) {
+    char buf[3][MAX_CAMINHO];
+    char *args[5] = {(char*)cmd, NULL, NULL, NULL, NULL};
+    const char *originais[3] = {a1, a2, a3};
+    for (int i = 0; i < 3 && originais[i] != NULL; i++) {
+        snprintf(buf[i], sizeof(buf[i]), "%s", originais[i]);
+        args[i + 1] = buf[i];
+    }
+    executar_comando(comando_buscar(cmd), args);
+}
+
+int estresse_existe(const char *caminho, int ehDir) {
+    char buf[MAX_CAMINHO], *nome;
+    snprintf(buf, sizeof(buf), "%s", caminho);
+    pthread_rwlock_rdlock(&travaVolume);
+    Bloco *pai = resolver_pai(buf, &nome, 0);
+    int existe = 0;
+    if (pai != NULL) {
+        existe = dir_buscar(pai, nome, ehDir) != NULL;
+        dir_destravar(pai);
+    }
+    pthread_rwlock_unlock(&travaVolume);
+    return existe;
+}
+
+void* estresse_trabalhar(void *arg) {
+    Trabalhador *t = (Trabalhador*)arg;
+    char proprio[MAX_CAMINHO / 2], comum[MAX_CAMINHO / 2], caminho[MAX_CAMINHO], numero[32], texto[32];
+    snprintf(proprio, sizeof(proprio), "%s/t%d", t->raiz, t->id);
+    snprintf(comum, sizeof(comum), "%s/comum", t->raiz);
+    snprintf(texto, sizeof(texto), "t%d", t->id);
+    estadoBench = t->semente;
+    palavraLocal = t->primeiraPalavra;
+
+    for (long i = 0; i < t->ops; i++) {
+        int sorteio = (int)(bench_aleatorio() % 100);
+        ListaCaminhos *arqs = &t->arquivos;
+        const char *arquivo = arqs->n > 0 ? arqs->itens[bench_aleatorio() % (uint64_t)arqs->n] : NULL;
+        if (sorteio < 35) {
+            /* Metade no próprio diretório, um quarto no comum e um quarto num subdiretório próprio. */
+            int onde = (int)(bench_aleatorio() % 4);
+            const char *dir = proprio;
+            if (onde == 0)
+                dir = comum;
+            else if (onde == 1 && t->dirs.n > 0)
+                dir = t->dirs.itens[bench_aleatorio() % (uint64_t)t->dirs.n];
+            snprintf(caminho, sizeof(caminho), "%s/f%d_%ld", dir, t->id, t->contador++);
+            snprintf(numero, sizeof(numero), "%ld", bench_tamanho(t->tamMin, t->tamMax, 1));
+            /* Metade dos arquivos nasce esparsa, para a escrita também alocar blocos. */
+            estresse_executar("criaa", caminho, numero, bench_aleatorio() % 2 ? "--prealloc" : NULL);
+            if (estresse_existe(caminho, 0))
+                lista_adicionar(arqs, caminho);
+        } else if (sorteio < 65) {
+            if (arqs->n > 0) {
+                long k = (long)(bench_aleatorio() % (uint64_t)arqs->n);
+                estresse_executar("removea", arqs->itens[k], NULL, NULL);
+                lista_remover(arqs, k);
             }
-            if (current == NULL) {
-                printf("Erro: diretório '%s' não encontrado.\n", dirList[i]);
-                free(dirList);
-                return;
+        } else if (sorteio < 70) {
+            snprintf(caminho, sizeof(caminho), "%s/d%ld", proprio, t->contador++);
+            estresse_executar("criad", caminho, NULL, NULL);
+            if (estresse_existe(caminho, 1))
+                lista_adicionar(&t->dirs, caminho);
+        } else if (sorteio < 75) {
+            if (t->dirs.n > 0) {
+                long k = (long)(bench_aleatorio() % (uint64_t)t->dirs.n);
+                estresse_executar("removed", t->dirs.itens[k], NULL, NULL);
+                if (!estresse_existe(t->dirs.itens[k], 1))
+                    lista_remover(&t->dirs, k);
+            }
+        } else if (sorteio < 77) {
+            estresse_executar("verd", bench_aleatorio() % 4 == 0 ? comum : proprio, NULL, NULL);
+        } else if (arquivo == NULL) {
+            continue;
+        } else if (sorteio < 87) {
+            estresse_executar("verset", arquivo, NULL, NULL);
+        } else if (sorteio < 94) {
+            estresse_executar("escreve", arquivo, "0", texto);
+        } else if (sorteio < 98) {
+            estresse_executar("le", arquivo, "0", "16");
+        } else {
+            /* Leva o arquivo para o comum ou de volta para o próprio diretório, com um nome novo. */
+            snprintf(caminho, sizeof(caminho), "%s/f%d_%ld", bench_aleatorio() % 2 ? comum : proprio, t->id,
+                     t->contador++);
+            long k = (long)(bench_aleatorio() % (uint64_t)arqs->n);
+            estresse_executar("move", arqs->itens[k], caminho, NULL);
+            if (estresse_existe(caminho, 0)) {
+                lista_remover(arqs, k);
+                lista_adicionar(arqs, caminho);
             }
-            i++;
         }
-
-        free(dirList);
     }
+    return NULL;
+}
 
-    atual = atual->filho;
-    if (atual == NULL) {
-        printf("Nenhum arquivo ou diretório encontrado.\n");
-    } else {
-        while (atual != NULL) {
-            if (atual->arq == NULL) {
-                printf("%s    <DIR>    %s\n", atual->data, atual->nome);
-                total_dirs++;
-            } else {
-                printf("%s    %d    %s\n", atual->data, atual->tamanho, atual->nome);
-                total_files++;
-                file_size += atual->tamanho;
-            }
-            atual = atual->prox;
+void estresse_marcar(long inicio, long n, uint64_t *usados, Contagem *c) {
+    for (long i = inicio; i < inicio + n; i++) {
+        uint64_t bit = (uint64_t)1 << (i & 63);
+        if (repetidosEstresse != NULL && (usados[i >> 6] & bit) && refsBlocos[i] > 0) {
+            repetidosEstresse[i]++;
+            continue;
+        }
+        if (i < blocosReservados || i >= totalBlocos || bloco_livre(i) || (usados[i >> 6] & bit)) {
+            if (c->erros++ < MAX_ERROS_ESTRESSE)
+                printf("  bloco %ld: livre no bitmap, reservado ou usado duas vezes\n", i);
+            continue;
         }
-        printf("\n%d arquivo(s)     %d bytes ocupados\n", total_files, file_size);
-        printf("%d diretório(s)   %d bytes disponíveis\n", total_dirs, free_space);
+        usados[i >> 6] |= bit;
+        c->blocos++;
     }
 }
 
-void verset() {
-    if (argList[1] == NULL) {
-        printf("Erro: nome do arquivo não fornecido.\n");
+/* Um Uso diverge do agregado mantido? Imprime a diferença. */
+void estresse_conferir_uso(Bloco *d, const char *qual, Uso *contado, Uso *mantido, Contagem *c) {
+    if (memcmp(contado, mantido, sizeof(Uso)) == 0)
         return;
+    if (c->erros++ < MAX_ERROS_ESTRESSE)
+        printf("  agregado %s de '%s': %ld/%ld/%ld/%ld contados, %ld/%ld/%ld/%ld mantidos\n", qual, d->nome,
+               (long)contado->arquivos, (long)contado->diretorios, (long)contado->bytes, (long)contado->blocos,
+               (long)mantido->arquivos, (long)mantido->diretorios, (long)mantido->bytes, (long)mantido->blocos);
+}
+
+/*
+ * Confere o diretório 'd' e a subárvore abaixo dele: índice contra lista de
+ * filhos, blocos de cada entrada e agregados. Devolve o uso da subárvore.
+ */
+Uso estresse_conferir_dir(Bloco *d, uint64_t *usados, Contagem *c) {
+    dir_carregar(d);
+    unsigned filhos = 0;
+    Uso direto = {0, 0, 0, 0};
+    Uso total = {0, 0, 0, 0};
+    for (Bloco *b = d->filho; b != NULL; b = b->prox) {
+        filhos++;
+        if (dir_buscar(d, b->nome, b->arq == NULL) != b && c->erros++ < MAX_ERROS_ESTRESSE)
+            printf("  '%s' está na lista de '%s' mas não no índice\n", b->nome, d->nome);
+        if (b->arq == NULL) {
+            c->dirs++;
+            estresse_marcar(b->dir->attr.posicao, 1, usados, c);
+            Uso sub = estresse_conferir_dir(b, usados, c);
+            direto.diretorios++;
+            direto.blocos++;
+            total.arquivos += sub.arquivos;
+            total.diretorios += sub.diretorios;
+            total.bytes += sub.bytes;
+            total.blocos += sub.blocos;
+            continue;
+        }
+        c->arquivos++;
+        direto.arquivos++;
+        direto.bytes += b->arq->tamanho;
+        direto.blocos += arquivo_blocos(b->arq);
+        for (int j = 0; j < b->arq->numExt; j++)
+            if (b->arq->ext[j].inicio != BURACO)
+                estresse_marcar(b->arq->ext[j].inicio, b->arq->ext[j].tamanho, usados, c);
+        /* Um bloco de caudas tem vários donos; conta uma vez. */
+        long cauda = b->arq->cauda;
+        if (b->arq->caudaFatias > 0 && !((usados[cauda >> 6] >> (cauda & 63)) & 1))
+            estresse_marcar(cauda, 1, usados, c);
+        if (mapaVolume != NULL && b->arq->attr.ino >= 0) {
+            for (int64_t ind = inodes[b->arq->attr.ino].extIndireto; ind >= 0;) {
+                estresse_marcar(ind, 1, usados, c);
+                ind = ((BlocoExtensoes*)(mapaVolume + ind * tamBloco))->prox;
+            }
+        }
     }
+    if (filhos != d->dir->numFilhos && c->erros++ < MAX_ERROS_ESTRESSE)
+        printf("  '%s' tem %u filhos na lista e %u no contador\n", d->nome, filhos, d->dir->numFilhos);
+    total.arquivos += direto.arquivos;
+    total.diretorios += direto.diretorios;
+    total.bytes += direto.bytes;
+    total.blocos += direto.blocos;
+    estresse_conferir_uso(d, "direto", &direto, &d->dir->agregados->direto, c);
+    estresse_conferir_uso(d, "total", &total, &d->dir->agregados->total, c);
+    return total;
+}
 
-    dirList = (char**)malloc(256 * sizeof(char*));
-    if (dirList == NULL) {
+/*
+ * Confere os invariantes com o volume parado: cada bloco em uso pertence a
+ * exatamente uma entrada e está ocupado no bitmap, o contador de livres e o
+ * resumo batem com o bitmap, os pools têm um objeto por entrada, e tudo o que
+ * os trabalhadores registraram existe. Devolve o número de violações.
+ */
+long estresse_verificar(Trabalhador *t, int n, Contagem *c) {
+    memset(c, 0, sizeof(Contagem));
+    uint64_t *usados = (uint64_t*)calloc(numPalavras, sizeof(uint64_t));
+    repetidosEstresse = refsBlocos != NULL ? (uint32_t*)calloc(totalBlocos, sizeof(uint32_t)) : NULL;
+    if (usados == NULL || (refsBlocos != NULL && repetidosEstresse == NULL)) {
         printf("Erro: falha na alocação de memória.\n");
-        return;
+        free(usados);
+        return 1;
+    }
+    estresse_conferir_dir(raiz, usados, c);
+    free(usados);
+    if (repetidosEstresse != NULL) {
+        for (long i = 0; i < totalBlocos; i++)
+            if (repetidosEstresse[i] != refsBlocos[i] && c->erros++ < MAX_ERROS_ESTRESSE)
+                printf("  bloco %ld aparece %u vez(es) além da primeira, contador diz %u\n", i,
+                       repetidosEstresse[i], refsBlocos[i]);
+        free(repetidosEstresse);
+        repetidosEstresse = NULL;
     }
 
-    int count = 0;
-    char *token = strtok(argList[1], "/");
-    while (token) {
-        dirList[count++] = token;
-        token = strtok(NULL, "/");
+    long livres = 0;
+    for (long w = 0; w < numPalavras; w++) {
+        livres += __builtin_popcountll(blocosLivres[w]);
+        if (blocosLivres[w] != 0 && !((resumoLivres[w >> 6] >> (w & 63)) & 1) && c->erros++ < MAX_ERROS_ESTRESSE)
+            printf("  palavra %ld do bitmap tem blocos livres mas não está no resumo\n", w);
     }
-    dirList[count] = NULL;
+    if (livres != espacosLivres && c->erros++ < MAX_ERROS_ESTRESSE)
+        printf("  bitmap tem %ld blocos livres, contador diz %ld\n", livres, espacosLivres);
+    if (totalBlocos - blocosReservados - livres != c->blocos && c->erros++ < MAX_ERROS_ESTRESSE)
+        printf("  %ld blocos ocupados no bitmap, %ld pertencem a alguma entrada\n",
+               totalBlocos - blocosReservados - livres, c->blocos);
+    if (indice.montado && indice.emUso != c->dirs + c->arquivos && c->erros++ < MAX_ERROS_ESTRESSE)
+        printf("  índice de nomes com %d entrada(s) para %ld diretórios e %ld arquivos\n", indice.emUso, c->dirs,
+               c->arquivos);
+    if ((poolBlocos.emUso != c->dirs + c->arquivos + 1 || poolDiretorios.emUso != c->dirs + 1
+         || poolArquivos.emUso != c->arquivos) && c->erros++ < MAX_ERROS_ESTRESSE)
+        printf("  pools com %ld blocos, %ld diretórios e %ld arquivos em uso para %ld diretórios e %ld arquivos\n",
+               poolBlocos.emUso, poolDiretorios.emUso, poolArquivos.emUso, c->dirs + 1, c->arquivos);
 
-    Bloco* atual = raiz;
-    int i = 0;
+    for (int i = 0; i < n; i++) {
+        for (long k = 0; k < t[i].arquivos.n; k++)
+            if (!estresse_existe(t[i].arquivos.itens[k], 0) && c->erros++ < MAX_ERROS_ESTRESSE)
+                printf("  arquivo '%s' criado pela thread %d sumiu\n", t[i].arquivos.itens[k], i);
+        for (long k = 0; k < t[i].dirs.n; k++)
+            if (!estresse_existe(t[i].dirs.itens[k], 1) && c->erros++ < MAX_ERROS_ESTRESSE)
+                printf("  diretório '%s' criado pela thread %d sumiu\n", t[i].dirs.itens[k], i);
+    }
+    return c->erros;
+}
 
-    while (dirList[i + 1] != NULL) {
-        Bloco* current = atual->filho;
-        while (current != NULL) {
-            if (current->arq == NULL && strcmp(current->nome, dirList[i]) == 0) {
-                atual = current;
-                break;
-            }
-            current = current->prox;
-        }
-        if (current == NULL) {
-            printf("Erro: diretório '%s' não encontrado.\n", dirList[i]);
-            free(dirList);
+void estresse() {
+    int threads = 4;
+    long ops = 20000, tamMin = 1, tamMax = 4096;
+    uint64_t semente = 1;
+    const char *raizEstresse = "estresse";
+
+    for (int i = 1; argList[i] != NULL; i++) {
+        char *chave = argList[i], *valor = parametro_valor(chave);
+        if (valor == NULL)
+            return;
+        if (!strcmp(chave, "threads"))
+            threads = atoi(valor);
+        else if (!strcmp(chave, "ops"))
+            ops = atol(valor);
+        else if (!strcmp(chave, "tam"))
+            sscanf(valor, "%ld-%ld", &tamMin, &tamMax);
+        else if (!strcmp(chave, "semente"))
+            semente = strtoull(valor, NULL, 10);
+        else if (!strcmp(chave, "raiz"))
+            raizEstresse = valor;
+        else {
+            printf("Erro: parâmetro desconhecido '%s'.\n", chave);
             return;
         }
-        i++;
+    }
+    if (threads < 1 || threads > 256 || ops < 0 || tamMin < 0 || tamMax < tamMin) {
+        printf("Erro: parâmetros de estresse inválidos.\n");
+        return;
+    }
+    if (numInstantaneos > 0) {
+        printf("Erro: apague os instantâneos antes de rodar o estresse.\n");
+        return;
+    }
+    if (estresse_existe(raizEstresse, 1)) {
+        printf("Erro: diretório '%s' já existe.\n", raizEstresse);
+        return;
     }
 
-    Bloco* alvo = NULL;
-    Bloco* current = atual->filho;
-    while (current != NULL) {
-        if (current->arq != NULL && strcmp(current->nome, dirList[i]) == 0) {
-            alvo = current;
-            break;
-        }
-        current = current->prox;
+    Contagem antes, c;
+    if (estresse_verificar(NULL, 0, &antes) > 0) {
+        printf("Erro: volume inconsistente antes do teste.\n");
+        return;
     }
-    if (alvo == NULL) {
-        printf("Erro: arquivo '%s' não encontrado.\n", dirList[i]);
-        free(dirList);
+    long livresAntes = espacosLivres;
+    Trabalhador *t = (Trabalhador*)calloc(threads, sizeof(Trabalhador));
+    if (t == NULL) {
+        printf("Erro: falha na alocação de memória.\n");
         return;
     }
 
-    printf("Setores ocupados pelo arquivo '%s': ", dirList[i]);
-    Arquivo* temp = alvo->arq;
-    while (temp != NULL) {
-        printf("%d ", temp->posicao);
-        temp = temp->prox;
+    fflush(stdout);
+    int saidaOriginal = dup(STDOUT_FILENO);
+    int nulo = open("/dev/null", O_WRONLY);
+    dup2(nulo, STDOUT_FILENO);
+    int verbosoOriginal = verboso;
+    verboso = 0;
+
+    char caminho[MAX_CAMINHO];
+    estresse_executar("criad", raizEstresse, NULL, NULL);
+    snprintf(caminho, sizeof(caminho), "%s/comum", raizEstresse);
+    estresse_executar("criad", caminho, NULL, NULL);
+    for (int i = 0; i < threads; i++) {
+        snprintf(caminho, sizeof(caminho), "%s/t%d", raizEstresse, i);
+        estresse_executar("criad", caminho, NULL, NULL);
+        t[i].id = i;
+        t[i].ops = ops;
+        t[i].tamMin = tamMin;
+        t[i].tamMax = tamMax;
+        t[i].semente = (semente + (uint64_t)i * 0x9e3779b97f4a7c15ull) | 1;
+        t[i].primeiraPalavra = numPalavras * i / threads;
+        t[i].raiz = raizEstresse;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int iniciadas = 0;
+    while (iniciadas < threads && pthread_create(&t[iniciadas].thread, NULL, estresse_trabalhar, &t[iniciadas]) == 0)
+        iniciadas++;
+    for (int i = 0; i < iniciadas; i++)
+        pthread_join(t[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    fflush(stdout);
+    dup2(saidaOriginal, STDOUT_FILENO);
+    verboso = verbosoOriginal;
+
+    double seg = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    long totalOps = iniciadas * ops;
+    printf("%d thread(s), %ld operações em %.3f s (%.0f ops/s)\n", iniciadas, totalOps, seg,
+           seg > 0 ? totalOps / seg : 0.0);
+    if (iniciadas < threads)
+        printf("Erro: só %d de %d threads puderam ser criadas.\n", iniciadas, threads);
+
+    long erros = estresse_verificar(t, threads, &c);
+    long esperadosArq = antes.arquivos, esperadosDir = antes.dirs + threads + 2;
+    for (int i = 0; i < threads; i++) {
+        esperadosArq += t[i].arquivos.n;
+        esperadosDir += t[i].dirs.n;
+    }
+    if ((c.arquivos != esperadosArq || c.dirs != esperadosDir) && erros++ < MAX_ERROS_ESTRESSE)
+        printf("  árvore tem %ld diretórios e %ld arquivos, registros dizem %ld e %ld\n", c.dirs, c.arquivos,
+               esperadosDir, esperadosArq);
+    printf("Depois da execução: %ld diretório(s), %ld arquivo(s), %ld bloco(s) em uso: %s\n", c.dirs, c.arquivos,
+           c.blocos, erros ? "FALHOU" : "ok");
+
+    /* Limpeza, na ordem inversa: arquivos, subdiretórios, diretórios dos trabalhadores, comum e a raiz. */
+    fflush(stdout);
+    dup2(nulo, STDOUT_FILENO);
+    verboso = 0;
+    for (int i = 0; i < threads; i++) {
+        for (long k = 0; k < t[i].arquivos.n; k++)
+            estresse_executar("removea", t[i].arquivos.itens[k], NULL, NULL);
+        for (long k = 0; k < t[i].dirs.n; k++)
+            estresse_executar("removed", t[i].dirs.itens[k], NULL, NULL);
+        snprintf(caminho, sizeof(caminho), "%s/t%d", raizEstresse, i);
+        estresse_executar("removed", caminho, NULL, NULL);
+        lista_liberar(&t[i].arquivos);
+        lista_liberar(&t[i].dirs);
     }
-    printf("\n");
+    snprintf(caminho, sizeof(caminho), "%s/comum", raizEstresse);
+    estresse_executar("removed", caminho, NULL, NULL);
+    estresse_executar("removed", raizEstresse, NULL, NULL);
+    fflush(stdout);
+    dup2(saidaOriginal, STDOUT_FILENO);
+    close(saidaOriginal);
+    close(nulo);
+    verboso = verbosoOriginal;
+    free(t);
 
-    free(dirList);
+    long errosLimpeza = estresse_verificar(NULL, 0, &c);
+    if ((c.arquivos != antes.arquivos || c.dirs != antes.dirs || espacosLivres != livresAntes)
+        && errosLimpeza++ < MAX_ERROS_ESTRESSE)
+        printf("  volume não voltou ao estado anterior: %ld diretórios, %ld arquivos, %ld livres (antes %ld, %ld, %ld)\n",
+               c.dirs, c.arquivos, espacosLivres, antes.dirs, antes.arquivos, livresAntes);
+    printf("Depois da limpeza: %ld bloco(s) livre(s): %s\n", espacosLivres, errosLimpeza ? "FALHOU" : "ok");
 }